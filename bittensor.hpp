@@ -0,0 +1,370 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <xtensor/xarray.hpp>
+#include <xtensor/xexpression.hpp>
+
+#include "xnordot.hpp"
+#include "xnorgemm.hpp"
+#include "threadpool.hpp"
+
+// N-dimensional tensors of packed sign bits. The innermost axis is packed LSB-first into 64-bit
+// words and every innermost row starts on a padded row stride, all in one aligned allocation.
+// Views address bits, not bytes, so a slice may start in the middle of a byte: a conv patch, a
+// channel group or a sub-matrix is a view over the packed data, never a copy.
+
+namespace bits{
+    /// `count` <= 64 bits starting at bit `bit` of p, in the low bits of the result. Only words
+    /// holding at least one of the bits are read.
+    inline std::uint64_t extract(const std::uint64_t* p, std::size_t bit, std::size_t count){
+        const auto word = bit / 64, shift = bit % 64;
+        auto value = p[word] >> shift;
+        if(shift + count > 64)
+            value |= p[word + 1] << (64 - shift);
+        return count == 64 ? value : value & ((std::uint64_t(1) << count) - 1);
+    }
+
+    /// Copies `count` bits starting at bit `bit` of src to dst starting at bit 0, zeroing the rest
+    /// of the last word written
+    inline void copy(const std::uint64_t* src, std::size_t bit, std::size_t count, std::uint64_t* dst){
+        if(bit % 64 == 0){
+            std::memcpy(dst, src + bit / 64, (count / 64) * sizeof(std::uint64_t));
+            if(count % 64)
+                dst[count / 64] = extract(src, bit + count / 64 * 64, count % 64);
+            return;
+        }
+        // With a nonzero shift every whole output word spans two source words, both of which hold
+        // some of the bits, so the funnel shift never reads past the run
+        const auto p = src + bit / 64;
+        const auto shift = bit % 64;
+        for(std::size_t w = 0; w < count / 64; w++)
+            dst[w] = (p[w] >> shift) | (p[w + 1] << (64 - shift));
+        if(count % 64)
+            dst[count / 64] = extract(src, bit + count / 64 * 64, count % 64);
+    }
+
+    /// Mismatching bits between `count` bits of x from bit xbit and of y from bit ybit.
+    /// Byte-aligned runs go straight to the dispatched popcount; the others are shifted into
+    /// L1 buffers a block at a time first.
+    inline std::uint64_t popcnt_xor(const std::uint64_t* x, std::size_t xbit,
+                                    const std::uint64_t* y, std::size_t ybit, std::size_t count){
+        const auto& k = dispatch();
+        if(xbit % NUM_BITS == 0 && ybit % NUM_BITS == 0){
+            auto bx = (const std::uint8_t*) x + xbit / NUM_BITS;
+            auto by = (const std::uint8_t*) y + ybit / NUM_BITS;
+            auto mismatches = k.popcnt_xor(bx, by, count / NUM_BITS);
+            if(count % NUM_BITS)
+                mismatches += lookup8bit[(bx[count / NUM_BITS] ^ by[count / NUM_BITS]) & mask[count % NUM_BITS]];
+            return mismatches;
+        }
+        static constexpr std::size_t BLOCK_WORDS = 64;
+        std::uint64_t sx[BLOCK_WORDS], sy[BLOCK_WORDS];
+        std::uint64_t mismatches = 0;
+        for(std::size_t b = 0; b < count; b += BLOCK_WORDS * 64){
+            const auto n = std::min(BLOCK_WORDS * 64, count - b);
+            copy(x, xbit + b, n, sx);
+            copy(y, ybit + b, n, sy);
+            mismatches += k.popcnt_xor((const std::uint8_t*) sx, (const std::uint8_t*) sy, (n + 63) / 64 * 8);
+        }
+        return mismatches;
+    }
+} // bits
+
+/// Non-owning view of packed sign bits: a bit offset into 64-bit words plus a shape and strides in
+/// bits. The innermost axis always has a stride of one bit, so innermost rows are contiguous runs.
+/// \tparam W - std::uint64_t for a mutable view, const std::uint64_t for a read-only one
+template <class W>
+class basic_bit_view
+{
+public:
+    using word_type = W;
+    using shape_type = std::vector<std::size_t>;
+
+    basic_bit_view() = default;
+
+    basic_bit_view(W* words, std::size_t offset, shape_type shape, shape_type strides)
+        : m_words(words), m_offset(offset), m_shape(std::move(shape)), m_strides(std::move(strides)) {}
+
+    /// A read-only view of the same bits
+    template <class V = W, std::enable_if_t<!std::is_const<V>::value, int> = 0>
+    operator basic_bit_view<const V>() const { return {m_words, m_offset, m_shape, m_strides}; }
+
+    W* words() const { return m_words; }
+    /// Position of the first element, in bits from words()
+    std::size_t offset() const { return m_offset; }
+    std::size_t dimension() const { return m_shape.size(); }
+    const shape_type& shape() const { return m_shape; }
+    /// Distance between neighbours along each axis, in bits
+    const shape_type& strides() const { return m_strides; }
+
+    std::size_t size() const
+    {
+        std::size_t n = 1;
+        for(auto s : m_shape)
+            n *= s;
+        return n;
+    }
+
+    /// Whether the element at the given index is set, i.e. negative
+    template <class... Idx>
+    bool operator()(Idx... idx) const
+    {
+        const auto bit = position(idx...);
+        return (m_words[bit / 64] >> (bit % 64)) & 1;
+    }
+
+    /// Sets the element at the given index to -1 (true) or +1 (false)
+    template <class... Idx>
+    void set(bool negative, Idx... idx) const
+    {
+        static_assert(!std::is_const<W>::value, "set() needs a mutable view");
+        const auto bit = position(idx...);
+        const auto m = std::uint64_t(1) << (bit % 64);
+        m_words[bit / 64] = negative ? m_words[bit / 64] | m : m_words[bit / 64] & ~m;
+    }
+
+    /// Elements [begin, end) along axis. Slicing the innermost axis may leave the view mid-byte.
+    basic_bit_view slice(std::size_t axis, std::size_t begin, std::size_t end) const
+    {
+        XTENSOR_ASSERT(axis < dimension() && begin <= end && end <= m_shape[axis])
+        auto shape = m_shape;
+        shape[axis] = end - begin;
+        return {m_words, m_offset + begin * m_strides[axis], std::move(shape), m_strides};
+    }
+
+    /// The sub-tensor at index i of the first axis, with one axis less
+    basic_bit_view operator[](std::size_t i) const
+    {
+        XTENSOR_ASSERT(dimension() > 1 && i < m_shape[0])
+        return {m_words, m_offset + i * m_strides[0], shape_type(m_shape.begin() + 1, m_shape.end()),
+                shape_type(m_strides.begin() + 1, m_strides.end())};
+    }
+
+    /// Calls f(bit) with the bit position of the first element of every innermost row, in row-major order
+    template <class F>
+    void for_each_row(F&& f) const
+    {
+        if(dimension() == 0 || size() == 0)
+            return;
+        const auto outer = dimension() - 1;
+        xt::svector<std::size_t, 4> index(outer, 0);
+        auto bit = m_offset;
+        while(true){
+            f(bit);
+            // Carry into the outer dimensions
+            std::size_t d = outer;
+            while(d > 0){
+                d--;
+                if(++index[d] < m_shape[d]){
+                    bit += m_strides[d];
+                    break;
+                }
+                bit -= (m_shape[d] - 1) * m_strides[d];
+                index[d] = 0;
+                if(d == 0)
+                    return;
+            }
+            if(outer == 0)
+                return;
+        }
+    }
+
+private:
+    template <class... Idx>
+    std::size_t position(Idx... idx) const
+    {
+        XTENSOR_ASSERT(sizeof...(Idx) == dimension())
+        const std::size_t index[] = {static_cast<std::size_t>(idx)...};
+        auto bit = m_offset;
+        for(std::size_t d = 0; d < sizeof...(Idx); d++)
+            bit += index[d] * m_strides[d];
+        return bit;
+    }
+
+    W* m_words = nullptr;
+    std::size_t m_offset = 0;
+    shape_type m_shape;
+    shape_type m_strides;
+};
+
+using bit_view = basic_bit_view<std::uint64_t>;
+using const_bit_view = basic_bit_view<const std::uint64_t>;
+
+/// Owning N-dimensional tensor of packed sign bits, set for negative elements as sign() packs them.
+/// Innermost rows are padded to a multiple of row_align bits, and bits past the end of a row are zero.
+class bit_tensor
+{
+public:
+    using storage_type = std::vector<std::uint64_t, huge_page_allocator<std::uint64_t>>;
+    using shape_type = std::vector<std::size_t>;
+
+    /// Innermost rows are padded to 64 bits unless asked otherwise
+    static constexpr std::size_t ROW_ALIGN = 64;
+
+    bit_tensor() = default;
+
+    /// A tensor of the given shape with every element +1
+    /// \param shape - at least one axis
+    /// \param row_align - row stride granularity in bits, a multiple of 64, e.g. CHUNK_BITS for the gemm panels
+    explicit bit_tensor(shape_type shape, std::size_t row_align = ROW_ALIGN)
+        : m_shape(std::move(shape))
+    {
+        if(m_shape.empty() || row_align == 0 || row_align % 64)
+            throw std::runtime_error("bit_tensor: needs at least one axis and a row alignment that is a multiple of 64 bits");
+        const auto cols = m_shape.back();
+        m_row_bits = (cols + row_align - 1) / row_align * row_align;
+        m_strides.assign(m_shape.size(), 1);
+        for(std::size_t d = m_shape.size() - 1; d-- > 0;)
+            m_strides[d] = d + 1 == m_shape.size() - 1 ? m_row_bits : m_strides[d + 1] * m_shape[d + 1];
+        m_data.assign(rows() * m_row_bits / 64, 0);
+    }
+
+    /// Packs the signs of an xtensor expression, one innermost row at a time, with no float copy
+    /// \param expression - expression of at least one axis, of a type sign() accepts or any arithmetic type
+    /// \param mode - sequential, or spread the rows across the thread pool
+    /// \param row_align - row stride granularity in bits, a multiple of 64
+    template <class E>
+    explicit bit_tensor(const xt::xexpression<E>& expression, ::execution mode = ::execution::sequential,
+                        std::size_t row_align = ROW_ALIGN)
+        : bit_tensor(shape_type(expression.derived_cast().shape().begin(), expression.derived_cast().shape().end()), row_align)
+    {
+        const auto& e = expression.derived_cast();
+        const auto cols = m_shape.back();
+        const bool simd = expr::linear_simd(e);
+        auto pack = [&](std::size_t t){
+            for(std::size_t i = t * PACK_ROWS; i < std::min(rows(), (t + 1) * PACK_ROWS); i++)
+                expr::sign(e, simd, i * cols, (i + 1) * cols, (std::uint8_t*) (m_data.data() + i * m_row_bits / 64));
+        };
+        const auto tasks = (rows() + PACK_ROWS - 1) / PACK_ROWS;
+        if(mode == ::execution::parallel)
+            thread_pool::global().parallel_for(tasks, pack);
+        else
+            for(std::size_t t = 0; t < tasks; t++)
+                pack(t);
+    }
+
+    std::size_t dimension() const { return m_shape.size(); }
+    const shape_type& shape() const { return m_shape; }
+    /// Distance between neighbours along each axis, in bits
+    const shape_type& strides() const { return m_strides; }
+    std::size_t size() const { return rows() * (m_shape.empty() ? 0 : m_shape.back()); }
+    /// Number of innermost rows
+    std::size_t rows() const
+    {
+        std::size_t n = 1;
+        for(std::size_t d = 0; d + 1 < m_shape.size(); d++)
+            n *= m_shape[d];
+        return n;
+    }
+    /// Padded length of an innermost row, in bits
+    std::size_t row_bits() const { return m_row_bits; }
+
+    std::uint64_t* data() { return m_data.data(); }
+    const std::uint64_t* data() const { return m_data.data(); }
+
+    bit_view view() { return {m_data.data(), 0, m_shape, m_strides}; }
+    const_bit_view view() const { return {m_data.data(), 0, m_shape, m_strides}; }
+    operator bit_view() { return view(); }
+    operator const_bit_view() const { return view(); }
+
+    template <class... Idx>
+    bool operator()(Idx... idx) const { return view()(idx...); }
+
+    bit_view slice(std::size_t axis, std::size_t begin, std::size_t end) { return view().slice(axis, begin, end); }
+    const_bit_view slice(std::size_t axis, std::size_t begin, std::size_t end) const { return view().slice(axis, begin, end); }
+    bit_view operator[](std::size_t i) { return view()[i]; }
+    const_bit_view operator[](std::size_t i) const { return view()[i]; }
+
+private:
+    shape_type m_shape;
+    shape_type m_strides;
+    std::size_t m_row_bits = 0;
+    storage_type m_data;
+};
+
+/// The ±1 values of a bit view as floats
+inline xt::xarray<float> unpack(const const_bit_view& v){
+    xt::xarray<float> res;
+    res.resize(v.shape());
+    const auto cols = v.dimension() ? v.shape().back() : 0;
+    auto out = res.data();
+    v.for_each_row([&](std::size_t bit){
+        for(std::size_t j = 0; j < cols; j++, bit++)
+            *out++ = (v.words()[bit / 64] >> (bit % 64)) & 1 ? -1.f : 1.f;
+    });
+    return res;
+}
+
+/// xnordot of two bit views of the same shape, summed over all their elements, e.g. a conv patch
+/// against a filter. Rows are counted where they lie, whatever their bit offsets.
+/// \param x - left operand
+/// \param y - right operand
+inline long long xnordot(const const_bit_view& x, const const_bit_view& y){
+    if(x.shape() != y.shape())
+        throw std::runtime_error("xnordot: bit views of different shapes");
+    if(x.dimension() == 0)
+        return 0;
+    const auto cols = x.shape().back();
+    workspace::frame frame;
+    const auto rows_y = frame.take<std::size_t>(y.size() / std::max<std::size_t>(cols, 1));
+    std::size_t n = 0;
+    y.for_each_row([&](std::size_t bit){ rows_y[n++] = bit; });
+    std::uint64_t mismatches = 0;
+    std::size_t r = 0;
+    x.for_each_row([&](std::size_t bit){
+        mismatches += bits::popcnt_xor(x.words(), bit, y.words(), rows_y[r++], cols);
+    });
+    return static_cast<long long>(x.size()) - 2 * static_cast<long long>(mismatches);
+}
+
+/// Packs the rows of a 2-D bit view into interleaved gemm panels, see pack_panels_with.
+/// Rows are shifted into place from wherever they start, so a sub-matrix needs no repacking.
+/// \param packed - output, panel_words(rows, cols, rows_per_panel) words, overwritten
+inline void pack_panels_into(std::uint64_t* packed, const const_bit_view& v, std::size_t rows_per_panel, ::execution mode){
+    XTENSOR_ASSERT(v.dimension() == 2)
+    const auto rows = v.shape()[0], cols = v.shape()[1];
+    pack_panels_with(packed, rows, cols, rows_per_panel, mode,
+                     [&](std::size_t i0, std::size_t n, std::uint8_t* out, std::size_t row_bytes){
+        for(std::size_t i = i0; i < i0 + n; i++)
+            bits::copy(v.words(), v.offset() + i * v.strides()[0], cols, (std::uint64_t*) (out + (i - i0) * row_bytes));
+    });
+}
+
+/// pack_panels_into newly allocated panels
+inline panel_t pack_panels(const const_bit_view& v, std::size_t rows_per_panel, ::execution mode = ::execution::sequential){
+    panel_t packed(panel_words(v.shape()[0], v.shape()[1], rows_per_panel));
+    pack_panels_into(packed.data(), v, rows_per_panel, mode);
+    return packed;
+}
+
+/// xnorgemm of two packed operands: c(i, j) is the xnordot of row i of a and row j of bt
+/// \param a - rows x k bit view
+/// \param bt - cols x k bit view, i.e. the right operand with its columns as rows
+/// \param mode - sequential, or spread packing and output tiles across the thread pool
+/// \tparam R - element type of the result: float, or std::int32_t / std::int16_t, see gemm::check_depth
+template <class R = float>
+inline xt::xarray<R> xnorgemm(const const_bit_view& a, const const_bit_view& bt,
+                              ::execution mode = ::execution::sequential){
+    if(a.dimension() != 2 || bt.dimension() != 2 || a.shape()[1] != bt.shape()[1])
+        throw std::runtime_error("xnorgemm: needs two 2-D bit views with the same number of columns");
+    const auto rows = a.shape()[0], cols = bt.shape()[0], k = a.shape()[1];
+    xt::xarray<R> res;
+    res.resize({rows, cols});
+    if(k == 0){
+        res.fill(0);
+        return res;
+    }
+    workspace::frame frame;
+    const auto packed_a1 = frame.take<std::uint64_t>(panel_words(rows, k, MR));
+    const auto packed_a2 = frame.take<std::uint64_t>(panel_words(cols, k, NR));
+    pack_panels_into(packed_a1, a, MR, mode);
+    pack_panels_into(packed_a2, bt, NR, mode);
+    gemm::run(packed_a1, packed_a2, res.data(), cols, rows, cols, k, mode);
+    return res;
+}
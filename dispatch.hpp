@@ -0,0 +1,58 @@
+#pragma once
+
+// Every kernel variant is compiled inside a target region, so a single binary built without
+// -march holds all of them and picks one at startup from cpuid.
+#define XNOR_PRAGMA(x) _Pragma(#x)
+#if defined(__clang__)
+#define XNOR_TARGET_PUSH(features) XNOR_PRAGMA(clang attribute push(__attribute__((target(features))), apply_to = function))
+#define XNOR_TARGET_POP XNOR_PRAGMA(clang attribute pop)
+#else
+#define XNOR_TARGET_PUSH(features) XNOR_PRAGMA(GCC push_options) XNOR_PRAGMA(GCC target(features))
+#define XNOR_TARGET_POP XNOR_PRAGMA(GCC pop_options)
+#endif
+
+#define XNOR_SSE42_TARGET "sse4.2,popcnt"
+#define XNOR_AVX2_TARGET "avx2,popcnt"
+#define XNOR_AVX512_TARGET "avx512f,avx512bw,avx512dq,avx512vl,popcnt"
+#define XNOR_AVX512_VPOPCNT_TARGET "avx512f,avx512bw,avx512dq,avx512vl,avx512vpopcntdq,popcnt"
+
+/// Instruction set levels that have their own kernel variants, slowest first
+enum class isa : int
+{
+    scalar = 0, // portable C++ with a software popcount
+    sse42 = 1,  // 128-bit movemask and popcnt64
+    avx2 = 2,   // 256-bit movemask, harley-seal and nibble LUT popcount
+    avx512 = 3, // 512-bit movemask, VPTERNLOG harley-seal and masked tails
+};
+
+inline const char* isa_name(::isa level)
+{
+    switch(level){
+        case ::isa::scalar: return "scalar";
+        case ::isa::sse42: return "sse4.2";
+        case ::isa::avx2: return "avx2";
+        case ::isa::avx512: return "avx512";
+    }
+    return "unknown";
+}
+
+/// Fastest level that both the CPU and the OS support
+inline ::isa detect_isa()
+{
+    __builtin_cpu_init();
+    if(!__builtin_cpu_supports("sse4.2") || !__builtin_cpu_supports("popcnt"))
+        return ::isa::scalar;
+    if(!__builtin_cpu_supports("avx2"))
+        return ::isa::sse42;
+    if(!__builtin_cpu_supports("avx512f") || !__builtin_cpu_supports("avx512bw")
+       || !__builtin_cpu_supports("avx512dq") || !__builtin_cpu_supports("avx512vl"))
+        return ::isa::avx2;
+    return ::isa::avx512;
+}
+
+/// VPOPCNTDQ (Ice Lake and later) is optional on top of the avx512 level
+inline bool has_vpopcntdq()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512vpopcntdq");
+}
@@ -0,0 +1,180 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+#include <xsimd/memory/xsimd_aligned_allocator.hpp>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define XNOR_HAS_MMAP 1
+#endif
+
+// Page backing for packed buffers. A multi-GB panel or kNN database on 4 KB pages needs a TLB
+// entry for every 4 KB the microkernel touches, and walking rows far apart misses the TLB on most
+// of them. Backed by 2 MB pages the same buffer needs 512 times fewer entries.
+
+/// How buffers of at least HUGE_PAGE_THRESHOLD bytes are backed
+enum class page_policy : int
+{
+    normal = 0,        // ordinary pages
+    transparent = 1,   // madvise(MADV_HUGEPAGE), so the kernel backs the range with transparent huge pages
+    explicit_huge = 2, // MAP_HUGETLB from the pool reserved in /proc/sys/vm/nr_hugepages, else transparent
+};
+
+/// Size of a huge page, the granularity large buffers are mapped and aligned at
+static constexpr std::size_t HUGE_PAGE_SIZE = std::size_t(1) << 21;
+/// Buffers smaller than this come from the heap, 64-byte aligned, whatever the policy
+static constexpr std::size_t HUGE_PAGE_THRESHOLD = HUGE_PAGE_SIZE;
+
+namespace pages{
+    static constexpr std::size_t SMALL_PAGE_SIZE = 4096;
+    static constexpr std::size_t HEAP_ALIGN = 64;
+
+    inline std::atomic<int>& policy()
+    {
+        static std::atomic<int> value{static_cast<int>(::page_policy::normal)};
+        return value;
+    }
+
+    inline std::atomic<bool>& prefault()
+    {
+        static std::atomic<bool> value{false};
+        return value;
+    }
+
+    /// Length a buffer of `bytes` is mapped with
+    inline std::size_t mapped_bytes(std::size_t bytes)
+    {
+        return (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    }
+
+#ifdef XNOR_HAS_MMAP
+    /// Anonymous mapping of `length` bytes starting on a huge page boundary, which transparent
+    /// huge pages need, or nullptr
+    inline void* map_aligned(std::size_t length)
+    {
+        auto raw = ::mmap(nullptr, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(raw == MAP_FAILED)
+            return nullptr;
+        const auto begin = reinterpret_cast<std::uintptr_t>(raw);
+        const auto aligned = (begin + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        // Trim the slack on either side
+        if(aligned > begin)
+            ::munmap(raw, aligned - begin);
+        if(aligned + length < begin + length + HUGE_PAGE_SIZE)
+            ::munmap(reinterpret_cast<void*>(aligned + length), begin + HUGE_PAGE_SIZE - aligned);
+        return reinterpret_cast<void*>(aligned);
+    }
+
+    inline void* map(std::size_t bytes)
+    {
+        const auto length = mapped_bytes(bytes);
+        const auto selected = static_cast<::page_policy>(policy().load(std::memory_order_relaxed));
+        const bool populate = prefault().load(std::memory_order_relaxed);
+#ifdef MAP_HUGETLB
+        if(selected == ::page_policy::explicit_huge){
+            auto p = ::mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (populate ? MAP_POPULATE : 0), -1, 0);
+            if(p != MAP_FAILED)
+                return p;
+            // The reserved pool is empty or absent, so ask for transparent huge pages instead
+        }
+#endif
+        auto p = map_aligned(length);
+        if(!p)
+            return nullptr;
+#ifdef MADV_HUGEPAGE
+        if(selected != ::page_policy::normal)
+            ::madvise(p, length, MADV_HUGEPAGE);
+#endif
+        // Touching the pages after the advice faults them in as huge pages where the kernel can,
+        // so the first pass of the microkernel does not pay for the faults
+        if(populate){
+            auto bytes_p = static_cast<volatile std::uint8_t*>(p);
+            for(std::size_t i = 0; i < length; i += SMALL_PAGE_SIZE)
+                bytes_p[i] = 0;
+        }
+        return p;
+    }
+#endif
+
+    /// `bytes` of memory, from a huge-page mapping when large enough
+    inline void* allocate(std::size_t bytes)
+    {
+#ifdef XNOR_HAS_MMAP
+        if(bytes >= HUGE_PAGE_THRESHOLD){
+            if(auto p = map(bytes))
+                return p;
+            throw std::bad_alloc();
+        }
+#endif
+        auto p = xsimd::aligned_malloc(bytes, HEAP_ALIGN);
+        if(!p && bytes)
+            throw std::bad_alloc();
+        return p;
+    }
+
+    /// Frees memory from allocate(bytes); the size alone tells how it was obtained
+    inline void deallocate(void* p, std::size_t bytes) noexcept
+    {
+        if(!p)
+            return;
+#ifdef XNOR_HAS_MMAP
+        if(bytes >= HUGE_PAGE_THRESHOLD){
+            ::munmap(p, mapped_bytes(bytes));
+            return;
+        }
+#endif
+        xsimd::aligned_free(p);
+    }
+} // pages
+
+/// Selects how large packed buffers allocated from now on are backed. Buffers already allocated keep their pages.
+/// \param policy - page size to ask the kernel for
+/// \param prefault - whether to fault every page in at allocation time instead of on first touch
+inline void set_page_policy(::page_policy policy, bool prefault = true){
+    pages::policy().store(static_cast<int>(policy));
+    pages::prefault().store(prefault);
+}
+
+inline ::page_policy get_page_policy(){
+    return static_cast<::page_policy>(pages::policy().load());
+}
+
+/// Allocator for packed buffers: 64-byte aligned from the heap when small, a huge page aligned
+/// mapping backed as set_page_policy() selects from HUGE_PAGE_THRESHOLD bytes up
+template <class T>
+class huge_page_allocator
+{
+public:
+    using value_type = T;
+
+    template <class U>
+    struct rebind
+    {
+        using other = huge_page_allocator<U>;
+    };
+
+    huge_page_allocator() noexcept = default;
+
+    template <class U>
+    huge_page_allocator(const huge_page_allocator<U>&) noexcept {}
+
+    T* allocate(std::size_t n)
+    {
+        return static_cast<T*>(pages::allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept
+    {
+        pages::deallocate(p, n * sizeof(T));
+    }
+};
+
+template <class T, class U>
+inline bool operator==(const huge_page_allocator<T>&, const huge_page_allocator<U>&) noexcept { return true; }
+
+template <class T, class U>
+inline bool operator!=(const huge_page_allocator<T>&, const huge_page_allocator<U>&) noexcept { return false; }
@@ -1,8 +1,16 @@
 // Define this at the top to avoid collisions
 #define XTENSOR_USE_XSIMD
+// Built without -march, xsimd only aligns to 16 bytes. The kernels take any alignment, but the
+// benchmark's tensors are aligned to 64 so their loads never split a cache line.
+#include <xsimd/memory/xsimd_aligned_allocator.hpp>
+#define XTENSOR_DEFAULT_ALLOCATOR(T) xsimd::aligned_allocator<T, 64>
 #include <iostream>
 #include <vector>
+#include <array>
 #include <cmath>
+#include <cstring>
+#include <random>
+#include <string>
 
 // xtensor-blas benchmark
 #include <xtensor-blas/xlinalg.hpp>
@@ -14,6 +22,7 @@
 #include <xtensor/xtensor.hpp>
 #include <xtensor/xfixed.hpp>
 #include <xtensor/xview.hpp>
+#include <xtensor/xmath.hpp>
 #include <xtensor/xrandom.hpp>
 
 // Require this for all float input
@@ -21,6 +30,14 @@
 
 #include "xnordot.hpp"
 #include "xnorgemm.hpp"
+#include "xnorfixed.hpp"
+#include "xnorlazy.hpp"
+#include "xnorbinary.hpp"
+#include "xnorpacked.hpp"
+#include "xnorcache.hpp"
+#include "xnorscale.hpp"
+#include "xnorbinarize.hpp"
+#include "xnormixed.hpp"
 
 #include "timeit.hpp"
 
@@ -52,6 +69,10 @@ void print_bitset(std::uint8_t b){
 
 // === dot benchmark functions ===
 
+auto hand_dot(const xt::xarray<float>& a1, const xt::xarray<float>& a2, ::input_alignment alignment, ::execution mode){
+    return xnordot(a1, a2, alignment, mode);
+}
+
 auto blas_dot(const xt::xarray<float>& a1, const xt::xarray<float>& a2){
     return xt::linalg::dot(a1, a2);
 }
@@ -100,10 +121,13 @@ void benchmark_dot(){
         run(arr1, arr2);
 
         std::cout << "=== hand-tuned bitpack+xnor+popcount safe ===" << std::endl;
-        timeit(xnordot, arr1, arr2, ::input_alignment::safe);
+        timeit(hand_dot, arr1, arr2, ::input_alignment::safe, ::execution::sequential);
 
         std::cout << "=== hand-tuned bitpack+xnor+popcount unsafe ===" << std::endl;
-        timeit(xnordot, arr1, arr2, ::input_alignment::unsafe);
+        timeit(hand_dot, arr1, arr2, ::input_alignment::unsafe, ::execution::sequential);
+
+        std::cout << "=== hand-tuned bitpack+xnor+popcount safe, split-K parallel ===" << std::endl;
+        timeit(hand_dot, arr1, arr2, ::input_alignment::safe, ::execution::parallel);
 
         std::cout << "=== xtensor-blas dot product ===" << std::endl;
         timeit(blas_dot, arr1, arr2);
@@ -118,10 +142,56 @@ void benchmark_dot(){
 
 // === gemm benchmark functions ===
 
+auto hand_gemm(const xt::xarray<float>& a1, const xt::xarray<float>& a2, ::execution mode){
+    return xnorgemm(a1, a2, mode);
+}
+
+// A scaled layer output: alpha * (a1 . a2) + bias
+xt::xarray<float> hand_layer(const xt::xarray<float>& a1, const xt::xarray<float>& a2,
+                             const xt::xarray<float>& alpha, const xt::xarray<float>& bias){
+    xt::xarray<float> res = xnorgemm(a1, a2);
+    return res * alpha + bias;
+}
+
+xt::xarray<float> fused_layer(const xt::xarray<float>& a1, const xt::xarray<float>& a2,
+                              const xt::xarray<float>& alpha, const xt::xarray<float>& bias){
+    return lazy_xnorgemm(a1, a2) * alpha + bias;
+}
+
+// Weights packed once outside the timed call, as a served model would hold them
+auto packed_gemm(const xt::xarray<float>& a1, const packed_binary_matrix& a2){
+    return xnorgemm(a1, a2);
+}
+
+// XNOR-Net layer: mean |x| row scales, the weights' column scales, bias and ReLU, all fused
+auto xnor_layer(const xt::xarray<float>& a1, const packed_binary_matrix& a2, const xt::xarray<float>& bias){
+    xnor_epilogue epilogue;
+    epilogue.row_scaling = ::scale_mode::mean_abs;
+    epilogue.col_scaling = ::scale_mode::mean_abs;
+    epilogue.bias = bias.data();
+    epilogue.act = ::activation::relu;
+    return xnorgemm(a1, a2, epilogue);
+}
+
+// Binary layer feeding another: batch norm folded into thresholds, packed bits out
+auto binary_layer(const xt::xarray<float>& a1, const packed_binary_matrix& a2, const sign_thresholds& thresholds){
+    return xnorgemm_signs(a1, a2, thresholds);
+}
+
+// First or last layer: int8 activations against binary weights, which add or subtract each of them
+auto bwn_layer(const xt::xarray<std::int8_t>& a1, const packed_binary_matrix& a2){
+    return bwngemm<std::int32_t>(a1, a2);
+}
+
 auto blas_gemm(const xt::xarray<float>& a1, const xt::xarray<float>& a2){
     return xt::linalg::dot(a1, a2);
 }
 
+// The xtensor-blas call, with operands whose type makes it binary
+auto binary_gemm(const binary_tensor<xt::xarray<float>>& a1, const binary_tensor<xt::xarray<float>>& a2){
+    return xt::linalg::dot(a1, a2);
+}
+
 auto blas_dot_gemm(const xt::xarray<float>& a1, const xt::xarray<float>& a2){
     auto&& i8a1 = xt::cast<std::int8_t>(xt::sign(a1));
     auto&& i8a2 = xt::cast<std::int8_t>(xt::sign(a2));
@@ -160,7 +230,40 @@ void benchmark_gemm(){
         }
 
         std::cout << "=== hand-tuned bitpack+xnor+popcount (unsafe) ===" << std::endl;
-        timeit(xnorgemm, arr1, arr2);
+        timeit(hand_gemm, arr1, arr2, ::execution::sequential);
+
+        std::cout << "=== hand-tuned bitpack+xnor+popcount (unsafe, parallel) ===" << std::endl;
+        timeit(hand_gemm, arr1, arr2, ::execution::parallel);
+
+        xt::xarray<float> alpha = xt::ones<float>({Z_SIZE}) * 0.5f;
+        xt::xarray<float> bias = xt::ones<float>({Z_SIZE});
+
+        std::cout << "=== hand-tuned gemm, then alpha * res + bias in xtensor ===" << std::endl;
+        timeit(hand_layer, arr1, arr2, alpha, bias);
+
+        std::cout << "=== lazy gemm with alpha * res + bias fused into the write-back ===" << std::endl;
+        timeit(fused_layer, arr1, arr2, alpha, bias);
+
+        const packed_binary_matrix packed2(arr2, operand_side::right);
+        std::cout << "=== hand-tuned gemm against prepacked weights ===" << std::endl;
+        timeit(packed_gemm, arr1, packed2);
+
+        const packed_binary_matrix scaled2(arr2, operand_side::right, ::execution::sequential, ::scale_mode::mean_abs);
+        std::cout << "=== XNOR-Net layer: scales, bias and ReLU in the write-back ===" << std::endl;
+        timeit(xnor_layer, arr1, scaled2, bias);
+
+        xt::xarray<float> bn_mean = xt::zeros<float>({Z_SIZE});
+        xt::xarray<float> bn_var = xt::ones<float>({Z_SIZE});
+        const sign_thresholds thresholds(alpha.data(), bias.data(), bn_mean.data(), bn_var.data(), Z_SIZE);
+        std::cout << "=== binary layer: batch norm and sign in the write-back, packed bits out ===" << std::endl;
+        timeit(binary_layer, arr1, packed2, thresholds);
+
+        const xt::xarray<std::int8_t> i8arr1 = xt::cast<std::int8_t>(xt::clip(arr1, -128.f, 127.f));
+        std::cout << "=== binary-weight gemm: int8 activations added or subtracted by the weight bits ===" << std::endl;
+        timeit(bwn_layer, i8arr1, packed2);
+
+        std::cout << "=== xt::linalg::dot on binary_tensor ===" << std::endl;
+        timeit(binary_gemm, binary_tensor<xt::xarray<float>>(arr1), binary_tensor<xt::xarray<float>>(arr2));
 
         std::cout << "=== xtensor-blas gemm ===" << std::endl;
         timeit(blas_gemm, arr1, arr2);
@@ -175,17 +278,243 @@ void benchmark_gemm(){
 
 // ===
 
+// === packed code benchmark functions ===
+
+void runtime_codes(const std::vector<std::uint8_t>& a, const std::vector<std::uint8_t>& b, std::size_t codes, std::size_t bits,
+                   std::vector<float>& c){
+    const auto bytes = bits / NUM_BITS;
+    for(std::size_t i = 0; i < codes; i++)
+        for(std::size_t j = 0; j < codes; j++)
+            c[i * codes + j] = xnor_sum(a.data() + i * bytes, b.data() + j * bytes, bits);
+}
+
+void fixed_codes(const std::vector<std::uint8_t>& a, const std::vector<std::uint8_t>& b, std::size_t codes, std::size_t bits,
+                 std::vector<float>& c){
+    xnorgemm_codes(a.data(), codes, b.data(), codes, bits, c.data(), codes);
+}
+
+void benchmark_codes(){
+    static constexpr std::size_t CODES = 1024;
+    for (auto bits : FIXED_WIDTHS) {
+        std::cout << "====== Code width : " << bits << " bits, " << CODES << " x " << CODES << " codes ====== " << std::endl;
+        std::vector<std::uint8_t> a(CODES * bits / NUM_BITS), b(CODES * bits / NUM_BITS);
+        for (std::size_t i = 0; i < a.size(); i++) {
+            a[i] = static_cast<std::uint8_t>(i * 37);
+            b[i] = static_cast<std::uint8_t>(i * 91 + 5);
+        }
+        std::vector<float> c(CODES * CODES);
+
+        std::cout << "=== runtime-length xnor_sum per pair ===" << std::endl;
+        timeit(runtime_codes, a, b, CODES, bits, c);
+
+        std::cout << "=== compile-time width xnorgemm<K> ===" << std::endl;
+        timeit(fixed_codes, a, b, CODES, bits, c);
+    }
+}
+
+// === correctness checks ===
+// Every path is compared against a naive dot product of signs before anything is timed.
+
+// -1 where sign() packs a set bit: the sign bit of a float, so -0.0 is -1, or of an int8.
+// The float bit is read directly, since -ffast-math lets std::signbit(x) become x < 0.
+float sign_of(float v){
+    std::uint32_t bits;
+    std::memcpy(&bits, &v, sizeof(bits));
+    return bits >> 31 ? -1.f : 1.f;
+}
+
+float sign_of(std::int8_t v){
+    return v < 0 ? -1.f : 1.f;
+}
+
+// res(i, j) = sum over p of sign(a(i, p)) * sign(b(p, j)), or x(i, p) * sign(b(p, j)) with signed_a false
+template <class T, class U>
+xt::xarray<float> sign_dot(const xt::xarray<T>& a, const xt::xarray<U>& b, bool signed_a = true){
+    const auto m = a.shape()[0], k = a.shape()[1], n = b.shape()[1];
+    xt::xarray<float> res;
+    res.resize({m, n});
+    for (std::size_t i = 0; i < m; i++) {
+        for (std::size_t j = 0; j < n; j++) {
+            float sum = 0.f;
+            for (std::size_t p = 0; p < k; p++)
+                sum += (signed_a ? sign_of(a(i, p)) : static_cast<float>(a(i, p))) * sign_of(b(p, j));
+            res(i, j) = sum;
+        }
+    }
+    return res;
+}
+
+void check(bool ok, const std::string& what){
+    if (!ok) {
+        throw std::runtime_error("Something's wrong: " + what);
+    }
+}
+
+template <class R>
+bool same(const xt::xarray<R>& res, const xt::xarray<float>& ref){
+    return res.shape() == ref.shape() && xt::all(xt::equal(xt::cast<float>(res), ref));
+}
+
+// Uniform in [-1, 1], with a +0.0 and a -0.0 so both signs of zero are exercised
+xt::xarray<float> random_matrix(std::size_t rows, std::size_t cols){
+    xt::xarray<float> res = xt::random::rand<float>(std::vector<std::size_t>{rows, cols}, -1.f, 1.f);
+    res(0, 0) = 0.f;
+    res(rows - 1, cols - 1) = -0.f;
+    return res;
+}
+
+// Whether xnorgemm_signs agrees with sign(BN(a . b)) computed in float, where a BN output of 0 is +1
+bool signs_match(const xt::xarray<float>& a, const packed_binary_matrix& b, const xt::xarray<float>& ref,
+                 const xt::xarray<float>& gamma, const xt::xarray<float>& shift,
+                 const xt::xarray<float>& mean, const xt::xarray<float>& var){
+    const sign_thresholds thresholds(gamma.data(), shift.data(), mean.data(), var.data(), gamma.size());
+    const auto signs = xnorgemm_signs(a, b, thresholds);
+    const xt::xarray<float> bn = gamma * (ref - mean) / xt::sqrt(var + 1e-5f) + shift;
+    for (std::size_t i = 0; i < ref.shape()[0]; i++)
+        for (std::size_t j = 0; j < ref.shape()[1]; j++)
+            if (signs(i, j) != (bn(i, j) < 0.f))
+                return false;
+    return true;
+}
+
+void check_dot(){
+    for (std::size_t size : {1UL, 7UL, 64UL, 1000UL, 3 * DOT_CHUNK + 5}) {
+        const xt::xarray<float> x = xt::view(random_matrix(1, size), 0, xt::all());
+        const xt::xarray<float> y = xt::view(random_matrix(1, size), 0, xt::all());
+        long long ref = 0;
+        for (std::size_t i = 0; i < size; i++)
+            ref += static_cast<long long>(sign_of(x(i)) * sign_of(y(i)));
+        const auto name = std::to_string(size);
+        check(xnordot(x, y) == ref, "xnordot " + name);
+        check(xnordot(x, y, ::input_alignment::safe, ::execution::parallel) == ref, "split-K xnordot " + name);
+        check(xnordot(x * 2.f, y * 1.f) == ref, "expression xnordot " + name);
+        const bit_tensor bx(x), by(y);
+        check(xnordot(bx.view(), by.view()) == ref, "bit_tensor xnordot " + name);
+    }
+}
+
+void check_gemm(){
+    // Shapes with partial register tiles, several KC slices of K, and enough tiles to split across the pool
+    const std::vector<std::array<std::size_t, 3>> shapes = {
+        {1, 1, 1}, {3, 7, 5}, {37, 300, 21}, {130, 513, 67}, {9, 9000, 13}, {260, 700, 300}};
+    for (const auto& shape : shapes) {
+        const auto m = shape[0], k = shape[1], n = shape[2];
+        const auto name = std::to_string(m) + "x" + std::to_string(k) + "x" + std::to_string(n);
+        const xt::xarray<float> a = random_matrix(m, k), b = random_matrix(k, n);
+        const xt::xarray<float> ref = sign_dot(a, b);
+
+        check(same(xnorgemm(a, b), ref), "blocked xnorgemm " + name);
+        check(same(xnorgemm(a, b, ::execution::parallel), ref), "parallel xnorgemm " + name);
+        check(same(xnorgemm<std::int32_t>(a, b), ref), "int32 xnorgemm " + name);
+        check(same(xnorgemm<std::int16_t>(a, b, ::execution::parallel), ref), "int16 xnorgemm " + name);
+
+        // Transposed and strided operands are read in place
+        const xt::xarray<float> at = xt::transpose(a), bt = xt::transpose(b);
+        check(same(xnorgemm(at, bt, ::execution::sequential, ::transposition::transposed, ::transposition::transposed), ref),
+              "transposed xnorgemm " + name);
+        const xt::xarray<float, xt::layout_type::column_major> a_cols = a;
+        check(same(xnorgemm(a_cols, b), ref), "column-major xnorgemm " + name);
+        xt::xarray<float> wide = xt::zeros<float>(std::vector<std::size_t>{m, k + 3});
+        xt::view(wide, xt::all(), xt::range(1, k + 1)) = a;
+        check(same(xnorgemm(xt::view(wide, xt::all(), xt::range(1, k + 1)), b), ref), "strided view xnorgemm " + name);
+        xt::xarray<float> raw = xt::zeros<float>(std::vector<std::size_t>{m, n + 2});
+        xnorgemm(::transposition::none, ::transposition::none, m, n, k, wide.data() + 1, k + 3, b.data(), n, raw.data(), n + 2);
+        check(same(xt::xarray<float>(xt::view(raw, xt::all(), xt::range(0, n))), ref), "raw pointer xnorgemm " + name);
+
+        // Lazy node with the elementwise ops fused into the write-back
+        const xt::xarray<float> lazy = lazy_xnorgemm(a, b) * 0.5f + 1.f;
+        check(same(lazy, ref * 0.5f + 1.f), "lazy xnorgemm " + name);
+
+        // Prepacked and cached operands
+        const packed_binary_matrix pa(a, operand_side::left), pb(b, operand_side::right);
+        check(same(xnorgemm(a, pb), ref) && same(xnorgemm(pa, b), ref) && same(xnorgemm(pa, pb), ref),
+              "packed xnorgemm " + name);
+        // A cached right operand is stored transposed, one row per column of b, as a table would be
+        xt::xarray<float> table = bt;
+        packing_cache cache;
+        check(same(xnorgemm(a, *cache.get(table.data(), n, k, k, operand_side::right, 0)), ref), "cached xnorgemm " + name);
+        xt::view(table, 0, xt::all()) = -xt::view(table, 0, xt::all());
+        cache.mark_dirty(table.data(), 0);
+        check(same(xnorgemm(a, *cache.get(table.data(), n, k, k, operand_side::right, 0)),
+                   sign_dot(a, xt::xarray<float>(xt::transpose(table)))),
+              "repacked cached xnorgemm " + name);
+
+        // bit_tensor operands and binary_tensor through xt::linalg::dot
+        const bit_tensor bits_a(a), bits_bt(bt);
+        check(same(xnorgemm(bits_a.view(), bits_bt.view()), ref), "bit_tensor xnorgemm " + name);
+        check(same(xt::linalg::dot(as_binary(a), as_binary(b)), ref), "binary_tensor dot " + name);
+
+        // XNOR-Net layer: mean |value| scales, bias and ReLU
+        xt::xarray<float> alpha = xt::mean(xt::abs(a), {1}), beta = xt::mean(xt::abs(b), {0});
+        xt::xarray<float> bias = xt::random::rand<float>({n}, -1.f, 1.f);
+        xnor_epilogue epilogue;
+        epilogue.row_scaling = ::scale_mode::mean_abs;
+        epilogue.col_scaling = ::scale_mode::mean_abs;
+        epilogue.bias = bias.data();
+        epilogue.act = ::activation::relu;
+        const xt::xarray<float> layer = xt::maximum(ref * xt::view(alpha, xt::all(), xt::newaxis()) * beta + bias, 0.f);
+        const packed_binary_matrix scaled_b(b, operand_side::right, ::execution::sequential, ::scale_mode::mean_abs);
+        check(xt::allclose(xnorgemm(a, b, epilogue), layer, 1e-4, 1e-5)
+              && xt::allclose(xnorgemm(a, scaled_b, epilogue, ::execution::parallel), layer, 1e-4, 1e-5),
+              "scaled xnorgemm " + name);
+
+        // Binary layer: sign(BN(a . b)) as packed bits
+        const xt::xarray<float> gamma = xt::random::rand<float>({n}, -2.f, 2.f), shift = xt::random::rand<float>({n}, -2.f, 2.f);
+        const xt::xarray<float> mean = xt::random::rand<float>({n}, -10.f, 10.f), var = xt::random::rand<float>({n}, 0.5f, 4.f);
+        check(signs_match(a, pb, ref, gamma, shift, mean, var), "xnorgemm_signs " + name);
+        // Ties: with beta 0 and each mean at a dot product the gemm produces, BN outputs exactly 0 there,
+        // which is +1. gamma -4.5 with var 1 and gamma 1.5 with var 2 are ones a two-step fold rounded to -1.
+        xt::xarray<float> tie_gamma = xt::zeros<float>({n}), tie_mean = xt::zeros<float>({n}), tie_var = xt::zeros<float>({n});
+        for (std::size_t j = 0; j < n; j++) {
+            tie_gamma(j) = j % 2 ? 1.5f : -4.5f;
+            tie_mean(j) = ref(j % m, j);
+            tie_var(j) = j % 2 ? 2.f : 1.f;
+        }
+        check(signs_match(a, pb, ref, tie_gamma, xt::zeros<float>({n}), tie_mean, tie_var), "xnorgemm_signs at BN ties " + name);
+
+        // Binary weights against int8 and float activations, which are not binarized
+        const xt::xarray<std::int8_t> x8 = xt::cast<std::int8_t>(a * 127.f);
+        check(same(bwngemm<std::int32_t>(x8, pb), sign_dot(x8, b, false)), "int8 bwngemm " + name);
+        check(xt::allclose(bwngemm(a, pb, ::execution::parallel), sign_dot(a, b, false), 1e-4, 1e-3), "float bwngemm " + name);
+    }
+}
+
+void check_codes(){
+    std::mt19937 gen(7);
+    std::vector<std::size_t> widths(std::begin(FIXED_WIDTHS), std::end(FIXED_WIDTHS));
+    widths.push_back(300);
+    for (auto bits : widths) {
+        const std::size_t m = 13, n = 11, bytes = (bits + NUM_BITS - 1) / NUM_BITS;
+        std::vector<std::uint8_t> a(m * bytes), b(n * bytes);
+        for (auto& v : a) v = static_cast<std::uint8_t>(gen());
+        for (auto& v : b) v = static_cast<std::uint8_t>(gen());
+        std::vector<float> c(m * n);
+        xnorgemm_codes(a.data(), m, b.data(), n, bits, c.data(), n);
+        for (std::size_t i = 0; i < m; i++) {
+            for (std::size_t j = 0; j < n; j++) {
+                long long ref = 0;
+                for (std::size_t p = 0; p < bits; p++)
+                    ref += ((a[i * bytes + p / 8] ^ b[j * bytes + p / 8]) >> (p % 8) & 1) ? -1 : 1;
+                check(c[i * n + j] == ref, "xnorgemm_codes " + std::to_string(bits));
+                if (const auto dot = fixed_xnordot(bits))
+                    check(dot(a.data() + i * bytes, b.data() + j * bytes) == ref, "xnordot<" + std::to_string(bits) + ">");
+            }
+        }
+    }
+}
+
+void check_all(){
+    xt::random::seed(0);
+    check_dot();
+    check_gemm();
+    check_codes();
+    std::cout << "correctness checks passed" << std::endl;
+}
+
 int main() {
+    std::cout << "kernels: " << isa_name(dispatch().level) << std::endl;
+    check_all();
 //    benchmark_dot();
+//    benchmark_codes();
    benchmark_gemm();
-
-    // Unit tests
-    // auto test_iters = 100;
-    // for(auto i = 0; i < test_iters; i++){
-        // xt::xarray<float, xt::layout_type::row_major> a1 = xt::random::rand<float>({100, 250}, -1000.0f, 1000.0f);
-        // xt::xarray<float, xt::layout_type::row_major> a2 = xt::random::rand<float>({250, 30}, -1000.0f, 1000.0f);
-        // auto res = xt::linalg::dot(xt::sign(a1), xt::sign(a2));
-        // auto xnorgemm_res = xnorgemm(a1, a2);
-        // assert(xt::allclose(res, xnorgemm_res));
-    // }
 }
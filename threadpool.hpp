@@ -0,0 +1,176 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+enum class execution : bool
+{
+    sequential = false,
+    parallel = true,
+};
+
+/// Fixed-size pool of workers that runs parallel_for jobs with work-stealing.
+/// Tasks are dealt round-robin onto per-worker deques, so at any moment the workers are busy on
+/// neighbouring task indices and share whatever those tasks read (e.g. a B panel in L3).
+/// A worker takes from the front of its own deque and, once it runs dry, steals from the front
+/// of the others'. The calling thread takes part as worker 0.
+class thread_pool
+{
+public:
+    explicit thread_pool(std::size_t num_threads = std::thread::hardware_concurrency())
+    {
+        num_threads = std::max<std::size_t>(num_threads, 1);
+        for(std::size_t i = 0; i < num_threads; i++)
+            m_queues.emplace_back(new queue());
+        for(std::size_t i = 1; i < num_threads; i++)
+            m_workers.emplace_back(&thread_pool::worker_loop, this, i);
+    }
+
+    ~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lk(m_lock);
+            m_stop = true;
+        }
+        m_wake.notify_all();
+        for(auto& t : m_workers)
+            t.join();
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    std::size_t size() const { return m_queues.size(); }
+
+    /// Runs fn(task) for every task in [0, tasks) and blocks until all of them are done.
+    /// Calls from inside a task run sequentially on the calling worker.
+    /// \param tasks - number of tasks
+    /// \param fn - callable taking the task index
+    template <class F>
+    void parallel_for(std::size_t tasks, F&& fn)
+    {
+        if(tasks == 0)
+            return;
+        if(tasks == 1 || size() == 1 || in_pool()){
+            for(std::size_t t = 0; t < tasks; t++)
+                fn(t);
+            return;
+        }
+
+        std::lock_guard<std::mutex> submit(m_submit);
+        std::function<void(std::size_t)> job = std::ref(fn);
+        m_job = &job;
+        m_error = nullptr;
+        m_remaining = tasks;
+        for(std::size_t t = 0; t < tasks; t++){
+            auto& q = *m_queues[t % size()];
+            std::lock_guard<std::mutex> lk(q.lock);
+            q.tasks.push_back(t);
+        }
+        {
+            std::lock_guard<std::mutex> lk(m_lock);
+            m_generation++;
+        }
+        m_wake.notify_all();
+
+        in_pool() = true;
+        run_tasks(0);
+        in_pool() = false;
+        {
+            std::unique_lock<std::mutex> lk(m_lock);
+            m_done.wait(lk, [this]{ return m_remaining == 0; });
+        }
+        m_job = nullptr;
+        if(m_error)
+            std::rethrow_exception(m_error);
+    }
+
+    /// Process-wide pool with one worker per hardware thread
+    static thread_pool& global()
+    {
+        static thread_pool pool;
+        return pool;
+    }
+
+private:
+    struct queue
+    {
+        std::mutex lock;
+        std::deque<std::size_t> tasks;
+    };
+
+    static bool& in_pool()
+    {
+        static thread_local bool flag = false;
+        return flag;
+    }
+
+    bool pop(std::size_t id, std::size_t& task)
+    {
+        // Own deque first, then steal from the neighbours in order
+        for(std::size_t i = 0; i < size(); i++){
+            auto& q = *m_queues[(id + i) % size()];
+            std::lock_guard<std::mutex> lk(q.lock);
+            if(!q.tasks.empty()){
+                task = q.tasks.front();
+                q.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run_tasks(std::size_t id)
+    {
+        std::size_t task;
+        while(pop(id, task)){
+            try{
+                (*m_job)(task);
+            }
+            catch(...){
+                std::lock_guard<std::mutex> lk(m_lock);
+                if(!m_error)
+                    m_error = std::current_exception();
+            }
+            if(--m_remaining == 0){
+                std::lock_guard<std::mutex> lk(m_lock);
+                m_done.notify_all();
+            }
+        }
+    }
+
+    void worker_loop(std::size_t id)
+    {
+        in_pool() = true;
+        std::size_t seen = 0;
+        while(true){
+            {
+                std::unique_lock<std::mutex> lk(m_lock);
+                m_wake.wait(lk, [&]{ return m_stop || m_generation != seen; });
+                if(m_stop)
+                    return;
+                seen = m_generation;
+            }
+            run_tasks(id);
+        }
+    }
+
+    std::vector<std::unique_ptr<queue>> m_queues;
+    std::vector<std::thread> m_workers;
+    std::mutex m_submit;
+    std::mutex m_lock;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    std::function<void(std::size_t)>* m_job = nullptr;
+    std::exception_ptr m_error;
+    std::atomic<std::size_t> m_remaining{0};
+    std::size_t m_generation = 0;
+    bool m_stop = false;
+};
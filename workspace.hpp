@@ -0,0 +1,156 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "hugepage.hpp"
+
+// Scratch memory for the kernels. Packed panels, sign buffers and per-task partials are all taken
+// from a per-thread arena instead of the heap, so once the arena has grown to a workload's
+// high-water mark the kernels allocate nothing, and threads calling them at once never meet in malloc.
+
+/// Alignment of every buffer taken from a workspace: a cache line, and one AVX-512 load
+static constexpr std::size_t WORKSPACE_ALIGN = 64;
+
+/// A per-thread bump arena. Buffers are taken inside workspace::frame scopes and given back, in
+/// stack order, when their frame ends.
+/// A buffer that does not fit the current block goes into a new one, so the buffers already
+/// handed out stay where they are; when the outermost frame ends the blocks are merged into a
+/// single block as large as all of them, after which the same calls fit without allocating.
+class workspace
+{
+public:
+    /// The calling thread's workspace
+    static workspace& local()
+    {
+        static thread_local workspace w;
+        return w;
+    }
+
+    /// Grows every thread's workspace to at least `bytes`, each the next time it is used, so a
+    /// workload known in advance allocates nothing at all in the kernels, not even on first use
+    static void reserve_all(std::size_t bytes)
+    {
+        auto& floor = reserved();
+        auto current = floor.load();
+        while(current < bytes && !floor.compare_exchange_weak(current, bytes)){}
+    }
+
+    /// Grows this workspace to at least `bytes`
+    void reserve(std::size_t bytes)
+    {
+        if(capacity() >= bytes)
+            return;
+        if(m_depth == 0)
+            m_blocks.clear();
+        // Inside a frame the buffers taken so far must stay put, so the difference is added as a
+        // block of its own and merged in when the outermost frame ends
+        m_blocks.emplace_back(bytes - capacity());
+    }
+
+    /// Bytes that can be taken without allocating, once no frame is open
+    std::size_t capacity() const
+    {
+        std::size_t total = 0;
+        for(const auto& b : m_blocks)
+            total += b.size();
+        return total;
+    }
+
+    /// Frees the workspace's memory. Buffers taken from it must not be in use.
+    void shrink()
+    {
+        if(m_depth == 0)
+            m_blocks.clear();
+    }
+
+    /// A scope that buffers are taken in. Everything taken from a frame is given back when it ends.
+    class frame
+    {
+    public:
+        /// A frame on the calling thread's workspace
+        frame() : frame(local()) {}
+
+        explicit frame(workspace& w) : m_workspace(w), m_block(w.m_block), m_top(w.m_top)
+        {
+            if(w.m_depth == 0)
+                w.reserve(reserved().load(std::memory_order_relaxed));
+            w.m_depth++;
+        }
+
+        ~frame() { m_workspace.pop(m_block, m_top); }
+
+        frame(const frame&) = delete;
+        frame& operator=(const frame&) = delete;
+
+        /// n uninitialized values, aligned to WORKSPACE_ALIGN and valid until the frame ends
+        template <class T>
+        T* take(std::size_t n)
+        {
+            return static_cast<T*>(m_workspace.take(n * sizeof(T)));
+        }
+
+        /// n zeroed values, aligned to WORKSPACE_ALIGN and valid until the frame ends
+        template <class T>
+        T* take_zeroed(std::size_t n)
+        {
+            auto p = take<T>(n);
+            std::fill(p, p + n, T(0));
+            return p;
+        }
+
+    private:
+        workspace& m_workspace;
+        std::size_t m_block;
+        std::size_t m_top;
+    };
+
+private:
+    // Blocks of a large workload are backed as set_page_policy() selects, like the packed operands
+    using block_t = std::vector<std::uint8_t, huge_page_allocator<std::uint8_t>>;
+
+    // The first block is never smaller than this, so small calls do not grow it step by step
+    static constexpr std::size_t MIN_BLOCK = std::size_t(1) << 16;
+
+    static std::atomic<std::size_t>& reserved()
+    {
+        static std::atomic<std::size_t> bytes{0};
+        return bytes;
+    }
+
+    void* take(std::size_t bytes)
+    {
+        bytes = (std::max<std::size_t>(bytes, 1) + WORKSPACE_ALIGN - 1) / WORKSPACE_ALIGN * WORKSPACE_ALIGN;
+        while(m_block < m_blocks.size() && m_top + bytes > m_blocks[m_block].size()){
+            m_block++;
+            m_top = 0;
+        }
+        if(m_block == m_blocks.size()){
+            // Doubling keeps the number of blocks, and merges, logarithmic in the high-water mark
+            m_blocks.emplace_back(std::max({bytes, capacity(), MIN_BLOCK}));
+            m_top = 0;
+        }
+        auto p = m_blocks[m_block].data() + m_top;
+        m_top += bytes;
+        return p;
+    }
+
+    void pop(std::size_t block, std::size_t top)
+    {
+        m_block = block;
+        m_top = top;
+        if(--m_depth == 0 && m_blocks.size() > 1){
+            const auto total = capacity();
+            m_blocks.clear();
+            m_blocks.emplace_back(total);
+        }
+    }
+
+    std::vector<block_t> m_blocks;
+    // Next free byte: block index and offset into it
+    std::size_t m_block = 0;
+    std::size_t m_top = 0;
+    // Number of open frames
+    std::size_t m_depth = 0;
+};
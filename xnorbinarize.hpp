@@ -0,0 +1,262 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "xnorpacked.hpp"
+#include "bittensor.hpp"
+
+// Re-binarization for stacked binary layers. The next layer only needs sign(BN(a . w)), so batch
+// norm is folded into one integer threshold per output channel, the raw dot products are compared
+// against it as the gemm writes each tile back, and the results are stored as packed sign bits.
+// Layers chained this way pass 1 bit per activation instead of a 32-bit float.
+
+/// Which side of its threshold makes an output channel negative
+enum class threshold_direction : bool
+{
+    below = false,      // -1 when dot < threshold, for a positive batch norm scale
+    at_or_above = true, // -1 when dot >= threshold, for a negative one
+};
+
+/// sign(BN(dot)) folded per output channel j into an integer comparison of the raw dot product:
+/// the output is -1 (a set bit) when dot < threshold(j), or dot >= threshold(j) if the channel's
+/// direction is at_or_above. BN outputs of exactly 0 give +1.
+class sign_thresholds
+{
+public:
+    sign_thresholds() = default;
+
+    /// Thresholds given directly, e.g. from a model exported with them already folded
+    sign_thresholds(std::vector<std::int32_t> thresholds, std::vector<threshold_direction> directions)
+        : m_thresholds(std::move(thresholds)), m_directions(std::move(directions))
+    {
+        if(m_thresholds.size() != m_directions.size())
+            throw std::runtime_error("sign_thresholds: " + std::to_string(m_thresholds.size()) + " thresholds but "
+                                     + std::to_string(m_directions.size()) + " directions");
+    }
+
+    /// Folds y = gamma * (scale * dot - mean) / sqrt(var + eps) + beta, per channel
+    /// \param gamma - BN scale of every channel
+    /// \param beta - BN shift of every channel
+    /// \param mean - running mean of every channel
+    /// \param var - running variance of every channel
+    /// \param channels - number of output channels, i.e. columns of the gemm
+    /// \param eps - added to the variance
+    /// \param scale - if not null, what each channel's dot product is multiplied by before BN, e.g. the
+    ///                mean |w| of a filter. A per-row scale would make the thresholds per element, so there is none.
+    sign_thresholds(const float* gamma, const float* beta, const float* mean, const float* var, std::size_t channels,
+                    float eps = 1e-5f, const float* scale = nullptr)
+        : m_thresholds(channels), m_directions(channels)
+    {
+        for(std::size_t j = 0; j < channels; j++){
+            const double sd = std::sqrt(static_cast<double>(var[j]) + eps);
+            const double s = scale ? scale[j] : 1.0;
+            // y = gamma * s / sd * (dot - t)
+            const double g = gamma[j] * s;
+            if(g == 0.0){
+                // y is beta - gamma * mean / sd whatever the dot product
+                const double c = beta[j] - gamma[j] * static_cast<double>(mean[j]) / sd;
+                m_thresholds[j] = c < 0.0 ? std::numeric_limits<std::int32_t>::max() : std::numeric_limits<std::int32_t>::min();
+                m_directions[j] = threshold_direction::below;
+                continue;
+            }
+            // t is solved for directly rather than as -c / (gamma * s / sd), which rounds twice and can
+            // move a BN output of exactly 0 to the negative side. With beta 0 and no scale it is mean itself.
+            const double t = (mean[j] - beta[j] * sd / gamma[j]) / s;
+            // y < 0 <=> dot < t for g > 0, dot > t for g < 0. Dot products are integers, so
+            // dot < t <=> dot < ceil(t) and dot > t <=> dot >= floor(t) + 1.
+            m_directions[j] = g > 0.0 ? threshold_direction::below : threshold_direction::at_or_above;
+            m_thresholds[j] = clamp(g > 0.0 ? std::ceil(t) : std::floor(t) + 1.0);
+        }
+    }
+
+    /// Whether the output of channel j is -1 for the dot product dot
+    bool negative(long long dot, std::size_t j) const
+    {
+        return (dot < m_thresholds[j]) != (m_directions[j] == threshold_direction::at_or_above);
+    }
+
+    std::size_t size() const { return m_thresholds.size(); }
+    const std::vector<std::int32_t>& thresholds() const { return m_thresholds; }
+    const std::vector<threshold_direction>& directions() const { return m_directions; }
+
+private:
+    // Thresholds past any dot product an int32 can hold keep their meaning when clamped, and NaN,
+    // from a zero variance with eps 0, is treated as 0
+    static std::int32_t clamp(double t)
+    {
+        if(std::isnan(t))
+            return 0;
+        return static_cast<std::int32_t>(std::min<double>(std::max<double>(t, std::numeric_limits<std::int32_t>::min()),
+                                                          std::numeric_limits<std::int32_t>::max()));
+    }
+
+    std::vector<std::int32_t> m_thresholds;
+    std::vector<threshold_direction> m_directions;
+};
+
+namespace gemm{
+    // A register tile's NR columns fall in one byte of the packed output
+    static_assert(NUM_BITS % NR == 0, "NR must divide a byte");
+
+    /// macrokernel that compares the finished dot products against thresholds and stores packed sign
+    /// bits. One MC x NT output tile is run at a time; when K spans several KC slices the partial
+    /// sums are kept in acc, mc x NT int32 values, until the last slice.
+    /// \param bits - packed output rows, LSB-first
+    /// \param row_bytes - distance in bytes between output rows
+    /// \param cols - columns of the whole output, so the last byte of a row is written with its tail zero
+    inline void sign_macrokernel(const std::uint64_t* pa, const std::uint64_t* pb, std::size_t chunks,
+                                 std::size_t ic, std::size_t mc, std::size_t jc, std::size_t nc,
+                                 std::size_t pc, std::size_t kc, std::size_t kc_bits, std::int32_t* acc,
+                                 std::uint8_t* bits, std::size_t row_bytes, std::size_t cols,
+                                 const sign_thresholds& thresholds)
+    {
+        const bool first = pc == 0;
+        const bool last = pc + kc == chunks;
+        std::uint64_t counts[MR * NR];
+        const auto microkernel = dispatch();
+        for(std::size_t jr = jc; jr < jc + nc; jr += NR){
+            const auto b = pb + ((jr / NR) * NR * chunks + pc * NR) * CHUNK_WORDS;
+            const auto n = std::min(NR, jc + nc - jr);
+            for(std::size_t ir = ic; ir < ic + mc; ir += MR){
+                const auto a = pa + ((ir / MR) * MR * chunks + pc * MR) * CHUNK_WORDS;
+                const auto m = std::min(MR, ic + mc - ir);
+                microkernel(kc, a, b, counts);
+                for(std::size_t r = 0; r < m; r++){
+                    const auto partial = acc ? acc + (ir - ic + r) * NT + (jr - jc) : nullptr;
+                    unsigned group = 0;
+                    for(std::size_t j = 0; j < n; j++){
+                        auto dot = static_cast<long long>(kc_bits) - 2 * static_cast<long long>(counts[r * NR + j]);
+                        if(!first)
+                            dot += partial[j];
+                        if(last)
+                            group |= static_cast<unsigned>(thresholds.negative(dot, jr + j)) << j;
+                        else
+                            partial[j] = static_cast<std::int32_t>(dot);
+                    }
+                    if(!last)
+                        continue;
+                    // Only this group's bits are replaced, and every bit above them when it ends the row
+                    auto& byte = bits[(ir + r) * row_bytes + jr / NUM_BITS];
+                    const auto shift = jr % NUM_BITS;
+                    const auto mask = (jr + n == cols ? 0xffu : (1u << n) - 1) << shift;
+                    byte = static_cast<std::uint8_t>((byte & ~mask) | (group << shift));
+                }
+            }
+        }
+    }
+
+    /// Runs the blocked loops over packed panels, writing sign(BN(op(A) . op(B))) as packed bits.
+    /// Output tiles are MC x NT in both modes, so every task writes whole bytes of its own.
+    /// \param packed_a1 - MR-row panels of op(A)
+    /// \param packed_a2 - NR-row panels of the columns of op(B)
+    /// \param bits - packed output, rows of (cols + 7) / 8 bytes with the bits past cols zero;
+    ///              any padding past that is left as it is
+    /// \param row_bytes - distance in bytes between output rows
+    /// \param thresholds - one per output column
+    inline void run_signs(const std::uint64_t* packed_a1, const std::uint64_t* packed_a2, std::uint8_t* bits,
+                          std::size_t row_bytes, std::size_t rows, std::size_t cols, std::size_t col_size,
+                          ::execution mode, const sign_thresholds& thresholds)
+    {
+        if(thresholds.size() != cols)
+            throw std::runtime_error("xnorgemm: " + std::to_string(thresholds.size()) + " thresholds for "
+                                     + std::to_string(cols) + " output channels");
+        const auto chunks = (col_size + CHUNK_BITS - 1) / CHUNK_BITS;
+        static constexpr auto KC_CHUNKS = KC / CHUNK_BITS;
+        const auto row_blocks = (rows + MC - 1) / MC;
+        const auto tiles_per_block = (std::min(NC, cols) + NT - 1) / NT;
+        const auto col_blocks = (cols + NC - 1) / NC;
+        // Same task order as run, so threads sweep the same B panel together
+        auto tile = [&](std::size_t t){
+            const auto jc = (t / (row_blocks * tiles_per_block)) * NC;
+            const auto ic = ((t / tiles_per_block) % row_blocks) * MC;
+            const auto jt = jc + (t % tiles_per_block) * NT;
+            if(jt >= std::min(cols, jc + NC))
+                return;
+            const auto nt = std::min(NT, cols - jt);
+            const auto mc = std::min(MC, rows - ic);
+            workspace::frame frame;
+            const auto acc = chunks > KC_CHUNKS ? frame.take<std::int32_t>(mc * NT) : nullptr;
+            for(std::size_t pc = 0; pc < chunks; pc += KC_CHUNKS){
+                const auto kc = std::min(KC_CHUNKS, chunks - pc);
+                const auto kc_bits = std::min(KC, col_size - pc * CHUNK_BITS);
+                sign_macrokernel(packed_a1, packed_a2, chunks, ic, mc, jt, nt, pc, kc, kc_bits, acc,
+                                 bits, row_bytes, cols, thresholds);
+            }
+        };
+        const auto tasks = col_blocks * row_blocks * tiles_per_block;
+        if(mode == ::execution::parallel)
+            thread_pool::global().parallel_for(tasks, tile);
+        else
+            for(std::size_t t = 0; t < tasks; t++)
+                tile(t);
+    }
+
+    /// MR-row panels of a bit view, e.g. the packed output of the previous layer
+    inline const std::uint64_t* left_panels(const const_bit_view& v, ::execution mode, workspace::frame& frame){
+        if(v.dimension() != 2)
+            throw std::runtime_error("xnorgemm: expected a 2-D bit view, got " + std::to_string(v.dimension())
+                                     + " dimensions");
+        const auto packed = frame.take<std::uint64_t>(panel_words(v.shape()[0], v.shape()[1], MR));
+        pack_panels_into(packed, v, MR, mode);
+        return packed;
+    }
+
+    /// Computes sign(BN(a . b)) as packed bits into a caller-owned buffer, see run_signs
+    /// \param a - rows x col_size left operand: an expression, a packed_binary_matrix or a bit view
+    /// \param b - col_size x cols right operand: an expression or a packed_binary_matrix
+    template <class E1, class E2>
+    inline void compute_signs(const E1& a, const E2& b, std::uint8_t* bits, std::size_t row_bytes, ::execution mode,
+                              const sign_thresholds& thresholds)
+    {
+        const std::size_t rows = a.shape()[0], col_size = a.shape()[1], cols = b.shape()[1];
+        if(b.shape()[0] != col_size)
+            throw std::runtime_error("xnorgemm: inner dimensions " + std::to_string(col_size) + " and "
+                                     + std::to_string(b.shape()[0]) + " do not match");
+        if(col_size == 0){
+            // Every dot product is 0
+            if(thresholds.size() != cols)
+                throw std::runtime_error("xnorgemm: " + std::to_string(thresholds.size()) + " thresholds for "
+                                         + std::to_string(cols) + " output channels");
+            for(std::size_t i = 0; i < rows; i++){
+                std::fill(bits + i * row_bytes, bits + i * row_bytes + (cols + NUM_BITS - 1) / NUM_BITS, std::uint8_t(0));
+                for(std::size_t j = 0; j < cols; j++)
+                    bits[i * row_bytes + j / NUM_BITS] |= static_cast<std::uint8_t>(thresholds.negative(0, j) << (j % NUM_BITS));
+            }
+            return;
+        }
+        workspace::frame frame;
+        const auto packed_a1 = left_panels(a, mode, frame);
+        const auto packed_a2 = right_panels(b, mode, frame);
+        run_signs(packed_a1, packed_a2, bits, row_bytes, rows, cols, col_size, mode, thresholds);
+    }
+} // gemm
+
+/// A binary layer feeding another: sign(BN(a . b)) with batch norm folded into thresholds, written
+/// straight to packed bits with no float output. Pass the result's view() as the next layer's a.
+/// \param a - 2-D expression, a left packed_binary_matrix, or a 2-D bit view such as a previous layer's output
+/// \param b - 2-D expression or a right packed_binary_matrix, e.g. the weights
+/// \param thresholds - one per column of b
+/// \param mode - sequential, or spread packing and output tiles across the thread pool
+/// \param row_align - row stride granularity of the result in bits, a multiple of 64
+template <class E1, class E2,
+          std::enable_if_t<(gemm::is_operand<E1>::value || std::is_convertible<const E1&, const_bit_view>::value)
+                           && gemm::is_operand<E2>::value, int> = 0>
+inline bit_tensor xnorgemm_signs(const E1& a, const E2& b, const sign_thresholds& thresholds,
+                                 ::execution mode = ::execution::sequential,
+                                 std::size_t row_align = bit_tensor::ROW_ALIGN){
+    if(a.dimension() != 2 || b.dimension() != 2)
+        throw std::runtime_error("xnorgemm: needs two matrices");
+    bit_tensor res(bit_tensor::shape_type{a.shape()[0], b.shape()[1]}, row_align);
+    if constexpr(std::is_convertible<const E1&, const_bit_view>::value)
+        gemm::compute_signs(static_cast<const_bit_view>(a), b, (std::uint8_t*) res.data(), res.row_bits() / NUM_BITS,
+                            mode, thresholds);
+    else
+        gemm::compute_signs(a, b, (std::uint8_t*) res.data(), res.row_bits() / NUM_BITS, mode, thresholds);
+    return res;
+}
@@ -0,0 +1,163 @@
+#pragma once
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <xtensor/xarray.hpp>
+#include <xtensor/xexpression.hpp>
+#include <xtl/xclosure.hpp>
+
+#include "xnordot.hpp"
+#include "xnorgemm.hpp"
+#include "threadpool.hpp"
+
+// A tensor that takes part in products through the signs of its elements only. Wrapping both
+// operands of xt::linalg::dot routes the product to the xnor engines, so model code written
+// against xtensor-blas moves to binary arithmetic by changing the operand type.
+
+/// Products whose operands span at least this many element pairs go to the thread pool
+static constexpr std::size_t BINARY_PARALLEL_WORK = std::size_t(1) << 22;
+
+/// Sign-binarized view of an xtensor expression: every element reads as +1 unless its sign bit
+/// is set, then -1, as sign() packs it: -0.0 is -1. uint8 and bool follow sign() too (below 128, false).
+/// \tparam CT - closure type: a value type owns the tensor, e.g. binary_tensor<xt::xarray<float>>,
+///              a const reference wraps one that lives elsewhere
+template <class CT>
+class binary_tensor
+{
+public:
+    using expression_type = std::decay_t<CT>;
+
+    template <class E, std::enable_if_t<!std::is_same<std::decay_t<E>, binary_tensor>::value, int> = 0>
+    binary_tensor(E&& e) : m_e(std::forward<E>(e)) {}
+
+    const expression_type& expression() const { return m_e; }
+    std::size_t dimension() const { return m_e.dimension(); }
+    const auto& shape() const { return m_e.shape(); }
+    std::size_t size() const { return m_e.size(); }
+
+private:
+    CT m_e;
+};
+
+/// Wraps an expression as a binary_tensor, by reference if it is an lvalue and by value otherwise
+template <class E, std::enable_if_t<xt::is_xexpression<std::decay_t<E>>::value, int> = 0>
+inline binary_tensor<xtl::closure_type_t<E>> as_binary(E&& e){
+    return binary_tensor<xtl::closure_type_t<E>>(std::forward<E>(e));
+}
+
+namespace binary{
+    /// Whether E is a tensor of a packable type whose elements are contiguous in row-major order behind data()
+    template <class E>
+    constexpr bool is_contiguous(){
+        if constexpr(xt::has_data_interface<E>::value)
+            return expr::is_packable<typename E::value_type>::value
+                   && E::contiguous_layout && E::static_layout == xt::layout_type::row_major;
+        else
+            return false;
+    }
+
+    /// y(i) = xnordot of row i of a, read row-major as rows x k, with x. x is packed once and every
+    /// row is signed into an L1 buffer and counted against it, so a is read exactly once.
+    template <class E1, class E2>
+    inline void matvec(const E1& a, std::size_t rows, std::size_t k, const E2& x, float* y, ::execution mode){
+        const auto bytes = (k + NUM_BITS - 1) / NUM_BITS;
+        workspace::frame frame;
+        const auto bx = frame.take<std::uint8_t>(bytes);
+        sign(x, bx, mode);
+        const bool simd = expr::linear_simd(a);
+        auto task = [&](std::size_t t){
+            workspace::frame task_frame;
+            const auto row = task_frame.take<std::uint8_t>(bytes);
+            for(std::size_t i = t * PACK_ROWS; i < std::min(rows, (t + 1) * PACK_ROWS); i++){
+                expr::sign(a, simd, i * k, (i + 1) * k, row);
+                y[i] = static_cast<float>(xnor_sum(row, bx, k));
+            }
+        };
+        const auto tasks = (rows + PACK_ROWS - 1) / PACK_ROWS;
+        if(mode == ::execution::parallel)
+            thread_pool::global().parallel_for(tasks, task);
+        else
+            for(std::size_t t = 0; t < tasks; t++)
+                task(t);
+    }
+
+    /// c = a . b with a read row-major as rows x k and b a k x cols matrix, through the blocked gemm
+    template <class E1, class E2>
+    inline void matmul(const E1& a, std::size_t rows, std::size_t k, const E2& b, float* c, ::execution mode){
+        const std::size_t cols = b.shape()[1];
+        if(k == 0){
+            std::fill(c, c + rows * cols, 0.f);
+            return;
+        }
+        workspace::frame frame;
+        const auto packed_a1 = frame.take<std::uint64_t>(panel_words(rows, k, MR));
+        const auto packed_a2 = frame.take<std::uint64_t>(panel_words(cols, k, NR));
+        pack_panels_into(packed_a1, a, rows, k, MR, mode);
+        pack_column_panels_into(packed_a2, b, NR, mode);
+        gemm::run(packed_a1, packed_a2, c, cols, rows, cols, k, mode);
+    }
+} // binary
+
+/// Dot product of two binary tensors with the semantics of xt::linalg::dot, numpy.dot restricted
+/// to a right operand of at most two axes:
+///  - vector . vector is a one-element tensor, through the fused sign + xnor + popcount when both are contiguous
+///  - (..., k) . (k) is a gemv over the rows of the left operand
+///  - (..., k) . (k, n) is a gemm, with the leading axes of the left operand folded into its rows
+/// \param a - left operand
+/// \param b - right operand
+/// \param mode - sequential, or spread packing and the product across the thread pool
+template <class CT1, class CT2>
+inline xt::xarray<float> binary_dot(const binary_tensor<CT1>& a, const binary_tensor<CT2>& b,
+                                    ::execution mode = ::execution::sequential){
+    const auto& x = a.expression();
+    const auto& y = b.expression();
+    using E1 = std::decay_t<decltype(x)>;
+    using E2 = std::decay_t<decltype(y)>;
+    if(x.dimension() == 0 || y.dimension() == 0 || y.dimension() > 2)
+        throw std::runtime_error("binary_dot: operands of " + std::to_string(x.dimension()) + " and "
+                                 + std::to_string(y.dimension()) + " dimensions are not supported");
+    const std::size_t k = x.shape()[x.dimension() - 1];
+    if(y.shape()[0] != k)
+        throw std::runtime_error("binary_dot: inner dimensions " + std::to_string(k) + " and "
+                                 + std::to_string(y.shape()[0]) + " do not match");
+
+    // The result has the shape of x without its last axis followed by the shape of y without its first
+    std::vector<std::size_t> shape(x.shape().begin(), x.shape().end() - 1);
+    shape.insert(shape.end(), y.shape().begin() + 1, y.shape().end());
+    std::size_t rows = 1;
+    for(std::size_t d = 0; d + 1 < x.dimension(); d++)
+        rows *= x.shape()[d];
+
+    xt::xarray<float> res;
+    if(x.dimension() == 1 && y.dimension() == 1){
+        res.resize({1});
+        if constexpr(binary::is_contiguous<E1>() && binary::is_contiguous<E2>())
+            res(0) = static_cast<float>(xnordot(x.data(), y.data(), k, mode));
+        else
+            res(0) = static_cast<float>(xnordot(x, y, mode));
+        return res;
+    }
+    res.resize(shape);
+    if(y.dimension() == 1)
+        binary::matvec(x, rows, k, y, res.data(), mode);
+    else
+        binary::matmul(x, rows, k, y, res.data(), mode);
+    return res;
+}
+
+namespace xt{
+    namespace linalg{
+        /// xt::linalg::dot on binary tensors runs on the xnor engines, see binary_dot. Large
+        /// products are spread across the thread pool.
+        template <class CT1, class CT2>
+        inline xt::xarray<float> dot(const ::binary_tensor<CT1>& a, const ::binary_tensor<CT2>& b){
+            const std::size_t cols = b.dimension() == 2 ? b.shape()[1] : 1;
+            const auto mode = a.size() * cols >= BINARY_PARALLEL_WORK ? ::execution::parallel : ::execution::sequential;
+            return binary_dot(a, b, mode);
+        }
+    } // linalg
+} // xt
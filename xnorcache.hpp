@@ -0,0 +1,237 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <typeindex>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+#include "xnorpacked.hpp"
+
+// Memoized packing for operands that change slowly, like an embedding table, an online-learned
+// weight matrix or a retrieval index, that are queried far more often than they are written.
+// The cache keeps the packed form of each buffer it has seen. Writers record which rows they
+// changed, and the next lookup re-signs only those rows into the cached panels.
+
+/// A cached buffer with more than 1 / CACHE_REPACK_DIVISOR of its rows dirty is packed from scratch,
+/// which spreads across the thread pool and streams the buffer instead of visiting scattered rows
+static constexpr std::size_t CACHE_REPACK_DIVISOR = 4;
+
+/// Packed forms of row-major buffers, keyed by the buffer's address, the operand side it is packed
+/// for and the element type it is read as. Rows are packed as in packed_binary_matrix's buffer constructor.
+/// A cached form is brought up to date on lookup:
+///  - rows marked dirty since the last lookup are repacked, whatever the version
+///  - a new version with no dirty rows means the buffer changed in unknown places, so it is repacked whole
+///  - a buffer looked up with another shape is repacked whole
+/// All members may be called from several threads. The cache's lock is only held to look entries up
+/// and to publish them: packing and repacking run outside it, one update of an entry at a time, so a
+/// writer's update never blocks lookups of the other entries, or of the same entry's last version
+/// once it is current.
+/// A matrix returned by get() is never modified afterwards. Updates go to a copy while it is still
+/// held; an entry that is updated incrementally keeps its previous version as a spare, which is
+/// repacked in its place once its readers have let go of it, so the copy is not paid on every update.
+/// Such an entry takes twice the memory of its packed form.
+class packing_cache
+{
+public:
+    using matrix_ptr = std::shared_ptr<const packed_binary_matrix>;
+
+    /// Records that row `row` of the buffer at data changed. Does nothing for a buffer that is not cached.
+    void mark_dirty(const void* data, std::size_t row)
+    {
+        mark_dirty(data, row, row + 1);
+    }
+
+    /// Records that rows [begin, end) of the buffer at data changed
+    void mark_dirty(const void* data, std::size_t begin, std::size_t end)
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        const auto it = m_buffers.find(data);
+        if(it == m_buffers.end())
+            return;
+        for(auto& form : it->second){
+            auto& e = *form.second;
+            const auto last = std::min(end, e.rows);
+            if(begin >= last)
+                continue;
+            e.marks++;
+            // Past the threshold the entry is repacked whole anyway, so the rows are not kept
+            if(e.whole || e.dirty.size() + (last - begin) > e.rows / CACHE_REPACK_DIVISOR){
+                e.whole = true;
+                e.dirty.clear();
+                continue;
+            }
+            for(auto i = begin; i < last; i++)
+                e.dirty.push_back(i);
+        }
+    }
+
+    /// The packed form of a row-major buffer, packing or repacking as much of it as has changed
+    /// \param data - first element of the buffer, of any type sign() accepts; its address and type are the key
+    /// \param rows - number of rows
+    /// \param cols - values per row
+    /// \param ld - distance in elements between rows
+    /// \param side - the operand the buffer is packed for
+    /// \param version - the caller's version of the buffer's contents
+    /// \param mode - sequential, or spread packing across the thread pool
+    /// \param scales - whether the packed form keeps its scaling factors; a form cached without them
+    ///                 is repacked whole the first time they are asked for
+    template <class T>
+    matrix_ptr get(const T* data, std::size_t rows, std::size_t cols, std::size_t ld, operand_side side,
+                   std::uint64_t version, ::execution mode = ::execution::sequential,
+                   ::scale_mode scales = ::scale_mode::none)
+    {
+        std::shared_ptr<entry> e;
+        {
+            std::lock_guard<std::mutex> lk(m_lock);
+            auto& slot = m_buffers[static_cast<const void*>(data)][{side, std::type_index(typeid(T))}];
+            if(!slot)
+                slot = std::make_shared<entry>();
+            e = slot;
+            if(e->current(rows, cols, ld, version, scales))
+                return e->packed;
+        }
+
+        std::lock_guard<std::mutex> update(e->update);
+        std::shared_ptr<packed_binary_matrix> old;
+        std::vector<std::size_t> dirty;
+        std::uint64_t marks;
+        bool whole, in_place;
+        {
+            std::lock_guard<std::mutex> lk(m_lock);
+            // Another thread may have brought the entry up to date while this one waited
+            if(e->current(rows, cols, ld, version, scales))
+                return e->packed;
+            whole = !e->shaped(rows, cols, ld, scales) || e->whole || (e->version != version && e->dirty.empty());
+            dirty = e->dirty;
+            marks = e->marks;
+            old = e->packed;
+            // The entry is not current, so no lookup hands its matrix out until this update is published;
+            // if no reader holds it either, it can be repacked where it is
+            in_place = old.use_count() == 2;
+        }
+
+        std::shared_ptr<packed_binary_matrix> fresh;
+        if(whole){
+            fresh = std::make_shared<packed_binary_matrix>(data, rows, cols, ld, side, mode, scales);
+            e->spare.reset();
+        }
+        else{
+            std::sort(dirty.begin(), dirty.end());
+            dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+            // The spare lagged the old version, which lags the buffer by these rows
+            e->lag(dirty);
+            if(in_place){
+                fresh = old;
+                fresh->repack(data, ld, dirty, mode);
+            }
+            else{
+                // Once the entry holds the spare's only reference its readers are gone, and as it is no
+                // longer handed out none can come back
+                if(e->spare && e->spare.use_count() == 1){
+                    fresh = std::move(e->spare);
+                    fresh->repack(data, ld, e->spare_dirty, mode);
+                }
+                else{
+                    fresh = std::make_shared<packed_binary_matrix>(*old);
+                    fresh->repack(data, ld, dirty, mode);
+                }
+                e->spare = std::move(old);
+                e->spare_dirty = std::move(dirty);
+            }
+        }
+
+        std::lock_guard<std::mutex> lk(m_lock);
+        e->packed = fresh;
+        e->rows = rows;
+        e->cols = cols;
+        e->ld = ld;
+        e->version = version;
+        // Rows marked while this update ran may have been read before they were written, so they stay
+        // dirty for the next lookup
+        if(e->marks == marks){
+            e->whole = false;
+            e->dirty.clear();
+        }
+        return fresh;
+    }
+
+    /// Drops the packed forms of the buffer at data, e.g. before it is freed
+    void erase(const void* data)
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        m_buffers.erase(data);
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        m_buffers.clear();
+    }
+
+    /// Number of cached packed forms
+    std::size_t size() const
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        std::size_t total = 0;
+        for(const auto& buffer : m_buffers)
+            total += buffer.second.size();
+        return total;
+    }
+
+private:
+    struct entry
+    {
+        // Published state, guarded by the cache's lock
+        std::shared_ptr<packed_binary_matrix> packed;
+        std::size_t rows = 0;
+        std::size_t cols = 0;
+        std::size_t ld = 0;
+        std::uint64_t version = 0;
+        // Whether so much changed that the dirty rows are not worth tracking
+        bool whole = false;
+        std::vector<std::size_t> dirty;
+        // Number of mark_dirty calls that reached the entry, to tell whether any came during an update
+        std::uint64_t marks = 0;
+
+        // Held by the thread packing the entry; the spare is only touched under it
+        std::mutex update;
+        // The version before packed, and the rows it lags packed by, sorted
+        std::shared_ptr<packed_binary_matrix> spare;
+        std::vector<std::size_t> spare_dirty;
+
+        bool shaped(std::size_t r, std::size_t c, std::size_t l, ::scale_mode scales) const
+        {
+            return packed && rows == r && cols == c && ld == l
+                   && (scales == ::scale_mode::none || !packed->scales().empty());
+        }
+
+        bool current(std::size_t r, std::size_t c, std::size_t l, std::uint64_t v, ::scale_mode scales) const
+        {
+            return shaped(r, c, l, scales) && !whole && dirty.empty() && version == v;
+        }
+
+        /// Adds rows to what the spare lags by, dropping it once repacking it would cost as much as a copy
+        void lag(const std::vector<std::size_t>& rows_changed)
+        {
+            if(!spare)
+                return;
+            spare_dirty.insert(spare_dirty.end(), rows_changed.begin(), rows_changed.end());
+            std::sort(spare_dirty.begin(), spare_dirty.end());
+            spare_dirty.erase(std::unique(spare_dirty.begin(), spare_dirty.end()), spare_dirty.end());
+            if(spare_dirty.size() > rows / CACHE_REPACK_DIVISOR){
+                spare.reset();
+                spare_dirty.clear();
+            }
+        }
+    };
+
+    // Forms of one buffer: the side it is packed for and the element type it is read as
+    using form_key = std::pair<operand_side, std::type_index>;
+
+    std::map<const void*, std::map<form_key, std::shared_ptr<entry>>> m_buffers;
+    mutable std::mutex m_lock;
+};
@@ -4,6 +4,17 @@
 #include <iostream>
 #include <vector>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+#include <tuple>
+#include <type_traits>
+
+// xtensor expressions are packed straight from their xsimd batches
+#include <xtensor/xarray.hpp>
+#include <xtensor/xassign.hpp>
+#include <xtensor/xexpression.hpp>
 
 // xtensor bitset simd instructions
 #include <xtl/xdynamic_bitset.hpp>
@@ -12,29 +23,46 @@
 // intrinsics
 #include <immintrin.h>
 
+#include "threadpool.hpp"
+#include "dispatch.hpp"
+#include "workspace.hpp"
+
 enum class input_alignment : bool
 {
     unsafe = false,
     safe = true,
 };
 
-static constexpr int NUM_BITS = 8;
-// 32 bytes because AVX256
-static constexpr int ALIGN_SIZE = 32;
+/// BLAS-style operand transposition. A transposed operand is read through its strides, never copied.
+enum class transposition : bool
+{
+    none = false,
+    transposed = true,
+};
 
-#define ALLIGN_ASSERT(expr) ALLIGN_ASSERT_IMPL(expr, __FILE__, __LINE__)
-#define ALLIGN_ASSERT_IMPL(expr, file, line)                                                                           \
-    if ((intptr_t)(expr) % ALIGN_SIZE)                                                                                 \
-    {                                                                                                                  \
-        throw std::runtime_error(std::string(file) + ':' + std::to_string(line) + ": Not alligned (" #expr ") \n\t");  \
-    }
+/// IEEE binary16 value kept as its bit pattern. Packing only needs the sign bit, so nothing is converted.
+struct float16
+{
+    std::uint16_t bits;
+};
 
-#define C_LAYOUT_ASSERT(expr) C_LAYOUT_ASSERT_IMPL(expr, __FILE__, __LINE__)
-#define C_LAYOUT_ASSERT_IMPL(expr, file,line)                                                                          \
-    if (expr.layout() != xt::layout_type::row_major)                                                                   \
-    {                                                                                                                  \
-        throw std::runtime_error(std::string(file) + ':' + std::to_string(line) + ": Layout not C-style (" #expr ") \n\t"); \
-    }
+/// bfloat16 value (the top half of a float) kept as its bit pattern
+struct bfloat16
+{
+    std::uint16_t bits;
+};
+
+static constexpr int NUM_BITS = 8;
+// 32 bytes because AVX256. Inputs may have any alignment: the kernels peel up to this boundary
+// or use unaligned loads, so nothing depends on how the caller's allocator aligns its buffers.
+static constexpr int ALIGN_SIZE = 32;
+// Floats per split-K chunk of a parallel xnordot: 256KB per operand, so a pair fits in L2.
+// A multiple of 256 keeps every chunk on whole harley-seal blocks and on the input's alignment.
+static constexpr std::size_t DOT_CHUNK = 1 << 16;
+// Floats per task of a parallel sign packing: 256KB read and 8KB written per task
+static constexpr std::size_t PACK_CHUNK = 1 << 16;
+// Values of an xtensor expression evaluated at a time before packing, small enough to stay in L1
+static constexpr std::size_t STAGE_SIZE = 256;
 
 static constexpr std::uint8_t lookup8bit[256] = {
         /* 0 */ 0, /* 1 */ 1, /* 2 */ 1, /* 3 */ 2,
@@ -176,263 +204,344 @@ static constexpr unsigned pt[] = {
         248,
 };
 
-/// performs unsafe load sign on 8 floats at a single time and writes it into int8
-/// \param data - floating point array to extract sign from
-/// \param res - resulting packed bit array
-/// \param size - size of data
-inline void unsafe_sign(const float* data, std::uint8_t* res, std::size_t size){
-    // 8 floats at a time
-    // FLOAT_PACK is related to uint8_t. Change FLOAT_PACK to 16 for AVX512
-    // implies we need ptrs of std::uint16_t.
-    static const auto FLOAT_PACK = 8;
-    const std::uint64_t limit = size - size % (FLOAT_PACK * ALIGN_SIZE);
-    auto i = 0;
-    for(; i < limit; i+= (FLOAT_PACK * ALIGN_SIZE)) {
-        int _accum[8 + ALIGN_SIZE]= {0};
-        int* accum = (int *) ((intptr_t) (_accum) + ALIGN_SIZE - (intptr_t) (_accum) % ALIGN_SIZE);
-
-        ALLIGN_ASSERT(accum)
-        // Load all 32 * 32 floats.
-        __m256 res1 = _mm256_loadu_ps(data + i + pt[0]);
-        __m256 res2 = _mm256_loadu_ps(data + i + pt[1]);
-        __m256 res3 = _mm256_loadu_ps(data + i + pt[2]);
-        __m256 res4 = _mm256_loadu_ps(data + i + pt[3]);
-        __m256 res5 = _mm256_loadu_ps(data + i + pt[4]);
-        __m256 res6 = _mm256_loadu_ps(data + i + pt[5]);
-        __m256 res7 = _mm256_loadu_ps(data + i + pt[6]);
-        __m256 res8 = _mm256_loadu_ps(data + i + pt[7]);
-        __m256 res9 = _mm256_loadu_ps(data + i + pt[8]);
-        __m256 res10 = _mm256_loadu_ps(data + i + pt[9]);
-        __m256 res11 = _mm256_loadu_ps(data + i + pt[10]);
-        __m256 res12 = _mm256_loadu_ps(data + i + pt[11]);
-        __m256 res13 = _mm256_loadu_ps(data + i + pt[12]);
-        __m256 res14 = _mm256_loadu_ps(data + i + pt[13]);
-        __m256 res15 = _mm256_loadu_ps(data + i + pt[14]);
-        __m256 res16 = _mm256_loadu_ps(data + i + pt[15]);
-
-        accum[0] |= _mm256_movemask_ps(res1) << pt[3];
-        accum[0] |= _mm256_movemask_ps(res2) << pt[2];
-        accum[0] |= _mm256_movemask_ps(res3) << pt[1];
-        accum[0] |= _mm256_movemask_ps(res4) << pt[0];
-
-        accum[1] |= _mm256_movemask_ps(res5) << pt[3];
-        accum[1] |= _mm256_movemask_ps(res6) << pt[2];
-        accum[1] |= _mm256_movemask_ps(res7) << pt[1];
-        accum[1] |= _mm256_movemask_ps(res8) << pt[0];
-
-        accum[2] |= _mm256_movemask_ps(res9) << pt[3];
-        accum[2] |= _mm256_movemask_ps(res10) << pt[2];
-        accum[2] |= _mm256_movemask_ps(res11) << pt[1];
-        accum[2] |= _mm256_movemask_ps(res12) << pt[0];
-
-        accum[3] |= _mm256_movemask_ps(res13) << pt[3];
-        accum[3] |= _mm256_movemask_ps(res14) << pt[2];
-        accum[3] |= _mm256_movemask_ps(res15) << pt[1];
-        accum[3] |= _mm256_movemask_ps(res16) << pt[0];
-
-        __m256 res17 = _mm256_loadu_ps(data + i + pt[16]);
-        __m256 res18 = _mm256_loadu_ps(data + i + pt[17]);
-        __m256 res19 = _mm256_loadu_ps(data + i + pt[18]);
-        __m256 res20 = _mm256_loadu_ps(data + i + pt[19]);
-        __m256 res21 = _mm256_loadu_ps(data + i + pt[20]);
-        __m256 res22 = _mm256_loadu_ps(data + i + pt[21]);
-        __m256 res23 = _mm256_loadu_ps(data + i + pt[22]);
-        __m256 res24 = _mm256_loadu_ps(data + i + pt[23]);
-        __m256 res25 = _mm256_loadu_ps(data + i + pt[24]);
-        __m256 res26 = _mm256_loadu_ps(data + i + pt[25]);
-        __m256 res27 = _mm256_loadu_ps(data + i + pt[26]);
-        __m256 res28 = _mm256_loadu_ps(data + i + pt[27]);
-        __m256 res29 = _mm256_loadu_ps(data + i + pt[28]);
-        __m256 res30 = _mm256_loadu_ps(data + i + pt[29]);
-        __m256 res31 = _mm256_loadu_ps(data + i + pt[30]);
-        __m256 res32 = _mm256_loadu_ps(data + i + pt[31]);
-
-        accum[4] |= _mm256_movemask_ps(res17) << pt[3];
-        accum[4] |= _mm256_movemask_ps(res18) << pt[2];
-        accum[4] |= _mm256_movemask_ps(res19) << pt[1];
-        accum[4] |= _mm256_movemask_ps(res20) << pt[0];
-
-        accum[5] |= _mm256_movemask_ps(res21) << pt[3];
-        accum[5] |= _mm256_movemask_ps(res22) << pt[2];
-        accum[5] |= _mm256_movemask_ps(res23) << pt[1];
-        accum[5] |= _mm256_movemask_ps(res24) << pt[0];
-
-        accum[6] |= _mm256_movemask_ps(res25) << pt[3];
-        accum[6] |= _mm256_movemask_ps(res26) << pt[2];
-        accum[6] |= _mm256_movemask_ps(res27) << pt[1];
-        accum[6] |= _mm256_movemask_ps(res28) << pt[0];
-
-        accum[7] |= _mm256_movemask_ps(res29) << pt[3];
-        accum[7] |= _mm256_movemask_ps(res30) << pt[2];
-        accum[7] |= _mm256_movemask_ps(res31) << pt[1];
-        accum[7] |= _mm256_movemask_ps(res32) << pt[0];
-
-        __m256i chunk = _mm256_load_si256((__m256i *) accum);
-        _mm256_store_si256((__m256i*) (res + i/FLOAT_PACK), chunk);
-    }
-
-    for(; i < size - size % FLOAT_PACK; i+=FLOAT_PACK) {
-        __m256 accum = _mm256_loadu_ps(data + i);
-        res[i/FLOAT_PACK] = (std::uint8_t) _mm256_movemask_ps(accum);
-    }
-
-    // If there are any remainders bit-wise
-    if(size - i) {
-        std::uint8_t residue = 0;
-        auto base = i;
-        for (; i < size; i++) {
-            residue |= std::signbit(data[i]) << i - base;
-        }
-        res[i / FLOAT_PACK] = residue;
+// Every variant writes the same LSB-first layout: the sign of float j is bit j % 8 of byte j / 8,
+// which is also bit j % 32 of little-endian 32-bit word j / 32. Bits past the end of the last byte
+// are zero, so packed data can be stored and reused by any kernel.
+// A set bit means -1. Floating point types pack their sign bit (so -0.0 is -1), int8 its top bit,
+// uint8 is offset-binary with zero point 128 (values below 128 are -1), and bool packs false as -1.
+
+// Portable kernels, used when the CPU has neither SSE4.2 nor popcnt
+namespace scalar{
+    inline std::uint32_t sign_bit(float f){
+        std::uint32_t u;
+        std::memcpy(&u, &f, sizeof(u));
+        return u >> 31;
     }
-}
 
-/// performs sign on 8 floats at a single time and writes it into int8
-/// \param data - floating point array to extract sign from
-/// \param res - resulting packed bit array
-/// \param size - size of data
-inline void sign(const float* data, std::uint8_t* res, std::size_t size){
-    ALLIGN_ASSERT(data)
-    ALLIGN_ASSERT(res)
-    // 8 floats at a time
-    // FLOAT_PACK is related to uint8_t. Change FLOAT_PACK to 16 for AVX512
-    // implies we need ptrs of std::uint16_t.
-    static const auto FLOAT_PACK = 8;
-    const std::uint64_t limit = size - size % (FLOAT_PACK * 32);
-    auto i = 0;
-    for(; i < limit; i+= (FLOAT_PACK * 32)) {
-        // In order to keep allignment, we must over-allocate by ALIGN_SIZE
-        int _accum[8 + ALIGN_SIZE]= {0};
-        int* accum = (int*) ((intptr_t)(_accum) + ALIGN_SIZE - (intptr_t)(_accum) % ALIGN_SIZE);
-        ALLIGN_ASSERT(accum)
-        // Load all 32 * 32 floats.
-        __m256 res1 = _mm256_load_ps(data + i + pt[0]);
-        __m256 res2 = _mm256_load_ps(data + i + pt[1]);
-        __m256 res3 = _mm256_load_ps(data + i + pt[2]);
-        __m256 res4 = _mm256_load_ps(data + i + pt[3]);
-        __m256 res5 = _mm256_load_ps(data + i + pt[4]);
-        __m256 res6 = _mm256_load_ps(data + i + pt[5]);
-        __m256 res7 = _mm256_load_ps(data + i + pt[6]);
-        __m256 res8 = _mm256_load_ps(data + i + pt[7]);
-        __m256 res9 = _mm256_load_ps(data + i + pt[8]);
-        __m256 res10 = _mm256_load_ps(data + i + pt[9]);
-        __m256 res11 = _mm256_load_ps(data + i + pt[10]);
-        __m256 res12 = _mm256_load_ps(data + i + pt[11]);
-        __m256 res13 = _mm256_load_ps(data + i + pt[12]);
-        __m256 res14 = _mm256_load_ps(data + i + pt[13]);
-        __m256 res15 = _mm256_load_ps(data + i + pt[14]);
-        __m256 res16 = _mm256_load_ps(data + i + pt[15]);
-
-        accum[0] |= _mm256_movemask_ps(res1) << pt[3];
-        accum[0] |= _mm256_movemask_ps(res2) << pt[2];
-        accum[0] |= _mm256_movemask_ps(res3) << pt[1];
-        accum[0] |= _mm256_movemask_ps(res4) << pt[0];
-
-        accum[1] |= _mm256_movemask_ps(res5) << pt[3];
-        accum[1] |= _mm256_movemask_ps(res6) << pt[2];
-        accum[1] |= _mm256_movemask_ps(res7) << pt[1];
-        accum[1] |= _mm256_movemask_ps(res8) << pt[0];
-
-        accum[2] |= _mm256_movemask_ps(res9) << pt[3];
-        accum[2] |= _mm256_movemask_ps(res10) << pt[2];
-        accum[2] |= _mm256_movemask_ps(res11) << pt[1];
-        accum[2] |= _mm256_movemask_ps(res12) << pt[0];
-
-        accum[3] |= _mm256_movemask_ps(res13) << pt[3];
-        accum[3] |= _mm256_movemask_ps(res14) << pt[2];
-        accum[3] |= _mm256_movemask_ps(res15) << pt[1];
-        accum[3] |= _mm256_movemask_ps(res16) << pt[0];
-
-        __m256 res17 = _mm256_load_ps(data + i + pt[16]);
-        __m256 res18 = _mm256_load_ps(data + i + pt[17]);
-        __m256 res19 = _mm256_load_ps(data + i + pt[18]);
-        __m256 res20 = _mm256_load_ps(data + i + pt[19]);
-        __m256 res21 = _mm256_load_ps(data + i + pt[20]);
-        __m256 res22 = _mm256_load_ps(data + i + pt[21]);
-        __m256 res23 = _mm256_load_ps(data + i + pt[22]);
-        __m256 res24 = _mm256_load_ps(data + i + pt[23]);
-        __m256 res25 = _mm256_load_ps(data + i + pt[24]);
-        __m256 res26 = _mm256_load_ps(data + i + pt[25]);
-        __m256 res27 = _mm256_load_ps(data + i + pt[26]);
-        __m256 res28 = _mm256_load_ps(data + i + pt[27]);
-        __m256 res29 = _mm256_load_ps(data + i + pt[28]);
-        __m256 res30 = _mm256_load_ps(data + i + pt[29]);
-        __m256 res31 = _mm256_load_ps(data + i + pt[30]);
-        __m256 res32 = _mm256_load_ps(data + i + pt[31]);
-
-        accum[4] |= _mm256_movemask_ps(res17) << pt[3];
-        accum[4] |= _mm256_movemask_ps(res18) << pt[2];
-        accum[4] |= _mm256_movemask_ps(res19) << pt[1];
-        accum[4] |= _mm256_movemask_ps(res20) << pt[0];
-
-        accum[5] |= _mm256_movemask_ps(res21) << pt[3];
-        accum[5] |= _mm256_movemask_ps(res22) << pt[2];
-        accum[5] |= _mm256_movemask_ps(res23) << pt[1];
-        accum[5] |= _mm256_movemask_ps(res24) << pt[0];
-
-        accum[6] |= _mm256_movemask_ps(res25) << pt[3];
-        accum[6] |= _mm256_movemask_ps(res26) << pt[2];
-        accum[6] |= _mm256_movemask_ps(res27) << pt[1];
-        accum[6] |= _mm256_movemask_ps(res28) << pt[0];
-
-        accum[7] |= _mm256_movemask_ps(res29) << pt[3];
-        accum[7] |= _mm256_movemask_ps(res30) << pt[2];
-        accum[7] |= _mm256_movemask_ps(res31) << pt[1];
-        accum[7] |= _mm256_movemask_ps(res32) << pt[0];
-
-        __m256i chunk = _mm256_load_si256((__m256i *) accum);
-        _mm256_store_si256((__m256i*) (res + i/FLOAT_PACK), chunk);
-    }
-
-    for(; i < size - size % FLOAT_PACK; i+=FLOAT_PACK) {
-        __m256 accum = _mm256_load_ps(data + i);
-        res[i/FLOAT_PACK] = (std::uint8_t) _mm256_movemask_ps(accum);
-    }
-
-    // If there are any remainders bit-wise
-    if(size - i) {
-        std::uint8_t residue = 0;
-        auto base = i;
-        for (; i < size; i++) {
-            residue |= std::signbit(data[i]) << i - base;
-        }
-        res[i / FLOAT_PACK] = residue;
+    inline std::uint32_t sign_bit(double d){
+        std::uint64_t u;
+        std::memcpy(&u, &d, sizeof(u));
+        return u >> 63;
     }
-}
 
-/// Performs 32 byte xors at a single time.
-/// \param x - left operand data
-/// \param y - right operand data
-/// \param res - result buffer to save into
-/// \param size - size of x and y. IMPORTANT: IN BITS.
-inline void xnor(std::uint8_t* x, std::uint8_t* y, std::uint8_t* res, std::size_t size){
-    ALLIGN_ASSERT(x)
-    ALLIGN_ASSERT(y)
-    ALLIGN_ASSERT(res)
-    static const auto UINT8_PACK = 32; // Can fit 32 uint8_t's
-    // 8 elements per byte. Adding by uint8_t will add 8 at a time.
-    static const auto SIZE_SCALE = 8;
-    const std::uint64_t limit = size - size % (UINT8_PACK * SIZE_SCALE); // 32 uint8_t's at a time
-    auto i = 0;
-    for(; i < limit; i+=UINT8_PACK*SIZE_SCALE) {
-        __m256i tmp_x = _mm256_load_si256((__m256i *) (x + i/SIZE_SCALE));
-        __m256i tmp_y = _mm256_load_si256((__m256i *) (y + i/SIZE_SCALE));
-        _mm256_store_si256((__m256i *) (res + i/SIZE_SCALE), ~_mm256_xor_si256(tmp_x, tmp_y));
-    }
-    // The remaining <32 uint8_t's are computed in sequence
-    auto residue = size % SIZE_SCALE;
-    for(; i < size - residue; i+=SIZE_SCALE){
-        res[i/SIZE_SCALE] = ~(x[i/SIZE_SCALE] ^ y[i/SIZE_SCALE]);
-    }
-    // The remainder bits are computed with mask
-    if (residue != 0)
-        res[i / SIZE_SCALE] = ~(x[i / SIZE_SCALE] ^ y[i / SIZE_SCALE]) & mask[residue];
-}
+    inline std::uint32_t sign_bit(std::int8_t v){ return static_cast<std::uint8_t>(v) >> 7; }
+    inline std::uint32_t sign_bit(std::uint8_t v){ return (v >> 7) ^ 1; }
+    inline std::uint32_t sign_bit(bool v){ return !v; }
+    inline std::uint32_t sign_bit(float16 v){ return v.bits >> 15; }
+    inline std::uint32_t sign_bit(bfloat16 v){ return v.bits >> 15; }
+
+    /// |value| on the scale the sign is taken on, for the XNOR-Net scaling factor mean(|x|)
+    inline float magnitude(float f){ return std::fabs(f); }
+    inline float magnitude(double d){ return static_cast<float>(std::fabs(d)); }
+    inline float magnitude(std::int8_t v){ return static_cast<float>(std::abs(static_cast<int>(v))); }
+    inline float magnitude(std::uint8_t v){ return static_cast<float>(std::abs(static_cast<int>(v) - 128)); }
+    inline float magnitude(bool){ return 1.f; }
+    inline float magnitude(bfloat16 v){
+        // The top half of a float, so widening is a shift
+        const std::uint32_t u = static_cast<std::uint32_t>(v.bits & 0x7fff) << 16;
+        float f;
+        std::memcpy(&f, &u, sizeof(f));
+        return f;
+    }
+    inline float magnitude(float16 v){
+        const int exponent = (v.bits >> 10) & 0x1f;
+        const int mantissa = v.bits & 0x3ff;
+        if(exponent == 0x1f)
+            return mantissa ? std::numeric_limits<float>::quiet_NaN() : std::numeric_limits<float>::infinity();
+        // Subnormals have no implicit leading one and the exponent of the smallest normal
+        return exponent ? std::ldexp(static_cast<float>(mantissa | 0x400), exponent - 25)
+                        : std::ldexp(static_cast<float>(mantissa), -24);
+    }
+
+    /// Sum of magnitude() over n values. Eight independent sums keep the adds pipelined.
+    template <class T>
+    inline float abs_sum(const T* data, std::size_t n){
+        float sums[8] = {};
+        const std::size_t blocks = n / 8;
+        for(std::size_t q = 0; q < blocks; q++)
+            for(int l = 0; l < 8; l++)
+                sums[l] += magnitude(data[q * 8 + l]);
+        // Fewer than 8 left, one per sum
+        const auto tail = data + blocks * 8;
+        for(std::size_t l = 0; l < n % 8; l++)
+            sums[l] += magnitude(tail[l]);
+        return ((sums[0] + sums[1]) + (sums[2] + sums[3])) + ((sums[4] + sums[5]) + (sums[6] + sums[7]));
+    }
+
+    /// Sign bits of 8 values, value j in bit j
+    template <class T>
+    inline std::uint8_t sign8(const T* data){
+        std::uint8_t res = 0;
+        for(int j = 0; j < 8; j++)
+            res |= sign_bit(data[j]) << j;
+        return res;
+    }
+
+    template <class T>
+    inline void sign(const T* data, std::uint8_t* res, std::size_t size){
+        static const auto FLOAT_PACK = 8;
+        std::size_t i = 0;
+        for(; i + FLOAT_PACK <= size; i += FLOAT_PACK)
+            res[i / FLOAT_PACK] = sign8(data + i);
+        if(size - i){
+            std::uint8_t residue = 0;
+            for(auto base = i; i < size; i++)
+                residue |= sign_bit(data[i]) << (i - base);
+            res[i / FLOAT_PACK] = residue;
+        }
+    }
+
+    inline void xnor(const std::uint8_t* x, const std::uint8_t* y, std::uint8_t* res, std::size_t size){
+        const auto bytes = size / 8;
+        std::size_t i = 0;
+        for(; i + 8 <= bytes; i += 8){
+            std::uint64_t a, b;
+            std::memcpy(&a, x + i, 8);
+            std::memcpy(&b, y + i, 8);
+            a = ~(a ^ b);
+            std::memcpy(res + i, &a, 8);
+        }
+        for(; i < bytes; i++)
+            res[i] = ~(x[i] ^ y[i]);
+        if(size % 8)
+            res[i] = ~(x[i] ^ y[i]) & mask[size % 8];
+    }
+
+    /// Popcount of `bytes` whole bytes
+    inline std::uint64_t popcnt(const std::uint8_t* data, std::uint64_t bytes){
+        std::uint64_t total = 0;
+        std::uint64_t i = 0;
+        for(; i + 8 <= bytes; i += 8){
+            std::uint64_t a;
+            std::memcpy(&a, data + i, 8);
+            total += __builtin_popcountll(a);
+        }
+        for(; i < bytes; i++)
+            total += lookup8bit[data[i]];
+        return total;
+    }
 
+    /// Popcount of x ^ y over `bytes` whole bytes
+    inline std::uint64_t popcnt_xor(const std::uint8_t* x, const std::uint8_t* y, std::uint64_t bytes){
+        std::uint64_t total = 0;
+        std::uint64_t i = 0;
+        for(; i + 8 <= bytes; i += 8){
+            std::uint64_t a, b;
+            std::memcpy(&a, x + i, 8);
+            std::memcpy(&b, y + i, 8);
+            total += __builtin_popcountll(a ^ b);
+        }
+        for(; i < bytes; i++)
+            total += lookup8bit[x[i] ^ y[i]];
+        return total;
+    }
+
+    /// Number of float pairs whose signs differ
+    inline std::uint64_t sign_xor_popcnt(const float* x, const float* y, std::size_t size){
+        std::uint64_t mismatches = 0;
+        for(std::size_t i = 0; i < size; i++)
+            mismatches += sign_bit(x[i]) ^ sign_bit(y[i]);
+        return mismatches;
+    }
+
+    /// In-place transpose of a W x W bit tile held as W words, word r being row r with column c in bit c.
+    /// Butterfly stage j swaps bit c + j of row k with bit c of row k + j, for every c and k without bit j.
+    template <class W>
+    inline void transpose_tile(W* rows){
+        constexpr unsigned N = sizeof(W) * 8;
+        W m = ~W(0) >> (N / 2);
+        for(unsigned j = N / 2; j != 0; j >>= 1, m ^= m << j){
+            for(unsigned k = 0; k < N; k = (k + j + 1) & ~j){
+                const W t = ((rows[k] >> j) ^ rows[k + j]) & m;
+                rows[k + j] ^= t;
+                rows[k] ^= t << j;
+            }
+        }
+    }
+
+    inline void transpose32(std::uint32_t* rows){ transpose_tile(rows); }
+    inline void transpose64(std::uint64_t* rows){ transpose_tile(rows); }
+} // scalar
+
+XNOR_TARGET_PUSH(XNOR_SSE42_TARGET)
+// 128-bit movemask and hardware popcnt64
+namespace sse42{
+    /// Sign bits of 8 values, value j in bit j
+    inline std::uint8_t sign8(const float* data){
+        return _mm_movemask_ps(_mm_loadu_ps(data)) | _mm_movemask_ps(_mm_loadu_ps(data + 4)) << 4;
+    }
+
+    inline std::uint8_t sign8(const double* data){
+        return _mm_movemask_pd(_mm_loadu_pd(data)) | _mm_movemask_pd(_mm_loadu_pd(data + 2)) << 2
+               | _mm_movemask_pd(_mm_loadu_pd(data + 4)) << 4 | _mm_movemask_pd(_mm_loadu_pd(data + 6)) << 6;
+    }
+
+    inline std::uint8_t sign8(const std::int8_t* data){
+        return _mm_movemask_epi8(_mm_loadl_epi64((const __m128i*) data));
+    }
+
+    inline std::uint8_t sign8(const std::uint8_t* data){
+        return ~sign8((const std::int8_t*) data);
+    }
+
+    inline std::uint8_t sign8(const bool* data){
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadl_epi64((const __m128i*) data), _mm_setzero_si128()));
+    }
+
+    /// Sign bits of 8 16-bit floats. Saturating packs keep the sign of each lane.
+    inline std::uint8_t sign8_half(const std::uint16_t* data){
+        return _mm_movemask_epi8(_mm_packs_epi16(_mm_loadu_si128((const __m128i*) data), _mm_setzero_si128()));
+    }
+
+    inline std::uint8_t sign8(const float16* data){ return sign8_half((const std::uint16_t*) data); }
+    inline std::uint8_t sign8(const bfloat16* data){ return sign8_half((const std::uint16_t*) data); }
 
-// Implementation of harley-seal
+    template <class T>
+    inline void sign(const T* data, std::uint8_t* res, std::size_t size){
+        static const auto FLOAT_PACK = 8;
+        std::size_t i = 0;
+        // One 32-bit word per 32 values
+        for(; i + 4 * FLOAT_PACK <= size; i += 4 * FLOAT_PACK){
+            std::uint32_t word = static_cast<std::uint32_t>(sign8(data + i + pt[0]))
+                                 | static_cast<std::uint32_t>(sign8(data + i + pt[1])) << pt[1]
+                                 | static_cast<std::uint32_t>(sign8(data + i + pt[2])) << pt[2]
+                                 | static_cast<std::uint32_t>(sign8(data + i + pt[3])) << pt[3];
+            std::memcpy(res + i / FLOAT_PACK, &word, sizeof(word));
+        }
+        for(; i + FLOAT_PACK <= size; i += FLOAT_PACK)
+            res[i / FLOAT_PACK] = sign8(data + i);
+        scalar::sign(data + i, res + i / FLOAT_PACK, size - i);
+    }
+
+    inline void xnor(const std::uint8_t* x, const std::uint8_t* y, std::uint8_t* res, std::size_t size){
+        const auto bytes = size / 8;
+        std::size_t i = 0;
+        for(; i + 16 <= bytes; i += 16){
+            __m128i a = _mm_loadu_si128((const __m128i*) (x + i));
+            __m128i b = _mm_loadu_si128((const __m128i*) (y + i));
+            _mm_storeu_si128((__m128i*) (res + i), ~_mm_xor_si128(a, b));
+        }
+        scalar::xnor(x + i, y + i, res + i, size - i * 8);
+    }
+
+    /// popcnt64 over 64-bit words, where word i is produced by load(i).
+    /// Four independent accumulators keep popcnt's false output dependency off the critical path.
+    /// \param load - callable returning the i-th std::uint64_t word
+    /// \param words - number of 64-bit words
+    template <class L>
+    inline std::uint64_t popcnt64(L&& load, const std::uint64_t words){
+        std::uint64_t c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+        std::uint64_t i = 0;
+        for(; i + 4 <= words; i += 4){
+            c0 += _mm_popcnt_u64(load(i + 0));
+            c1 += _mm_popcnt_u64(load(i + 1));
+            c2 += _mm_popcnt_u64(load(i + 2));
+            c3 += _mm_popcnt_u64(load(i + 3));
+        }
+        for(; i < words; i++)
+            c0 += _mm_popcnt_u64(load(i));
+        return c0 + c1 + c2 + c3;
+    }
+
+    inline std::uint64_t load64(const std::uint8_t* data){
+        std::uint64_t a;
+        std::memcpy(&a, data, 8);
+        return a;
+    }
+
+    inline std::uint64_t popcnt(const std::uint8_t* data, std::uint64_t bytes){
+        const auto words = bytes / 8;
+        auto total = popcnt64([data](std::uint64_t i){ return load64(data + i * 8); }, words);
+        for(auto i = words * 8; i < bytes; i++)
+            total += lookup8bit[data[i]];
+        return total;
+    }
+
+    inline std::uint64_t popcnt_xor(const std::uint8_t* x, const std::uint8_t* y, std::uint64_t bytes){
+        const auto words = bytes / 8;
+        auto total = popcnt64([x, y](std::uint64_t i){ return load64(x + i * 8) ^ load64(y + i * 8); }, words);
+        for(auto i = words * 8; i < bytes; i++)
+            total += lookup8bit[x[i] ^ y[i]];
+        return total;
+    }
+
+    inline std::uint64_t sign_xor_popcnt(const float* x, const float* y, std::size_t size){
+        std::uint64_t mismatches = 0;
+        std::size_t i = 0;
+        // 64 float pairs -> one 64-bit mismatch mask -> popcnt64
+        for(; i + 64 <= size; i += 64){
+            std::uint64_t accum = 0;
+            for(int q = 0; q < 16; q++){
+                __m128 d = _mm_xor_ps(_mm_loadu_ps(x + i + 4 * q), _mm_loadu_ps(y + i + 4 * q));
+                accum |= static_cast<std::uint64_t>(_mm_movemask_ps(d)) << (4 * q);
+            }
+            mismatches += _mm_popcnt_u64(accum);
+        }
+        return mismatches + scalar::sign_xor_popcnt(x + i, y + i, size - i);
+    }
+} // sse42
+XNOR_TARGET_POP
+
+XNOR_TARGET_PUSH(XNOR_AVX2_TARGET)
+// Popcount over streams of 256-bit blocks. Which kernel is fastest depends on the length:
+// popcnt64 for a few words, the nibble LUT for short streams and harley-seal for long ones.
 namespace popcnt{
-    __m256i popcount(const __m256i v)
+    /// Per-byte popcount using the nibble lookup table (Mula).
+    /// Only two constants are live, which leaves the rest of the register file to the accumulators.
+    inline __m256i popcount_lut(const __m256i v, const __m256i lookup, const __m256i low_mask)
+    {
+        const __m256i lo = v & low_mask;
+        const __m256i hi = _mm256_srli_epi16(v, 4) & low_mask;
+        return _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo), _mm256_shuffle_epi8(lookup, hi));
+    }
+
+    inline __m256i lookup_table()
+    {
+        return _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    }
+
+    inline std::uint64_t hsum(const __m256i v)
+    {
+        return static_cast<std::uint64_t>(_mm256_extract_epi64(v, 0))
+               + static_cast<std::uint64_t>(_mm256_extract_epi64(v, 1))
+               + static_cast<std::uint64_t>(_mm256_extract_epi64(v, 2))
+               + static_cast<std::uint64_t>(_mm256_extract_epi64(v, 3));
+    }
+
+    /// Horizontal sums of four vectors of 64-bit counts, as the four lanes of one vector.
+    /// Two unpacks and a lane swap replace the sixteen extracts of four hsum calls.
+    inline __m256i hsum4(const __m256i v0, const __m256i v1, const __m256i v2, const __m256i v3)
+    {
+        const __m256i s01 = _mm256_add_epi64(_mm256_unpacklo_epi64(v0, v1), _mm256_unpackhi_epi64(v0, v1));
+        const __m256i s23 = _mm256_add_epi64(_mm256_unpacklo_epi64(v2, v3), _mm256_unpackhi_epi64(v2, v3));
+        return _mm256_add_epi64(_mm256_permute2x128_si256(s01, s23, 0x20), _mm256_permute2x128_si256(s01, s23, 0x31));
+    }
+
+    // Each byte of a block popcounts to at most 8, so byte accumulators hold 31 blocks before overflow
+    static constexpr std::uint64_t BYTE_ACCUM_BLOCKS = 31;
+
+    /// Nibble LUT popcount over a stream of 256-bit blocks, where block i is produced by load(i).
+    /// Counts are kept per byte and widened with one vpsadbw every BYTE_ACCUM_BLOCKS blocks.
+    /// \param load - callable returning the i-th __m256i block
+    /// \param size - number of 256-bit blocks
+    template <class L>
+    inline std::uint64_t lut(L&& load, const std::uint64_t size)
+    {
+        const __m256i lookup = lookup_table();
+        const __m256i low_mask = _mm256_set1_epi8(0x0f);
+        __m256i total = _mm256_setzero_si256();
+        for(std::uint64_t b = 0; b < size; b += BYTE_ACCUM_BLOCKS){
+            const auto limit = std::min(size, b + BYTE_ACCUM_BLOCKS);
+            __m256i bytes = _mm256_setzero_si256();
+            for(auto i = b; i < limit; i++)
+                bytes = _mm256_add_epi8(bytes, popcount_lut(load(i), lookup, low_mask));
+            total = _mm256_add_epi64(total, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+        }
+        return hsum(total);
+    }
+
+    inline __m256i popcount(const __m256i v)
     {
         const __m256i m1 = _mm256_set1_epi8(0x55);
         const __m256i m2 = _mm256_set1_epi8(0x33);
@@ -444,14 +553,19 @@ namespace popcnt{
         return _mm256_sad_epu8(t3, _mm256_setzero_si256());
     }
 
-    void CSA(__m256i& h, __m256i& l, __m256i a, __m256i b, __m256i c)
+    inline void CSA(__m256i& h, __m256i& l, __m256i a, __m256i b, __m256i c)
     {
         const __m256i u = a ^ b;
         h = (a & b) | (u & c);
         l = u ^ c;
     }
 
-    std::uint64_t popcnt(const __m256i* data, const std::uint64_t size)
+    /// Harley-Seal over a stream of 256-bit blocks, where block i is produced by load(i).
+    /// Blocks can be computed on the fly (e.g. x ^ y) and go straight into the CSA tree.
+    /// \param load - callable returning the i-th __m256i block
+    /// \param size - number of 256-bit blocks
+    template <class L>
+    inline std::uint64_t harley_seal(L&& load, const std::uint64_t size)
     {
         __m256i total     = _mm256_setzero_si256();
         __m256i ones      = _mm256_setzero_si256();
@@ -462,21 +576,21 @@ namespace popcnt{
         __m256i twosA, twosB, foursA, foursB, eightsA, eightsB;
 
         const std::uint64_t limit = size - size % 16;
-        auto i = 0;
+        std::uint64_t i = 0;
         for(; i < limit; i += 16)
         {
-            CSA(twosA, ones, ones, data[i+0], data[i+1]);
-            CSA(twosB, ones, ones, data[i+2], data[i+3]);
+            CSA(twosA, ones, ones, load(i+0), load(i+1));
+            CSA(twosB, ones, ones, load(i+2), load(i+3));
             CSA(foursA, twos, twos, twosA, twosB);
-            CSA(twosA, ones, ones, data[i+4], data[i+5]);
-            CSA(twosB, ones, ones, data[i+6], data[i+7]);
+            CSA(twosA, ones, ones, load(i+4), load(i+5));
+            CSA(twosB, ones, ones, load(i+6), load(i+7));
             CSA(foursB, twos, twos, twosA, twosB);
             CSA(eightsA,fours, fours, foursA, foursB);
-            CSA(twosA, ones, ones, data[i+8], data[i+9]);
-            CSA(twosB, ones, ones, data[i+10], data[i+11]);
+            CSA(twosA, ones, ones, load(i+8), load(i+9));
+            CSA(twosB, ones, ones, load(i+10), load(i+11));
             CSA(foursA, twos, twos, twosA, twosB);
-            CSA(twosA, ones, ones, data[i+12], data[i+13]);
-            CSA(twosB, ones, ones, data[i+14], data[i+15]);
+            CSA(twosA, ones, ones, load(i+12), load(i+13));
+            CSA(twosB, ones, ones, load(i+14), load(i+15));
             CSA(foursB, twos, twos, twosA, twosB);
             CSA(eightsB, fours, fours, foursA, foursB);
             CSA(sixteens, eights, eights, eightsA, eightsB);
@@ -492,43 +606,988 @@ namespace popcnt{
             total = _mm256_add_epi64(total, popcount(ones));
         }
 
-        for(; i < size; i++) {
-            auto res = popcount(data[i]);
-            total = _mm256_add_epi64(total, res);
-        }
+        // The last < 16 blocks are too few for the CSA tree
+        return hsum(total) + lut([&load, i](std::uint64_t j){ return load(i + j); }, size - i);
+    }
 
+    // Crossover points in bytes, measured with the data in L1. Below POPCNT64_BYTES the setup and
+    // horizontal sum of a vector kernel cost more than the popcnts themselves, and harley-seal
+    // only pays off once its CSA tree runs over two 16-block groups.
+    static constexpr std::uint64_t POPCNT64_BYTES = 128;
+    static constexpr std::uint64_t HARLEY_SEAL_BYTES = 1024;
 
-        return static_cast<std::uint64_t>(_mm256_extract_epi64(total, 0))
-               + static_cast<std::uint64_t>(_mm256_extract_epi64(total, 1))
-               + static_cast<std::uint64_t>(_mm256_extract_epi64(total, 2))
-               + static_cast<std::uint64_t>(_mm256_extract_epi64(total, 3));
+    /// Size-adaptive popcount over 256-bit blocks, where block i is produced by load(i)
+    template <class L>
+    inline std::uint64_t adaptive(L&& load, const std::uint64_t size)
+    {
+        if(size * 32 < HARLEY_SEAL_BYTES)
+            return lut(load, size);
+        return harley_seal(load, size);
+    }
+
+    inline std::uint64_t popcnt(const __m256i* data, const std::uint64_t size)
+    {
+        return adaptive([data](std::uint64_t i){ return data[i]; }, size);
+    }
+
+    /// Popcount of x ^ y, i.e. the number of mismatching bits, without writing x ^ y anywhere.
+    /// Only x has to be 32-byte aligned.
+    inline std::uint64_t popcnt_xor(const __m256i* x, const __m256i* y, const std::uint64_t size)
+    {
+        return adaptive([x, y](std::uint64_t i){ return _mm256_xor_si256(x[i], _mm256_loadu_si256(y + i)); }, size);
     }
 } // popcnt
 
-/// Performs popcount (population count) on bits
+// 256-bit movemask, harley-seal popcount
+namespace avx2{
+    /// Sign bits of 32 values as one word, value j in bit j
+    inline std::uint32_t sign32(const float* data){
+        return static_cast<std::uint32_t>(_mm256_movemask_ps(_mm256_loadu_ps(data + pt[0])))
+               | static_cast<std::uint32_t>(_mm256_movemask_ps(_mm256_loadu_ps(data + pt[1]))) << pt[1]
+               | static_cast<std::uint32_t>(_mm256_movemask_ps(_mm256_loadu_ps(data + pt[2]))) << pt[2]
+               | static_cast<std::uint32_t>(_mm256_movemask_ps(_mm256_loadu_ps(data + pt[3]))) << pt[3];
+    }
+
+    inline std::uint32_t sign32(const double* data){
+        std::uint32_t word = 0;
+        for(int q = 0; q < 8; q++)
+            word |= static_cast<std::uint32_t>(_mm256_movemask_pd(_mm256_loadu_pd(data + 4 * q))) << (4 * q);
+        return word;
+    }
+
+    /// 32 int8 values per movemask
+    inline std::uint32_t sign32(const std::int8_t* data){
+        return _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*) data));
+    }
+
+    inline std::uint32_t sign32(const std::uint8_t* data){
+        return ~sign32((const std::int8_t*) data);
+    }
+
+    inline std::uint32_t sign32(const bool* data){
+        return _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) data), _mm256_setzero_si256()));
+    }
+
+    /// Sign bits of 32 16-bit floats. The saturating pack interleaves the 128-bit lanes,
+    /// so a cross-lane permute puts the bytes back in order before the movemask.
+    inline std::uint32_t sign32_half(const std::uint16_t* data){
+        const __m256i lo = _mm256_loadu_si256((const __m256i*) data);
+        const __m256i hi = _mm256_loadu_si256((const __m256i*) (data + 16));
+        return _mm256_movemask_epi8(_mm256_permute4x64_epi64(_mm256_packs_epi16(lo, hi), 0xd8));
+    }
+
+    inline std::uint32_t sign32(const float16* data){ return sign32_half((const std::uint16_t*) data); }
+    inline std::uint32_t sign32(const bfloat16* data){ return sign32_half((const std::uint16_t*) data); }
+
+    /// Packs the sign of every value, 32 values straight into one 32-bit word.
+    /// Unaligned loads cost the same as aligned ones on aligned data, so there is no separate safe variant.
+    /// \param data - array to extract sign from
+    /// \param res - resulting packed bit array
+    /// \param size - size of data
+    template <class T>
+    inline void sign(const T* data, std::uint8_t* res, std::size_t size){
+        static const auto FLOAT_PACK = 8;
+        static const auto WORD_PACK = 32;
+        std::size_t i = 0;
+        // 256 values per iteration, eight independent words
+        for(; i + 8 * WORD_PACK <= size; i += 8 * WORD_PACK) {
+            std::uint32_t words[8];
+            for(int w = 0; w < 8; w++)
+                words[w] = sign32(data + i + w * WORD_PACK);
+            std::memcpy(res + i / FLOAT_PACK, words, sizeof(words));
+        }
+        for(; i + WORD_PACK <= size; i += WORD_PACK) {
+            const std::uint32_t word = sign32(data + i);
+            std::memcpy(res + i / FLOAT_PACK, &word, sizeof(word));
+        }
+        sse42::sign(data + i, res + i / FLOAT_PACK, size - i);
+    }
+
+    /// Performs 32 byte xors at a single time.
+    /// \param x - left operand data
+    /// \param y - right operand data
+    /// \param res - result buffer to save into
+    /// \param size - size of x and y. IMPORTANT: IN BITS.
+    inline void xnor(const std::uint8_t* x, const std::uint8_t* y, std::uint8_t* res, std::size_t size){
+        static const auto UINT8_PACK = 32; // Can fit 32 uint8_t's
+        // 8 elements per byte. Adding by uint8_t will add 8 at a time.
+        static const auto SIZE_SCALE = 8;
+        const std::uint64_t limit = size - size % (UINT8_PACK * SIZE_SCALE); // 32 uint8_t's at a time
+        auto i = 0;
+        for(; i < limit; i+=UINT8_PACK*SIZE_SCALE) {
+            __m256i tmp_x = _mm256_loadu_si256((const __m256i *) (x + i/SIZE_SCALE));
+            __m256i tmp_y = _mm256_loadu_si256((const __m256i *) (y + i/SIZE_SCALE));
+            _mm256_storeu_si256((__m256i *) (res + i/SIZE_SCALE), ~_mm256_xor_si256(tmp_x, tmp_y));
+        }
+        // The remaining <32 uint8_t's are computed in sequence
+        auto residue = size % SIZE_SCALE;
+        for(; i < size - residue; i+=SIZE_SCALE){
+            res[i/SIZE_SCALE] = ~(x[i/SIZE_SCALE] ^ y[i/SIZE_SCALE]);
+        }
+        // The remainder bits are computed with mask
+        if (residue != 0)
+            res[i / SIZE_SCALE] = ~(x[i / SIZE_SCALE] ^ y[i / SIZE_SCALE]) & mask[residue];
+    }
+
+
+
+    /// Bytes before the first 32-byte boundary at or after data
+    inline std::uint64_t head_bytes(const std::uint8_t* data){
+        return (ALIGN_SIZE - reinterpret_cast<std::uintptr_t>(data) % ALIGN_SIZE) % ALIGN_SIZE;
+    }
+
+    /// Popcount of `bytes` whole bytes of data at any alignment.
+    /// Short inputs go through popcnt64, and so do the bytes before the first 32-byte boundary
+    /// and after the last 256-bit block, leaving aligned loads for the blocks in between.
+    inline std::uint64_t popcnt(const std::uint8_t* data, std::uint64_t bytes){
+        static constexpr auto UINT8_PACK = 32;
+        if(bytes < popcnt::POPCNT64_BYTES)
+            return sse42::popcnt(data, bytes);
+        const auto head = head_bytes(data);
+        auto total = sse42::popcnt(data, head);
+        data += head;
+        bytes -= head;
+        auto mm256_block = bytes / UINT8_PACK;
+        total += popcnt::popcnt((const __m256i*) data, mm256_block);
+        return total + sse42::popcnt(data + mm256_block * UINT8_PACK, bytes % UINT8_PACK);
+    }
+
+    /// Popcount of x ^ y over `bytes` whole bytes at any alignment. The head is peeled until x is
+    /// 32-byte aligned; y is read with unaligned loads, since both rarely share an offset.
+    inline std::uint64_t popcnt_xor(const std::uint8_t* x, const std::uint8_t* y, std::uint64_t bytes){
+        static constexpr auto UINT8_PACK = 32;
+        if(bytes < popcnt::POPCNT64_BYTES)
+            return sse42::popcnt_xor(x, y, bytes);
+        const auto head = head_bytes(x);
+        auto mismatches = sse42::popcnt_xor(x, y, head);
+        x += head;
+        y += head;
+        bytes -= head;
+        auto mm256_block = bytes / UINT8_PACK;
+        mismatches += popcnt::popcnt_xor((const __m256i*) x, (const __m256i*) y, mm256_block);
+        const auto i = mm256_block * UINT8_PACK;
+        return mismatches + sse42::popcnt_xor(x + i, y + i, bytes % UINT8_PACK);
+    }
+
+    /// Sign mismatches of 32 float pairs as a 32-bit mask. sign(x) ^ sign(y) is the sign bit of x ^ y,
+    /// so one movemask covers both operands.
+    inline std::uint32_t xor_sign32(const float* x, const float* y){
+        std::uint32_t accum = 0;
+        accum |= _mm256_movemask_ps(_mm256_xor_ps(_mm256_loadu_ps(x + pt[0]), _mm256_loadu_ps(y + pt[0]))) << pt[0];
+        accum |= _mm256_movemask_ps(_mm256_xor_ps(_mm256_loadu_ps(x + pt[1]), _mm256_loadu_ps(y + pt[1]))) << pt[1];
+        accum |= _mm256_movemask_ps(_mm256_xor_ps(_mm256_loadu_ps(x + pt[2]), _mm256_loadu_ps(y + pt[2]))) << pt[2];
+        accum |= _mm256_movemask_ps(_mm256_xor_ps(_mm256_loadu_ps(x + pt[3]), _mm256_loadu_ps(y + pt[3]))) << pt[3];
+        return accum;
+    }
+
+    /// Fused sign + xor + popcount straight from floats. Each float pair goes through
+    /// xor -> movemask -> harley-seal accumulate in a single pass, and no packed bits are written.
+    inline std::uint64_t sign_xor_popcnt(const float* x, const float* y, std::size_t size){
+        static const auto FLOAT_PACK = 8;
+        // 256 floats make up one 256-bit block of mismatch bits
+        static const auto BLOCK_FLOATS = FLOAT_PACK * ALIGN_SIZE;
+        const std::uint64_t blocks = size / BLOCK_FLOATS;
+        auto load = [x, y](std::uint64_t b){
+            const float* px = x + b * BLOCK_FLOATS;
+            const float* py = y + b * BLOCK_FLOATS;
+            return _mm256_setr_epi32(xor_sign32(px + 0 * 32, py + 0 * 32),
+                                     xor_sign32(px + 1 * 32, py + 1 * 32),
+                                     xor_sign32(px + 2 * 32, py + 2 * 32),
+                                     xor_sign32(px + 3 * 32, py + 3 * 32),
+                                     xor_sign32(px + 4 * 32, py + 4 * 32),
+                                     xor_sign32(px + 5 * 32, py + 5 * 32),
+                                     xor_sign32(px + 6 * 32, py + 6 * 32),
+                                     xor_sign32(px + 7 * 32, py + 7 * 32));
+        };
+        std::uint64_t mismatches = popcnt::adaptive(load, blocks);
+
+        std::size_t i = blocks * BLOCK_FLOATS;
+        for(; i + FLOAT_PACK <= size; i += FLOAT_PACK)
+            mismatches += lookup8bit[_mm256_movemask_ps(_mm256_xor_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)))];
+
+        return mismatches + scalar::sign_xor_popcnt(x + i, y + i, size - i);
+    }
+
+    /// Butterfly stage between two vectors of rows, a holding rows k.. and b rows k + j..
+    inline void swap_blocks32(__m256i& a, __m256i& b, int j, const __m256i m){
+        const __m256i t = _mm256_and_si256(_mm256_xor_si256(_mm256_srli_epi32(a, j), b), m);
+        b = _mm256_xor_si256(b, t);
+        a = _mm256_xor_si256(a, _mm256_slli_epi32(t, j));
+    }
+
+    inline void swap_blocks64(__m256i& a, __m256i& b, int j, const __m256i m){
+        const __m256i t = _mm256_and_si256(_mm256_xor_si256(_mm256_srli_epi64(a, j), b), m);
+        b = _mm256_xor_si256(b, t);
+        a = _mm256_xor_si256(a, _mm256_slli_epi64(t, j));
+    }
+
+    /// Butterfly stage inside a vector. p is v with every row moved to its partner row k ^ j,
+    /// and HI has a bit set for the upper row of each pair.
+    template <int HI>
+    inline __m256i swap_lanes32(const __m256i v, const __m256i p, int j, const __m256i m){
+        const __m256i lo = _mm256_xor_si256(v, _mm256_slli_epi32(_mm256_and_si256(_mm256_xor_si256(_mm256_srli_epi32(v, j), p), m), j));
+        const __m256i hi = _mm256_xor_si256(v, _mm256_and_si256(_mm256_xor_si256(_mm256_srli_epi32(p, j), v), m));
+        return _mm256_blend_epi32(lo, hi, HI);
+    }
+
+    template <int HI>
+    inline __m256i swap_lanes64(const __m256i v, const __m256i p, int j, const __m256i m){
+        const __m256i lo = _mm256_xor_si256(v, _mm256_slli_epi64(_mm256_and_si256(_mm256_xor_si256(_mm256_srli_epi64(v, j), p), m), j));
+        const __m256i hi = _mm256_xor_si256(v, _mm256_and_si256(_mm256_xor_si256(_mm256_srli_epi64(p, j), v), m));
+        return _mm256_blend_epi32(lo, hi, HI);
+    }
+
+    /// 32x32 bit transpose, 8 rows per vector. Stages 16 and 8 pair up whole vectors,
+    /// stages 4, 2 and 1 pair up lanes of one vector through a shuffle and a blend.
+    inline void transpose32(std::uint32_t* rows){
+        __m256i v[4];
+        for(int p = 0; p < 4; p++)
+            v[p] = _mm256_loadu_si256((const __m256i*) (rows + 8 * p));
+        swap_blocks32(v[0], v[2], 16, _mm256_set1_epi32(0x0000ffff));
+        swap_blocks32(v[1], v[3], 16, _mm256_set1_epi32(0x0000ffff));
+        swap_blocks32(v[0], v[1], 8, _mm256_set1_epi32(0x00ff00ff));
+        swap_blocks32(v[2], v[3], 8, _mm256_set1_epi32(0x00ff00ff));
+        for(int p = 0; p < 4; p++){
+            v[p] = swap_lanes32<0xf0>(v[p], _mm256_permute4x64_epi64(v[p], 0x4e), 4, _mm256_set1_epi32(0x0f0f0f0f));
+            v[p] = swap_lanes32<0xcc>(v[p], _mm256_shuffle_epi32(v[p], 0x4e), 2, _mm256_set1_epi32(0x33333333));
+            v[p] = swap_lanes32<0xaa>(v[p], _mm256_shuffle_epi32(v[p], 0xb1), 1, _mm256_set1_epi32(0x55555555));
+            _mm256_storeu_si256((__m256i*) (rows + 8 * p), v[p]);
+        }
+    }
+
+    /// 64x64 bit transpose, 4 rows per vector. Stages 32 down to 4 pair up whole vectors,
+    /// stages 2 and 1 pair up lanes of one vector.
+    inline void transpose64(std::uint64_t* rows){
+        static constexpr std::uint64_t masks[] = {0x5555555555555555ULL, 0x3333333333333333ULL, 0x0f0f0f0f0f0f0f0fULL,
+                                                  0x00ff00ff00ff00ffULL, 0x0000ffff0000ffffULL, 0x00000000ffffffffULL};
+        __m256i v[16];
+        for(int p = 0; p < 16; p++)
+            v[p] = _mm256_loadu_si256((const __m256i*) (rows + 4 * p));
+        for(int s = 5; s >= 2; s--){
+            const int j = 1 << s, d = j / 4;
+            const __m256i m = _mm256_set1_epi64x(masks[s]);
+            for(int p = 0; p < 16; p = (p + d + 1) & ~d)
+                swap_blocks64(v[p], v[p + d], j, m);
+        }
+        for(int p = 0; p < 16; p++){
+            v[p] = swap_lanes64<0xf0>(v[p], _mm256_permute4x64_epi64(v[p], 0x4e), 2, _mm256_set1_epi64x(masks[1]));
+            v[p] = swap_lanes64<0xcc>(v[p], _mm256_shuffle_epi32(v[p], 0x4e), 1, _mm256_set1_epi64x(masks[0]));
+            _mm256_storeu_si256((__m256i*) (rows + 4 * p), v[p]);
+        }
+    }
+} // avx2
+XNOR_TARGET_POP
+
+XNOR_TARGET_PUSH(XNOR_AVX512_TARGET)
+// 512-bit kernels: 16 floats per movemask, 512-bit xors, and a VPTERNLOG harley-seal
+namespace avx512{
+    /// Popcount of each 64-bit lane, nibble lookup table
+    inline __m512i popcount(const __m512i v)
+    {
+        const __m512i lookup = _mm512_broadcast_i32x4(_mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4));
+        const __m512i low_mask = _mm512_set1_epi8(0x0f);
+        const __m512i lo = _mm512_and_si512(v, low_mask);
+        const __m512i hi = _mm512_and_si512(_mm512_srli_epi16(v, 4), low_mask);
+        const __m512i cnt = _mm512_add_epi8(_mm512_shuffle_epi8(lookup, lo), _mm512_shuffle_epi8(lookup, hi));
+        return _mm512_sad_epu8(cnt, _mm512_setzero_si512());
+    }
+
+    /// Carry-save adder: one VPTERNLOG for the majority, one for the parity
+    inline void CSA(__m512i& h, __m512i& l, __m512i a, __m512i b, __m512i c)
+    {
+        h = _mm512_ternarylogic_epi64(a, b, c, 0xe8);
+        l = _mm512_ternarylogic_epi64(a, b, c, 0x96);
+    }
+
+    /// Harley-seal over a stream of 512-bit blocks, where block i is produced by load(i)
+    /// \param load - callable returning the i-th __m512i block
+    /// \param size - number of 512-bit blocks
+    template <class L>
+    inline std::uint64_t accumulate(L&& load, const std::uint64_t size)
+    {
+        __m512i total     = _mm512_setzero_si512();
+        __m512i ones      = _mm512_setzero_si512();
+        __m512i twos      = _mm512_setzero_si512();
+        __m512i fours     = _mm512_setzero_si512();
+        __m512i eights    = _mm512_setzero_si512();
+        __m512i sixteens  = _mm512_setzero_si512();
+        __m512i twosA, twosB, foursA, foursB, eightsA, eightsB;
+
+        const std::uint64_t limit = size - size % 16;
+        std::uint64_t i = 0;
+        for(; i < limit; i += 16)
+        {
+            CSA(twosA, ones, ones, load(i+0), load(i+1));
+            CSA(twosB, ones, ones, load(i+2), load(i+3));
+            CSA(foursA, twos, twos, twosA, twosB);
+            CSA(twosA, ones, ones, load(i+4), load(i+5));
+            CSA(twosB, ones, ones, load(i+6), load(i+7));
+            CSA(foursB, twos, twos, twosA, twosB);
+            CSA(eightsA,fours, fours, foursA, foursB);
+            CSA(twosA, ones, ones, load(i+8), load(i+9));
+            CSA(twosB, ones, ones, load(i+10), load(i+11));
+            CSA(foursA, twos, twos, twosA, twosB);
+            CSA(twosA, ones, ones, load(i+12), load(i+13));
+            CSA(twosB, ones, ones, load(i+14), load(i+15));
+            CSA(foursB, twos, twos, twosA, twosB);
+            CSA(eightsB, fours, fours, foursA, foursB);
+            CSA(sixteens, eights, eights, eightsA, eightsB);
+
+            total = _mm512_add_epi64(total, popcount(sixteens));
+        }
+
+        if (limit != 0) {
+            total = _mm512_slli_epi64(total, 4);     // * 16
+            total = _mm512_add_epi64(total, _mm512_slli_epi64(popcount(eights), 3)); // += 8 * ...
+            total = _mm512_add_epi64(total, _mm512_slli_epi64(popcount(fours), 2)); // += 4 * ...
+            total = _mm512_add_epi64(total, _mm512_slli_epi64(popcount(twos), 1)); // += 2 * ...
+            total = _mm512_add_epi64(total, popcount(ones));
+        }
+
+        for(; i < size; i++)
+            total = _mm512_add_epi64(total, popcount(load(i)));
+
+        return static_cast<std::uint64_t>(_mm512_reduce_add_epi64(total));
+    }
+
+    /// Masked loads of the bytes before the first 64-byte boundary and of the last partial block,
+    /// so the blocks in between never split a cache line
+    inline __mmask64 head_mask(const std::uint8_t* data)
+    {
+        return (1ULL << ((64 - reinterpret_cast<std::uintptr_t>(data) % 64) % 64)) - 1;
+    }
+
+    inline __mmask64 tail_mask(const std::uint64_t bytes)
+    {
+        return (1ULL << (bytes % 64)) - 1;
+    }
+
+    /// Popcount of `bytes` bytes of data at any alignment. The head and tail are read with masked loads.
+    inline std::uint64_t popcnt(const std::uint8_t* data, std::uint64_t bytes)
+    {
+        if(bytes < popcnt::POPCNT64_BYTES)
+            return sse42::popcnt(data, bytes);
+        const auto head = head_mask(data);
+        std::uint64_t total = _mm512_reduce_add_epi64(popcount(_mm512_maskz_loadu_epi8(head, data)));
+        const auto skip = static_cast<std::uint64_t>(_mm_popcnt_u64(head));
+        data += skip;
+        bytes -= skip;
+        const auto blocks = bytes / 64;
+        total += accumulate([data](std::uint64_t i){ return _mm512_loadu_si512(data + i * 64); }, blocks);
+        if(bytes % 64)
+            total += _mm512_reduce_add_epi64(popcount(_mm512_maskz_loadu_epi8(tail_mask(bytes), data + blocks * 64)));
+        return total;
+    }
+
+    /// Popcount of x ^ y over `bytes` bytes at any alignment, without writing x ^ y anywhere.
+    /// The head is peeled until x is 64-byte aligned.
+    inline std::uint64_t popcnt_xor(const std::uint8_t* x, const std::uint8_t* y, std::uint64_t bytes)
+    {
+        if(bytes < popcnt::POPCNT64_BYTES)
+            return sse42::popcnt_xor(x, y, bytes);
+        const auto head = head_mask(x);
+        std::uint64_t total = _mm512_reduce_add_epi64(popcount(_mm512_xor_si512(_mm512_maskz_loadu_epi8(head, x),
+                                                                                _mm512_maskz_loadu_epi8(head, y))));
+        const auto skip = static_cast<std::uint64_t>(_mm_popcnt_u64(head));
+        x += skip;
+        y += skip;
+        bytes -= skip;
+        const auto blocks = bytes / 64;
+        total += accumulate([x, y](std::uint64_t i){
+            return _mm512_xor_si512(_mm512_loadu_si512(x + i * 64), _mm512_loadu_si512(y + i * 64));
+        }, blocks);
+        if(bytes % 64){
+            const auto tail = tail_mask(bytes);
+            total += _mm512_reduce_add_epi64(popcount(_mm512_xor_si512(_mm512_maskz_loadu_epi8(tail, x + blocks * 64),
+                                                                       _mm512_maskz_loadu_epi8(tail, y + blocks * 64))));
+        }
+        return total;
+    }
+
+    /// Sign bits of 32 values as one word, value j in bit j
+    inline std::uint32_t sign32(const float* data)
+    {
+        std::uint32_t lo = _mm512_movepi32_mask(_mm512_castps_si512(_mm512_loadu_ps(data)));
+        std::uint32_t hi = _mm512_movepi32_mask(_mm512_castps_si512(_mm512_loadu_ps(data + 16)));
+        return lo | hi << 16;
+    }
+
+    inline std::uint32_t sign32(const double* data)
+    {
+        std::uint32_t word = 0;
+        for(int q = 0; q < 4; q++)
+            word |= static_cast<std::uint32_t>(_mm512_movepi64_mask(_mm512_castpd_si512(_mm512_loadu_pd(data + 8 * q)))) << (8 * q);
+        return word;
+    }
+
+    /// 32 16-bit floats per movemask, no pack needed
+    inline std::uint32_t sign32(const float16* data){ return _mm512_movepi16_mask(_mm512_loadu_si512(data)); }
+    inline std::uint32_t sign32(const bfloat16* data){ return _mm512_movepi16_mask(_mm512_loadu_si512(data)); }
+
+    // 8-bit types already get 32 values per 256-bit movemask
+    inline std::uint32_t sign32(const std::int8_t* data){ return avx2::sign32(data); }
+    inline std::uint32_t sign32(const std::uint8_t* data){ return avx2::sign32(data); }
+    inline std::uint32_t sign32(const bool* data){ return avx2::sign32(data); }
+
+    /// Packs 16 floats per movemask. The values after the last 32-value word go through the AVX2 tail.
+    template <class T>
+    inline void sign(const T* data, std::uint8_t* res, std::size_t size)
+    {
+        std::size_t i = 0;
+        for(; i + 256 <= size; i += 256){
+            std::uint32_t words[8];
+            for(int w = 0; w < 8; w++)
+                words[w] = sign32(data + i + w * 32);
+            std::memcpy(res + i / 8, words, sizeof(words));
+        }
+        for(; i + 32 <= size; i += 32){
+            const std::uint32_t word = sign32(data + i);
+            std::memcpy(res + i / 8, &word, sizeof(word));
+        }
+        sse42::sign(data + i, res + i / 8, size - i);
+    }
+
+    inline void xnor(const std::uint8_t* x, const std::uint8_t* y, std::uint8_t* res, std::size_t size)
+    {
+        const auto bytes = size / 8;
+        std::size_t i = 0;
+        // 64 uint8_t's at a time
+        for(; i + 64 <= bytes; i += 64){
+            __m512i tmp_x = _mm512_loadu_si512(x + i);
+            __m512i tmp_y = _mm512_loadu_si512(y + i);
+            // 0xc3 = ~(a ^ b) on the first two operands
+            _mm512_storeu_si512(res + i, _mm512_ternarylogic_epi64(tmp_x, tmp_y, tmp_y, 0xc3));
+        }
+        scalar::xnor(x + i, y + i, res + i, size - i * 8);
+    }
+
+    /// Sign mismatches of 64 float pairs as one 64-bit mask (bit order does not matter for a count)
+    inline std::uint64_t xor_sign64(const float* x, const float* y)
+    {
+        std::uint64_t accum = 0;
+        for(int q = 0; q < 4; q++){
+            __m512 d = _mm512_xor_ps(_mm512_loadu_ps(x + q * 16), _mm512_loadu_ps(y + q * 16));
+            accum |= static_cast<std::uint64_t>(_mm512_movepi32_mask(_mm512_castps_si512(d))) << (q * 16);
+        }
+        return accum;
+    }
+
+    /// Fused sign + xor + popcount over blocks of 512 float pairs, the rest goes through AVX2
+    inline std::uint64_t sign_xor_popcnt(const float* x, const float* y, std::size_t size)
+    {
+        const std::uint64_t blocks = size / 512;
+        auto mismatches = accumulate([x, y](std::uint64_t b){
+            const float* px = x + b * 512;
+            const float* py = y + b * 512;
+            return _mm512_setr_epi64(xor_sign64(px + 0 * 64, py + 0 * 64), xor_sign64(px + 1 * 64, py + 1 * 64),
+                                     xor_sign64(px + 2 * 64, py + 2 * 64), xor_sign64(px + 3 * 64, py + 3 * 64),
+                                     xor_sign64(px + 4 * 64, py + 4 * 64), xor_sign64(px + 5 * 64, py + 5 * 64),
+                                     xor_sign64(px + 6 * 64, py + 6 * 64), xor_sign64(px + 7 * 64, py + 7 * 64));
+        }, blocks);
+        const auto i = blocks * 512;
+        return mismatches + avx2::sign_xor_popcnt(x + i, y + i, size - i);
+    }
+
+    /// Butterfly stage inside a vector, see avx2::swap_lanes32
+    inline __m512i swap_lanes32(const __m512i v, const __m512i p, unsigned j, const __m512i m, const __mmask16 hi)
+    {
+        const __m512i lo_v = _mm512_xor_si512(v, _mm512_slli_epi32(_mm512_and_si512(_mm512_xor_si512(_mm512_srli_epi32(v, j), p), m), j));
+        const __m512i hi_v = _mm512_xor_si512(v, _mm512_and_si512(_mm512_xor_si512(_mm512_srli_epi32(p, j), v), m));
+        return _mm512_mask_blend_epi32(hi, lo_v, hi_v);
+    }
+
+    inline __m512i swap_lanes64(const __m512i v, const __m512i p, unsigned j, const __m512i m, const __mmask8 hi)
+    {
+        const __m512i lo_v = _mm512_xor_si512(v, _mm512_slli_epi64(_mm512_and_si512(_mm512_xor_si512(_mm512_srli_epi64(v, j), p), m), j));
+        const __m512i hi_v = _mm512_xor_si512(v, _mm512_and_si512(_mm512_xor_si512(_mm512_srli_epi64(p, j), v), m));
+        return _mm512_mask_blend_epi64(hi, lo_v, hi_v);
+    }
+
+    /// 32x32 bit transpose, 16 rows per vector: stage 16 pairs the two vectors, the rest are in-vector
+    inline void transpose32(std::uint32_t* rows)
+    {
+        __m512i a = _mm512_loadu_si512(rows), b = _mm512_loadu_si512(rows + 16);
+        const __m512i t = _mm512_and_si512(_mm512_xor_si512(_mm512_srli_epi32(a, 16), b), _mm512_set1_epi32(0x0000ffff));
+        b = _mm512_xor_si512(b, t);
+        a = _mm512_xor_si512(a, _mm512_slli_epi32(t, 16));
+        for(__m512i* v : {&a, &b}){
+            *v = swap_lanes32(*v, _mm512_shuffle_i64x2(*v, *v, 0x4e), 8, _mm512_set1_epi32(0x00ff00ff), 0xff00);
+            *v = swap_lanes32(*v, _mm512_shuffle_i64x2(*v, *v, 0xb1), 4, _mm512_set1_epi32(0x0f0f0f0f), 0xf0f0);
+            *v = swap_lanes32(*v, _mm512_shuffle_epi32(*v, (_MM_PERM_ENUM) 0x4e), 2, _mm512_set1_epi32(0x33333333), 0xcccc);
+            *v = swap_lanes32(*v, _mm512_shuffle_epi32(*v, (_MM_PERM_ENUM) 0xb1), 1, _mm512_set1_epi32(0x55555555), 0xaaaa);
+        }
+        _mm512_storeu_si512(rows, a);
+        _mm512_storeu_si512(rows + 16, b);
+    }
+
+    /// 64x64 bit transpose, 8 rows per vector: stages 32, 16 and 8 pair up vectors, 4, 2 and 1 are in-vector
+    inline void transpose64(std::uint64_t* rows)
+    {
+        static constexpr std::uint64_t masks[] = {0x5555555555555555ULL, 0x3333333333333333ULL, 0x0f0f0f0f0f0f0f0fULL,
+                                                  0x00ff00ff00ff00ffULL, 0x0000ffff0000ffffULL, 0x00000000ffffffffULL};
+        __m512i v[8];
+        for(int p = 0; p < 8; p++)
+            v[p] = _mm512_loadu_si512(rows + 8 * p);
+        for(int s = 5; s >= 3; s--){
+            const unsigned j = 1u << s;
+            const int d = j / 8;
+            const __m512i m = _mm512_set1_epi64(masks[s]);
+            for(int p = 0; p < 8; p = (p + d + 1) & ~d){
+                const __m512i t = _mm512_and_si512(_mm512_xor_si512(_mm512_srli_epi64(v[p], j), v[p + d]), m);
+                v[p + d] = _mm512_xor_si512(v[p + d], t);
+                v[p] = _mm512_xor_si512(v[p], _mm512_slli_epi64(t, j));
+            }
+        }
+        for(int p = 0; p < 8; p++){
+            v[p] = swap_lanes64(v[p], _mm512_shuffle_i64x2(v[p], v[p], 0x4e), 4, _mm512_set1_epi64(masks[2]), 0xf0);
+            v[p] = swap_lanes64(v[p], _mm512_shuffle_i64x2(v[p], v[p], 0xb1), 2, _mm512_set1_epi64(masks[1]), 0xcc);
+            v[p] = swap_lanes64(v[p], _mm512_shuffle_epi32(v[p], (_MM_PERM_ENUM) 0x4e), 1, _mm512_set1_epi64(masks[0]), 0xaa);
+            _mm512_storeu_si512(rows + 8 * p, v[p]);
+        }
+    }
+} // avx512
+XNOR_TARGET_POP
+
+template <class T>
+using sign_t = void (*)(const T* data, std::uint8_t* res, std::size_t size);
+
+/// One variant of every stage for a given instruction set.
+/// The namespaced kernels can also be called directly, e.g. to benchmark a lower level.
+struct kernels
+{
+    ::isa level;
+    // One sign packer per input type, see sign_kernel
+    std::tuple<sign_t<float>, sign_t<double>, sign_t<std::int8_t>, sign_t<std::uint8_t>, sign_t<bool>,
+               sign_t<float16>, sign_t<bfloat16>> sign;
+    void (*xnor)(const std::uint8_t* x, const std::uint8_t* y, std::uint8_t* res, std::size_t size);
+    std::uint64_t (*popcnt)(const std::uint8_t* data, std::uint64_t bytes);
+    std::uint64_t (*popcnt_xor)(const std::uint8_t* x, const std::uint8_t* y, std::uint64_t bytes);
+    std::uint64_t (*sign_xor_popcnt)(const float* x, const float* y, std::size_t size);
+    // In-place bit tile transposes, see scalar::transpose_tile
+    void (*transpose32)(std::uint32_t* rows);
+    void (*transpose64)(std::uint64_t* rows);
+};
+
+inline const kernels& kernels_for(::isa level)
+{
+    static const kernels table[] = {
+        {::isa::scalar, {scalar::sign<float>, scalar::sign<double>, scalar::sign<std::int8_t>, scalar::sign<std::uint8_t>,
+                        scalar::sign<bool>, scalar::sign<float16>, scalar::sign<bfloat16>},
+         scalar::xnor, scalar::popcnt, scalar::popcnt_xor, scalar::sign_xor_popcnt, scalar::transpose32, scalar::transpose64},
+        {::isa::sse42, {sse42::sign<float>, sse42::sign<double>, sse42::sign<std::int8_t>, sse42::sign<std::uint8_t>,
+                       sse42::sign<bool>, sse42::sign<float16>, sse42::sign<bfloat16>},
+         sse42::xnor, sse42::popcnt, sse42::popcnt_xor, sse42::sign_xor_popcnt, scalar::transpose32, scalar::transpose64},
+        {::isa::avx2, {avx2::sign<float>, avx2::sign<double>, avx2::sign<std::int8_t>, avx2::sign<std::uint8_t>,
+                      avx2::sign<bool>, avx2::sign<float16>, avx2::sign<bfloat16>},
+         avx2::xnor, avx2::popcnt, avx2::popcnt_xor, avx2::sign_xor_popcnt, avx2::transpose32, avx2::transpose64},
+        {::isa::avx512, {avx512::sign<float>, avx512::sign<double>, avx512::sign<std::int8_t>, avx512::sign<std::uint8_t>,
+                        avx512::sign<bool>, avx512::sign<float16>, avx512::sign<bfloat16>},
+         avx512::xnor, avx512::popcnt, avx512::popcnt_xor, avx512::sign_xor_popcnt, avx512::transpose32, avx512::transpose64},
+    };
+    return table[static_cast<int>(level)];
+}
+
+/// Kernels for the fastest instruction set of this CPU, selected once on first use
+inline const kernels& dispatch()
+{
+    static const kernels& selected = kernels_for(detect_isa());
+    return selected;
+}
+
+/// The sign packer of `k` for element type T
+template <class T>
+inline sign_t<T> sign_kernel(const kernels& k)
+{
+    return std::get<sign_t<T>>(k.sign);
+}
+
+/// Packs the signs of [0, size) with pack(begin, end), split into PACK_CHUNK pieces across the
+/// thread pool in parallel mode. Chunks start on byte boundaries, so no two tasks write the same byte.
+template <class F>
+inline void pack_chunks(F&& pack, std::size_t size, ::execution mode){
+    if(mode == ::execution::sequential || size <= PACK_CHUNK){
+        pack(0, size);
+        return;
+    }
+    thread_pool::global().parallel_for((size + PACK_CHUNK - 1) / PACK_CHUNK, [&](std::size_t t){
+        pack(t * PACK_CHUNK, std::min(size, (t + 1) * PACK_CHUNK));
+    });
+}
+
+/// performs unsafe load sign on 32 values at a single time and writes it into a uint32
+/// \param data - float, double, int8, uint8, bool, float16 or bfloat16 array to extract sign from
+/// \param res - resulting packed bit array, LSB-first
+/// \param size - size of data
+/// \param mode - sequential, or split into PACK_CHUNK pieces across the thread pool
+template <class T>
+inline void unsafe_sign(const T* data, std::uint8_t* res, std::size_t size,
+                        ::execution mode = ::execution::sequential){
+    const auto kernel = sign_kernel<T>(dispatch());
+    pack_chunks([=](std::size_t begin, std::size_t end){
+        kernel(data + begin, res + begin / NUM_BITS, end - begin);
+    }, size, mode);
+}
+
+/// performs sign on 32 values at a single time and writes it into a uint32. Neither buffer needs to be aligned.
+/// \param data - float, double, int8, uint8, bool, float16 or bfloat16 array to extract sign from
+/// \param res - resulting packed bit array, LSB-first
+/// \param size - size of data
+/// \param mode - sequential, or split into PACK_CHUNK pieces across the thread pool
+template <class T>
+inline void sign(const T* data, std::uint8_t* res, std::size_t size,
+                 ::execution mode = ::execution::sequential){
+    unsafe_sign(data, res, size, mode);
+}
+
+/// Transposes an 8x8 bit matrix held in a uint64, byte r being row r with column c in bit c
+inline std::uint64_t transpose8x8(std::uint64_t x){
+    std::uint64_t t;
+    t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaULL;
+    x ^= t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000cccc0000ccccULL;
+    x ^= t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ULL;
+    x ^= t ^ (t << 28);
+    return x;
+}
+
+/// Packs the signs of a rows x cols matrix with arbitrary element strides into bit rows, so any
+/// layout (row-major, column-major or a strided view) is read in place without a float copy.
+///  - unit column stride: every row goes through the contiguous sign kernel
+///  - unit row stride (a column-major matrix, or the transpose of a row-major one): 32 columns at
+///    a time are signed along memory, and each 32x32 block of bits is transposed in registers
+///  - anything else: one strided load per value
+/// Only the first (cols + 7) / 8 bytes of each row are written.
+/// \param data - first element of the matrix
+/// \param rows - number of rows
+/// \param cols - number of columns, i.e. bits per packed row
+/// \param row_stride - distance in elements between rows
+/// \param col_stride - distance in elements between columns
+/// \param res - packed rows, row i starting at res + i * row_bytes
+/// \param row_bytes - distance in bytes between packed rows
+/// \param abs_sums - if not null, the sum of |value| over row i is added to abs_sums[i], taken
+///                   from each block of values while it is in L1 from being signed
+template <class T>
+inline void sign_matrix(const T* data, std::size_t rows, std::size_t cols,
+                        std::ptrdiff_t row_stride, std::ptrdiff_t col_stride,
+                        std::uint8_t* res, std::size_t row_bytes, float* abs_sums = nullptr){
+    const auto& selected = dispatch();
+    const auto kernel = sign_kernel<T>(selected);
+    auto at = [=](std::size_t i, std::size_t k){
+        return data + static_cast<std::ptrdiff_t>(i) * row_stride + static_cast<std::ptrdiff_t>(k) * col_stride;
+    };
+    if(col_stride == 1 || cols <= 1){
+        for(std::size_t i = 0; i < rows; i++){
+            if(!abs_sums){
+                kernel(at(i, 0), res + i * row_bytes, cols);
+                continue;
+            }
+            for(std::size_t k = 0; k < cols; k += STAGE_SIZE){
+                const auto n = std::min(STAGE_SIZE, cols - k);
+                kernel(at(i, k), res + i * row_bytes + k / NUM_BITS, n);
+                abs_sums[i] += scalar::abs_sum(at(i, k), n);
+            }
+        }
+        return;
+    }
+    if(row_stride == 1 || rows == 1){
+        // Rows are signed in blocks of BLOCK_ROWS, so each kernel call covers a run of contiguous values
+        static constexpr std::size_t BLOCK_ROWS = 256;
+        static constexpr std::size_t TILE = 32;
+        const auto out_bytes = (cols + NUM_BITS - 1) / NUM_BITS;
+        // lanes[q] holds column k + q of the block, one bit per row
+        alignas(ALIGN_SIZE) std::uint32_t lanes[TILE][BLOCK_ROWS / TILE];
+        std::uint32_t tile[TILE];
+        for(std::size_t i0 = 0; i0 < rows; i0 += BLOCK_ROWS){
+            const auto block = std::min(BLOCK_ROWS, rows - i0);
+            const auto block_words = (block + TILE - 1) / TILE;
+            if(block < BLOCK_ROWS)
+                std::memset(lanes, 0, sizeof(lanes));
+            for(std::size_t k = 0; k < cols; k += TILE){
+                for(std::size_t q = 0; q < TILE; q++){
+                    if(k + q < cols){
+                        kernel(at(i0, k + q), (std::uint8_t*) lanes[q], block);
+                        if(abs_sums)
+                            for(std::size_t r = 0; r < block; r++)
+                                abs_sums[i0 + r] += scalar::magnitude(at(i0 + r, k + q)[0]);
+                    }
+                    else
+                        std::memset(lanes[q], 0, sizeof(lanes[q]));
+                }
+                const auto n = std::min<std::size_t>(4, out_bytes - k / NUM_BITS);
+                for(std::size_t b = 0; b < block_words; b++){
+                    for(std::size_t q = 0; q < TILE; q++)
+                        tile[q] = lanes[q][b];
+                    selected.transpose32(tile);
+                    // Word r of the transposed tile is row 32b + r, columns k .. k + 31
+                    for(std::size_t r = 0; r < TILE && b * TILE + r < block; r++){
+                        const auto out = res + (i0 + b * TILE + r) * row_bytes + k / NUM_BITS;
+                        if(n == sizeof(tile[r]))
+                            std::memcpy(out, &tile[r], sizeof(tile[r]));
+                        else
+                            std::memcpy(out, &tile[r], n);
+                    }
+                }
+            }
+        }
+        return;
+    }
+    for(std::size_t i = 0; i < rows; i++){
+        auto out = res + i * row_bytes;
+        for(std::size_t k = 0; k < cols; k += NUM_BITS){
+            std::uint8_t byte = 0;
+            for(std::size_t q = 0; q < NUM_BITS && k + q < cols; q++){
+                byte |= scalar::sign_bit(*at(i, k + q)) << q;
+                if(abs_sums)
+                    abs_sums[i] += scalar::magnitude(*at(i, k + q));
+            }
+            out[k / NUM_BITS] = byte;
+        }
+    }
+}
+
+/// Transposes a packed bit matrix without unpacking it, 64x64 tiles at a time.
+/// Row i of src holds columns 0 .. cols - 1 LSB-first; row c of dst receives column c of src.
+/// Bits of src past `cols` are ignored, and only the first (rows + 7) / 8 bytes of each dst row
+/// are written, with the bits past `rows` zero.
+/// \param src - packed rows x cols bit matrix
+/// \param rows - number of rows of src, i.e. bits per dst row
+/// \param cols - number of columns of src, i.e. rows of dst
+/// \param src_row_bytes - distance in bytes between rows of src
+/// \param dst - packed cols x rows bit matrix
+/// \param dst_row_bytes - distance in bytes between rows of dst
+/// \param mode - sequential, or one task per 512 rows of dst across the thread pool
+inline void transpose_bits(const std::uint8_t* src, std::size_t rows, std::size_t cols, std::size_t src_row_bytes,
+                           std::uint8_t* dst, std::size_t dst_row_bytes,
+                           ::execution mode = ::execution::sequential){
+    static constexpr std::size_t TILE = 64;
+    // A strip is 8 tiles side by side, so every source row contributes one whole cache line per band
+    // instead of 8 bytes, which keeps the power-of-two row strides from thrashing L1
+    static constexpr std::size_t STRIP_TILES = 8;
+    static constexpr std::size_t STRIP = STRIP_TILES * TILE;
+    const auto transpose64 = dispatch().transpose64;
+    const auto src_bytes = (cols + NUM_BITS - 1) / NUM_BITS;
+    const auto dst_bytes = (rows + NUM_BITS - 1) / NUM_BITS;
+    // Columns k0 .. k0 + 511 of src become rows k0 .. k0 + 511 of dst
+    auto strip = [&](std::size_t k0){
+        const auto width = std::min(STRIP, cols - k0);
+        const auto tiles = (width + TILE - 1) / TILE;
+        const auto in = std::min(STRIP / NUM_BITS, src_bytes - k0 / NUM_BITS);
+        const auto last = width % TILE ? (1ULL << (width % TILE)) - 1 : ~0ULL;
+        std::uint64_t tile[STRIP_TILES][TILE];
+        for(std::size_t i0 = 0; i0 < rows; i0 += TILE){
+            const auto height = std::min(TILE, rows - i0);
+            for(std::size_t r = 0; r < TILE; r++){
+                std::uint64_t words[STRIP_TILES] = {0};
+                const auto row = src + (i0 + r) * src_row_bytes + k0 / NUM_BITS;
+                if(r < height && in == sizeof(words))
+                    std::memcpy(words, row, sizeof(words));
+                else if(r < height)
+                    std::memcpy(words, row, in);
+                words[tiles - 1] &= last;
+                for(std::size_t q = 0; q < tiles; q++)
+                    tile[q][r] = words[q];
+            }
+            const auto out = std::min<std::size_t>(8, dst_bytes - i0 / NUM_BITS);
+            for(std::size_t q = 0; q < tiles; q++){
+                transpose64(tile[q]);
+                for(std::size_t c = 0; c < TILE && q * TILE + c < width; c++){
+                    const auto row = dst + (k0 + q * TILE + c) * dst_row_bytes + i0 / NUM_BITS;
+                    if(out == 8)
+                        std::memcpy(row, &tile[q][c], 8);
+                    else
+                        std::memcpy(row, &tile[q][c], out);
+                }
+            }
+        }
+    };
+    const auto strips = (cols + STRIP - 1) / STRIP;
+    if(mode == ::execution::parallel){
+        thread_pool::global().parallel_for(strips, [&](std::size_t t){ strip(t * STRIP); });
+        return;
+    }
+    for(std::size_t t = 0; t < strips; t++)
+        strip(t * STRIP);
+}
+
+namespace expr{
+    /// Value types the sign packers take directly
+    template <class T>
+    using is_packable = std::disjunction<std::is_same<T, float>, std::is_same<T, double>, std::is_same<T, std::int8_t>,
+                                         std::is_same<T, std::uint8_t>, std::is_same<T, bool>,
+                                         std::is_same<T, float16>, std::is_same<T, bfloat16>>;
+
+    /// Type an expression is staged in before packing. Other arithmetic types are signed as float.
+    template <class E>
+    using stage_t = std::conditional_t<is_packable<typename E::value_type>::value, typename E::value_type, float>;
+
+    /// Whether e can be read in row-major order with linear xsimd loads, by the same rules xtensor
+    /// itself uses to assign an expression with SIMD: a contiguous row-major layout, a SIMD-capable
+    /// value type and no broadcasting
+    template <class E>
+    inline bool linear_simd(const E& e)
+    {
+        if constexpr(E::contiguous_layout && E::static_layout == xt::layout_type::row_major
+                     && xt::xassign_traits<xt::xarray<stage_t<E>>, E>::simd_assign()){
+            xt::svector<std::size_t, 4> shape(e.dimension(), 0);
+            return e.broadcast_shape(shape, true);
+        }
+        else{
+            return false;
+        }
+    }
+
+    /// Evaluates values [begin, end) of e in row-major order, STAGE_SIZE at a time, and hands every
+    /// block to sink(block, n). Linear expressions are read through xsimd batches, the rest through
+    /// the expression's stepper.
+    template <class E, class F>
+    inline void evaluate(const E& e, bool simd, std::size_t begin, std::size_t end, F&& sink)
+    {
+        using value_type = stage_t<E>;
+        alignas(ALIGN_SIZE) value_type stage[STAGE_SIZE];
+        // xsimd's 8-bit integer batches cannot be loaded from memory, so those go through the stepper
+        if constexpr(E::contiguous_layout && std::is_floating_point<value_type>::value
+                     && xt::xassign_traits<xt::xarray<value_type>, E>::simd_assign()){
+            if(simd){
+                using batch = xsimd::simd_type<value_type>;
+                for(std::size_t b = begin; b < end; b += STAGE_SIZE){
+                    const auto n = std::min(STAGE_SIZE, end - b);
+                    std::size_t i = 0;
+                    for(; i + batch::size <= n; i += batch::size)
+                        e.template load_simd<xt::unaligned_mode, batch>(b + i).store_unaligned(stage + i);
+                    for(; i < n; i++)
+                        stage[i] = static_cast<value_type>(e.data_element(b + i));
+                    sink(stage, n);
+                }
+                return;
+            }
+        }
+        // Anything else (broadcasting, views, other layouts) is walked with its stepper, a whole
+        // innermost row at a time, which skips the per-value index carry of the xiterator
+        const auto dim = e.dimension();
+        if(dim == 0){
+            if(begin < end){
+                stage[0] = static_cast<value_type>(e());
+                sink(stage, 1);
+            }
+            return;
+        }
+        const auto& shape = e.shape();
+        const auto last = dim - 1;
+        xt::svector<std::size_t, 4> index(dim);
+        auto st = e.stepper_begin(shape);
+        for(std::size_t d = dim, rest = begin; d-- > 0; rest /= shape[d]){
+            index[d] = rest % shape[d];
+            if(index[d])
+                st.step(d, index[d]);
+        }
+        std::size_t n = 0;
+        for(std::size_t i = begin; i < end;){
+            const auto run = std::min(shape[last] - index[last], end - i);
+            for(std::size_t j = 0; j < run; j++){
+                stage[n++] = static_cast<value_type>(*st);
+                if(j + 1 < run)
+                    st.step(last);
+                if(n == STAGE_SIZE){
+                    sink(stage, n);
+                    n = 0;
+                }
+            }
+            i += run;
+            if(i == end)
+                break;
+            // Carry into the outer dimensions
+            index[last] += run - 1;
+            std::size_t d = last;
+            while(index[d] + 1 == shape[d]){
+                index[d] = 0;
+                st.reset(d);
+                d--;
+            }
+            index[d]++;
+            st.step(d);
+        }
+        if(n)
+            sink(stage, n);
+    }
+
+    /// Visitor of sign() that looks at nothing
+    struct no_visit
+    {
+        template <class T>
+        void operator()(const T*, std::size_t) const {}
+    };
+
+    /// Packs values [begin, end) of e into res, which receives value begin in bit 0
+    /// \param visit - visit(block, n) is handed the values in order, at most STAGE_SIZE at a time,
+    ///                right after they are signed, e.g. to sum their magnitudes while they are in L1
+    template <class E, class F = no_visit>
+    inline void sign(const E& e, bool simd, std::size_t begin, std::size_t end, std::uint8_t* res, F&& visit = {})
+    {
+        const auto kernel = sign_kernel<stage_t<E>>(dispatch());
+        // Contiguous tensors of a packable type need no staging, the packer reads them in place
+        if constexpr(xt::has_data_interface<E>::value){
+            if constexpr(E::contiguous_layout && E::static_layout == xt::layout_type::row_major
+                         && is_packable<typename E::value_type>::value){
+                const auto data = e.data() + e.data_offset() + begin;
+                if constexpr(std::is_same<std::decay_t<F>, no_visit>::value){
+                    kernel(data, res, end - begin);
+                }
+                else{
+                    for(std::size_t b = 0; b < end - begin; b += STAGE_SIZE){
+                        const auto n = std::min(STAGE_SIZE, end - begin - b);
+                        kernel(data + b, res + b / NUM_BITS, n);
+                        visit(data + b, n);
+                    }
+                }
+                return;
+            }
+        }
+        auto out = res;
+        evaluate(e, simd, begin, end, [&](const stage_t<E>* block, std::size_t n){
+            kernel(block, out, n);
+            visit(block, n);
+            out += STAGE_SIZE / NUM_BITS;
+        });
+    }
+} // expr
+
+/// Packs the signs of any xtensor expression in row-major order, e.g. `x - running_mean` or a view,
+/// evaluating it straight into bits. The expression is computed STAGE_SIZE values at a time into a
+/// buffer in L1, through xsimd batches when its layout allows it, so no float tensor is ever formed.
+/// \param expression - expression to extract sign from, of a type sign() accepts or any arithmetic type
+/// \param res - resulting packed bit array, LSB-first, (size + 7) / 8 bytes
+/// \param mode - sequential, or split into PACK_CHUNK pieces across the thread pool
+template <class E>
+inline void sign(const xt::xexpression<E>& expression, std::uint8_t* res, ::execution mode = ::execution::sequential){
+    const auto& e = expression.derived_cast();
+    const bool simd = expr::linear_simd(e);
+    pack_chunks([&](std::size_t begin, std::size_t end){
+        expr::sign(e, simd, begin, end, res + begin / NUM_BITS);
+    }, e.size(), mode);
+}
+
+/// Performs xnor on packed bits. None of the buffers need to be aligned.
+/// \param x - left operand data
+/// \param y - right operand data
+/// \param res - result buffer to save into
+/// \param size - size of x and y. IMPORTANT: IN BITS.
+inline void xnor(const std::uint8_t* x, const std::uint8_t* y, std::uint8_t* res, std::size_t size){
+    dispatch().xnor(x, y, res, size);
+}
+
+/// Performs popcount (population count) on bits. data can have any alignment.
 /// \param data - bits of data
 /// \param size - length of data. IMPORTANT: IN BITS.
 inline long long sum(const std::uint8_t* data, const std::size_t size)
 {
-    ALLIGN_ASSERT(data)
-    static constexpr auto UINT8_PACK = 32;
     static constexpr auto SIZE_SCALE = 8;
-    // The block remainder is taken care of in popcnt
-    auto byte_size = size / SIZE_SCALE;
-    auto mm256_block = byte_size / UINT8_PACK;
-    auto total = popcnt::popcnt((const __m256i*) data, mm256_block);
-
-    auto residue = mm256_block*UINT8_PACK;
-    auto i = residue;
-    for (; i < residue + (size - residue*SIZE_SCALE)/SIZE_SCALE; i++)
-        total += lookup8bit[data[i]];
+    auto i = size / SIZE_SCALE;
+    auto total = dispatch().popcnt(data, i);
 
-    // Prevent modulo by 0 by adding 1 to residue
-    if(size - i*SIZE_SCALE) {
-        auto bit_residue = size - i * SIZE_SCALE;
-        if (bit_residue)
-            total += lookup8bit[data[i] & mask[bit_residue]];
-    }
+    auto bit_residue = size % SIZE_SCALE;
+    if (bit_residue)
+        total += lookup8bit[data[i] & mask[bit_residue]];
 
     // size - total = # zeros (-1's)
     // total = # ones (1's)
@@ -536,31 +1595,143 @@ inline long long sum(const std::uint8_t* data, const std::size_t size)
     return 2 * total - size;
 }
 
-/// Performs an xnordot on the given xt::xarrays
+/// Fused xnor + popcount on packed bits. Same result as xnor() followed by sum(),
+/// but x ^ y is fed straight into the popcount instead of being written to a third bitset.
+/// x and y can have any alignment.
+/// \param x - left operand data
+/// \param y - right operand data
+/// \param size - size of x and y. IMPORTANT: IN BITS.
+inline long long xnor_sum(const std::uint8_t* x, const std::uint8_t* y, const std::size_t size)
+{
+    static constexpr auto SIZE_SCALE = 8;
+    auto i = size / SIZE_SCALE;
+    auto mismatches = dispatch().popcnt_xor(x, y, i);
+
+    auto bit_residue = size % SIZE_SCALE;
+    if (bit_residue)
+        mismatches += lookup8bit[(x[i] ^ y[i]) & mask[bit_residue]];
+
+    // #matches - #mismatches
+    return static_cast<long long>(size) - 2 * static_cast<long long>(mismatches);
+}
+
+/// Fused sign + xnor + popcount straight from floats, with no packed bits written anywhere
+/// \param x - left operand floats
+/// \param y - right operand floats
+/// \param size - number of floats in x and y
+inline long long sign_xnor_sum(const float* x, const float* y, const std::size_t size)
+{
+    auto mismatches = dispatch().sign_xor_popcnt(x, y, size);
+    return static_cast<long long>(size) - 2 * static_cast<long long>(mismatches);
+}
+
+/// Sign + xnor + popcount for inputs without a fused kernel. Both operands are packed one
+/// DOT_CHUNK at a time into small buffers that stay in L1, and the packed chunks are counted.
+/// \param x - left operand values
+/// \param y - right operand values
+/// \param size - number of values in x and y
+template <class T, class U>
+inline long long sign_xnor_sum(const T* x, const U* y, const std::size_t size)
+{
+    workspace::frame frame;
+    const auto bx = frame.take<std::uint8_t>(DOT_CHUNK / NUM_BITS), by = frame.take<std::uint8_t>(DOT_CHUNK / NUM_BITS);
+    const auto pack_x = sign_kernel<T>(dispatch());
+    const auto pack_y = sign_kernel<U>(dispatch());
+    long long total = 0;
+    for(std::size_t begin = 0; begin < size; begin += DOT_CHUNK){
+        const auto n = std::min(DOT_CHUNK, size - begin);
+        pack_x(x + begin, bx, n);
+        pack_y(y + begin, by, n);
+        total += xnor_sum(bx, by, n);
+    }
+    return total;
+}
+
+/// Performs an xnordot on raw buffers, without copying them or requiring any alignment.
+/// Values up to the first ALIGN_SIZE boundary of x are peeled off so the bulk runs on aligned x.
+/// \param x - left operand values
+/// \param y - right operand values
+/// \param size - number of values in x and y
+/// \param mode - sequential, or split K into DOT_CHUNK pieces across the thread pool
+template <class T, class U>
+inline long long xnordot(const T* x, const U* y, std::size_t size,
+                         ::execution mode = ::execution::sequential){
+    long long total = 0;
+    const auto offset = reinterpret_cast<std::uintptr_t>(x) % ALIGN_SIZE;
+    if(offset % sizeof(T) == 0){
+        const auto head = std::min<std::size_t>(size, (ALIGN_SIZE - offset) % ALIGN_SIZE / sizeof(T));
+        total += sign_xnor_sum(x, y, head);
+        x += head;
+        y += head;
+        size -= head;
+    }
+    // For floats, signs are packed, xnor'd and counted in one pass without any intermediate bitsets
+    if(mode == ::execution::sequential || size <= DOT_CHUNK)
+        return total + sign_xnor_sum(x, y, size);
+
+    // Split-K: each task counts one chunk, partials are reduced in chunk order
+    const auto chunks = (size + DOT_CHUNK - 1) / DOT_CHUNK;
+    workspace::frame frame;
+    const auto partial = frame.take<long long>(chunks);
+    thread_pool::global().parallel_for(chunks, [&](std::size_t t){
+        const auto begin = t * DOT_CHUNK;
+        partial[t] = sign_xnor_sum(x + begin, y + begin, std::min(size, begin + DOT_CHUNK) - begin);
+    });
+    for(std::size_t t = 0; t < chunks; t++)
+        total += partial[t];
+    return total;
+}
+
+/// Performs an xnordot on the given xt::xarrays, which must have the same size. Float pairs use the fused kernel, every other
+/// combination of float, double, int8, uint8, bool, float16 and bfloat16 is packed chunk by chunk.
+/// The operands may have any alignment, the misaligned head is peeled.
 /// \param a1 - xarray to compute dot product
 /// \param a2 - xarray to compute dot product
-inline long long xnordot(const xt::xarray<float>& a1,
-const xt::xarray<float>& a2,
-::input_alignment alignment = ::input_alignment::safe){
-    // Enforce alignment
-    xtl::xdynamic_bitset<std::uint8_t, xsimd::aligned_allocator<std::uint8_t, 32>> bitset_a1;
-    xtl::xdynamic_bitset<std::uint8_t, xsimd::aligned_allocator<std::uint8_t, 32>> bitset_a2;
-    xtl::xdynamic_bitset<std::uint8_t, xsimd::aligned_allocator<std::uint8_t, 32>> res;
-    const auto RESULT_SIZE = a1.size();
-    bitset_a1.reserve(RESULT_SIZE);
-    bitset_a2.reserve(RESULT_SIZE);
-    res.reserve(RESULT_SIZE);
-
-    if(alignment == ::input_alignment::safe) {
-        ALLIGN_ASSERT(a1.data())
-        ALLIGN_ASSERT(a2.data())
-        sign(a1.data(), bitset_a1.data(), RESULT_SIZE);
-        sign(a2.data(), bitset_a2.data(), RESULT_SIZE);
-    }
-    else{
-        unsafe_sign(a1.data(), bitset_a1.data(), RESULT_SIZE);
-        unsafe_sign(a2.data(), bitset_a2.data(), RESULT_SIZE);
-    }
-    xnor(bitset_a1.data(), bitset_a2.data(), res.data(), RESULT_SIZE);
-    return sum(res.data(), RESULT_SIZE);
+/// \param alignment - kept for existing callers; both values behave the same
+/// \param mode - sequential, or split K into DOT_CHUNK pieces across the thread pool
+template <class T, class U>
+inline long long xnordot(const xt::xarray<T>& a1,
+const xt::xarray<U>& a2,
+::input_alignment /*alignment*/ = ::input_alignment::safe,
+::execution mode = ::execution::sequential){
+    XTENSOR_ASSERT(a1.size() == a2.size())
+    return xnordot(a1.data(), a2.data(), a1.size(), mode);
+}
+
+/// Performs an xnordot on any two xtensor expressions of the same size, e.g. `x - running_mean`
+/// or a view into a batch. Both are evaluated straight into packed bits DOT_CHUNK values at a time,
+/// so neither is materialized as a float tensor.
+/// \param e1 - expression to compute dot product
+/// \param e2 - expression to compute dot product
+/// \param mode - sequential, or split K into DOT_CHUNK pieces across the thread pool
+template <class E1, class E2>
+inline long long xnordot(const xt::xexpression<E1>& e1, const xt::xexpression<E2>& e2,
+                         ::execution mode = ::execution::sequential){
+    const auto& x = e1.derived_cast();
+    const auto& y = e2.derived_cast();
+    XTENSOR_ASSERT(x.size() == y.size())
+    const auto size = x.size();
+    const bool simd_x = expr::linear_simd(x), simd_y = expr::linear_simd(y);
+    auto kernel = [&](std::size_t begin, std::size_t end){
+        workspace::frame frame;
+        const auto bx = frame.take<std::uint8_t>(DOT_CHUNK / NUM_BITS), by = frame.take<std::uint8_t>(DOT_CHUNK / NUM_BITS);
+        expr::sign(x, simd_x, begin, end, bx);
+        expr::sign(y, simd_y, begin, end, by);
+        return xnor_sum(bx, by, end - begin);
+    };
+    const auto chunks = (size + DOT_CHUNK - 1) / DOT_CHUNK;
+    workspace::frame frame;
+    const auto partial = frame.take<long long>(chunks);
+    auto task = [&](std::size_t t){
+        partial[t] = kernel(t * DOT_CHUNK, std::min(size, (t + 1) * DOT_CHUNK));
+    };
+    if(mode == ::execution::parallel)
+        thread_pool::global().parallel_for(chunks, task);
+    else
+        for(std::size_t t = 0; t < chunks; t++)
+            task(t);
+    long long total = 0;
+    for(std::size_t t = 0; t < chunks; t++)
+        total += partial[t];
+    return total;
 }
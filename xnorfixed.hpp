@@ -0,0 +1,338 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include "xnordot.hpp"
+#include "threadpool.hpp"
+#include "dispatch.hpp"
+
+// Kernels for packed codes of a width known at compile time. With K fixed every loop has a
+// constant trip count and fully unrolls, and there is no residue, mask[] lookup or size branch,
+// which is what dominates when millions of short codes are compared.
+// Codes are packed LSB-first as sign() writes them, K / 8 bytes each, and need no alignment.
+
+/// Code widths in bits that have their own instantiation, see fixed_xnordot / fixed_xnorgemm
+static constexpr std::size_t FIXED_WIDTHS[] = {64, 128, 256, 512, 1024, 4096};
+
+namespace fixed{
+    /// Mismatching bits between two K-bit codes
+    template <std::size_t K>
+    using popcnt_xor_t = std::uint64_t (*)(const std::uint8_t* x, const std::uint8_t* y);
+
+    /// Mismatching bits between code x and each of the TILE codes back to back at y
+    template <std::size_t K>
+    using popcnt_xor_tile_t = void (*)(const std::uint8_t* x, const std::uint8_t* y, std::uint64_t* counts);
+
+    /// All m x n code pairs of a against b, c(i, j) = #matches - #mismatches
+    using gemm_t = void (*)(const std::uint8_t* a, std::size_t m, const std::uint8_t* b, std::size_t n,
+                            float* c, std::size_t ldc);
+
+    /// Codes of b compared with one code of a per popcnt_xor_tile call
+    static constexpr std::size_t TILE = 4;
+
+    /// The gemm of every instruction set. Each code of a is compared with TILE codes of b per Tile
+    /// call, which keeps its words in registers while the b codes stream past. It is inlined into each
+    /// instruction set's gemm, inside whose target region Tile and Single can inline in turn.
+    template <std::size_t K, popcnt_xor_tile_t<K> Tile, popcnt_xor_t<K> Single>
+    [[gnu::always_inline]] inline void tiled_gemm(const std::uint8_t* a, std::size_t m, const std::uint8_t* b, std::size_t n,
+                                                  float* c, std::size_t ldc){
+        const auto dot = [](std::uint64_t mismatches){
+            return static_cast<float>(static_cast<long long>(K) - 2 * static_cast<long long>(mismatches));
+        };
+        const std::size_t tiled = n / TILE * TILE;
+        for(std::size_t i = 0; i < m; i++){
+            const auto x = a + i * K / 8;
+            const auto row = c + i * ldc;
+            for(std::size_t j = 0; j < tiled; j += TILE){
+                std::uint64_t counts[TILE];
+                Tile(x, b + j * K / 8, counts);
+                for(std::size_t q = 0; q < TILE; q++)
+                    row[j + q] = dot(counts[q]);
+            }
+            for(std::size_t j = tiled; j < n; j++)
+                row[j] = dot(Single(x, b + j * K / 8));
+        }
+    }
+
+    namespace scalar{
+        template <std::size_t K>
+        inline std::uint64_t popcnt_xor(const std::uint8_t* x, const std::uint8_t* y){
+            std::uint64_t total = 0;
+            for(std::size_t w = 0; w < K / 64; w++){
+                std::uint64_t a, b;
+                std::memcpy(&a, x + w * 8, 8);
+                std::memcpy(&b, y + w * 8, 8);
+                total += __builtin_popcountll(a ^ b);
+            }
+            return total;
+        }
+
+        template <std::size_t K>
+        inline void popcnt_xor_tile(const std::uint8_t* x, const std::uint8_t* y, std::uint64_t* counts){
+            for(std::size_t q = 0; q < TILE; q++)
+                counts[q] = popcnt_xor<K>(x, y + q * K / 8);
+        }
+
+        template <std::size_t K>
+        inline void gemm(const std::uint8_t* a, std::size_t m, const std::uint8_t* b, std::size_t n,
+                         float* c, std::size_t ldc){
+            tiled_gemm<K, popcnt_xor_tile<K>, popcnt_xor<K>>(a, m, b, n, c, ldc);
+        }
+    } // scalar
+} // fixed
+
+XNOR_TARGET_PUSH(XNOR_SSE42_TARGET)
+namespace fixed{
+    namespace sse42{
+        /// K / 64 popcnt64s in a constant-trip loop, which the compiler unrolls and splits itself
+        template <std::size_t K>
+        inline std::uint64_t popcnt_xor(const std::uint8_t* x, const std::uint8_t* y){
+            std::uint64_t total = 0;
+            for(std::size_t w = 0; w < K / 64; w++)
+                total += _mm_popcnt_u64(::sse42::load64(x + w * 8) ^ ::sse42::load64(y + w * 8));
+            return total;
+        }
+
+        /// Unrolled with constant trip counts, the TILE sums share one load of each word of x
+        template <std::size_t K>
+        inline void popcnt_xor_tile(const std::uint8_t* x, const std::uint8_t* y, std::uint64_t* counts){
+            for(std::size_t q = 0; q < TILE; q++)
+                counts[q] = popcnt_xor<K>(x, y + q * K / 8);
+        }
+
+        template <std::size_t K>
+        inline void gemm(const std::uint8_t* a, std::size_t m, const std::uint8_t* b, std::size_t n,
+                         float* c, std::size_t ldc){
+            tiled_gemm<K, popcnt_xor_tile<K>, popcnt_xor<K>>(a, m, b, n, c, ldc);
+        }
+    } // sse42
+} // fixed
+XNOR_TARGET_POP
+
+XNOR_TARGET_PUSH(XNOR_AVX2_TARGET)
+namespace fixed{
+    namespace avx2{
+        /// popcnt64 below popcnt::POPCNT64_BYTES, where the LUT's horizontal sum costs more than it saves
+        template <std::size_t K>
+        inline std::uint64_t popcnt_xor(const std::uint8_t* x, const std::uint8_t* y){
+            if constexpr(K / 8 < ::popcnt::POPCNT64_BYTES)
+                return sse42::popcnt_xor<K>(x, y);
+            else
+                return ::popcnt::lut([x, y](std::uint64_t i){
+                    return _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (x + i * 32)),
+                                            _mm256_loadu_si256((const __m256i*) (y + i * 32)));
+                }, K / 256);
+        }
+
+        /// The nibble LUT with one byte accumulator per code of b, reduced together by hsum4
+        template <std::size_t K>
+        inline void popcnt_xor_tile(const std::uint8_t* x, const std::uint8_t* y, std::uint64_t* counts){
+            static_assert(TILE == 4, "hsum4 reduces four codes");
+            if constexpr(K / 8 < ::popcnt::POPCNT64_BYTES)
+                sse42::popcnt_xor_tile<K>(x, y, counts);
+            else{
+                const __m256i lookup = ::popcnt::lookup_table();
+                const __m256i low_mask = _mm256_set1_epi8(0x0f);
+                __m256i totals[TILE];
+                for(auto& t : totals)
+                    t = _mm256_setzero_si256();
+                for(std::size_t v = 0; v < K / 256; v += ::popcnt::BYTE_ACCUM_BLOCKS){
+                    const auto limit = std::min<std::size_t>(K / 256, v + ::popcnt::BYTE_ACCUM_BLOCKS);
+                    __m256i bytes[TILE];
+                    for(auto& t : bytes)
+                        t = _mm256_setzero_si256();
+                    for(auto i = v; i < limit; i++){
+                        const __m256i a = _mm256_loadu_si256((const __m256i*) (x + i * 32));
+                        for(std::size_t q = 0; q < TILE; q++)
+                            bytes[q] = _mm256_add_epi8(bytes[q], ::popcnt::popcount_lut(
+                                    _mm256_xor_si256(a, _mm256_loadu_si256((const __m256i*) (y + q * K / 8 + i * 32))),
+                                    lookup, low_mask));
+                    }
+                    for(std::size_t q = 0; q < TILE; q++)
+                        totals[q] = _mm256_add_epi64(totals[q], _mm256_sad_epu8(bytes[q], _mm256_setzero_si256()));
+                }
+                _mm256_storeu_si256((__m256i*) counts, ::popcnt::hsum4(totals[0], totals[1], totals[2], totals[3]));
+            }
+        }
+
+        template <std::size_t K>
+        inline void gemm(const std::uint8_t* a, std::size_t m, const std::uint8_t* b, std::size_t n,
+                         float* c, std::size_t ldc){
+            tiled_gemm<K, popcnt_xor_tile<K>, popcnt_xor<K>>(a, m, b, n, c, ldc);
+        }
+    } // avx2
+} // fixed
+XNOR_TARGET_POP
+
+XNOR_TARGET_PUSH(XNOR_AVX512_VPOPCNT_TARGET)
+namespace fixed{
+    namespace avx512{
+        /// One VPOPCNTQ per 512 bits, narrower codes go through popcnt64
+        template <std::size_t K>
+        inline std::uint64_t popcnt_xor(const std::uint8_t* x, const std::uint8_t* y){
+            if constexpr(K < 512)
+                return sse42::popcnt_xor<K>(x, y);
+            else{
+                __m512i total = _mm512_setzero_si512();
+                for(std::size_t v = 0; v < K / 512; v++)
+                    total = _mm512_add_epi64(total, _mm512_popcnt_epi64(_mm512_xor_si512(_mm512_loadu_si512(x + v * 64),
+                                                                                          _mm512_loadu_si512(y + v * 64))));
+                return static_cast<std::uint64_t>(_mm512_reduce_add_epi64(total));
+            }
+        }
+
+        /// A VPOPCNTQ accumulator per code of b, each 512 bits of x loaded once for all of them
+        template <std::size_t K>
+        inline void popcnt_xor_tile(const std::uint8_t* x, const std::uint8_t* y, std::uint64_t* counts){
+            if constexpr(K < 512)
+                sse42::popcnt_xor_tile<K>(x, y, counts);
+            else{
+                __m512i totals[TILE];
+                for(auto& t : totals)
+                    t = _mm512_setzero_si512();
+                for(std::size_t v = 0; v < K / 512; v++){
+                    const __m512i a = _mm512_loadu_si512(x + v * 64);
+                    for(std::size_t q = 0; q < TILE; q++)
+                        totals[q] = _mm512_add_epi64(totals[q], _mm512_popcnt_epi64(_mm512_xor_si512(a,
+                                                                 _mm512_loadu_si512(y + q * K / 8 + v * 64))));
+                }
+                for(std::size_t q = 0; q < TILE; q++)
+                    counts[q] = static_cast<std::uint64_t>(_mm512_reduce_add_epi64(totals[q]));
+            }
+        }
+
+        template <std::size_t K>
+        inline void gemm(const std::uint8_t* a, std::size_t m, const std::uint8_t* b, std::size_t n,
+                         float* c, std::size_t ldc){
+            tiled_gemm<K, popcnt_xor_tile<K>, popcnt_xor<K>>(a, m, b, n, c, ldc);
+        }
+    } // avx512
+} // fixed
+XNOR_TARGET_POP
+
+namespace fixed{
+    template <std::size_t K>
+    struct kernels
+    {
+        popcnt_xor_t<K> popcnt_xor;
+        gemm_t gemm;
+    };
+
+    template <std::size_t K>
+    inline kernels<K> kernels_for(::isa level)
+    {
+        switch(level){
+            case ::isa::scalar: return {scalar::popcnt_xor<K>, scalar::gemm<K>};
+            case ::isa::sse42: return {sse42::popcnt_xor<K>, sse42::gemm<K>};
+            case ::isa::avx2: return {avx2::popcnt_xor<K>, avx2::gemm<K>};
+            // Without VPOPCNTDQ the 512-bit level has nothing over the AVX2 LUT at these widths
+            case ::isa::avx512:
+                if(has_vpopcntdq())
+                    return {avx512::popcnt_xor<K>, avx512::gemm<K>};
+                return {avx2::popcnt_xor<K>, avx2::gemm<K>};
+        }
+        return {scalar::popcnt_xor<K>, scalar::gemm<K>};
+    }
+
+    /// K-bit kernels for the fastest instruction set of this CPU, selected once on first use
+    template <std::size_t K>
+    inline const kernels<K>& dispatch()
+    {
+        static const kernels<K> selected = kernels_for<K>(detect_isa());
+        return selected;
+    }
+} // fixed
+
+/// xnordot of two packed K-bit codes, fully unrolled for the compile-time width
+/// \param x - left code, K / 8 bytes
+/// \param y - right code, K / 8 bytes
+template <std::size_t K>
+inline long long xnordot(const std::uint8_t* x, const std::uint8_t* y){
+    static_assert(K % 64 == 0, "fixed-width kernels work on whole 64-bit words");
+    return static_cast<long long>(K) - 2 * static_cast<long long>(fixed::dispatch<K>().popcnt_xor(x, y));
+}
+
+/// xnorgemm of packed K-bit codes: c(i, j) is the xnordot of code i of a and code j of b
+/// \param a - m codes back to back, K / 8 bytes each
+/// \param m - number of codes in a
+/// \param b - n codes back to back, K / 8 bytes each
+/// \param n - number of codes in b
+/// \param c - m x n row-major output, overwritten
+/// \param ldc - distance in elements between rows of c
+/// \param mode - sequential, or spread blocks of rows of a across the thread pool
+template <std::size_t K>
+inline void xnorgemm(const std::uint8_t* a, std::size_t m, const std::uint8_t* b, std::size_t n,
+                     float* c, std::size_t ldc, ::execution mode = ::execution::sequential){
+    static_assert(K % 64 == 0, "fixed-width kernels work on whole 64-bit words");
+    // Rows per task; a block of b codes is swept once per row, so rows only need enough work to amortize a task
+    static constexpr std::size_t ROWS = 16;
+    const auto gemm = fixed::dispatch<K>().gemm;
+    if(mode == ::execution::sequential){
+        gemm(a, m, b, n, c, ldc);
+        return;
+    }
+    thread_pool::global().parallel_for((m + ROWS - 1) / ROWS, [&](std::size_t t){
+        const auto i = t * ROWS;
+        gemm(a + i * K / 8, std::min(ROWS, m - i), b, n, c + i * ldc, ldc);
+    });
+}
+
+using fixed_xnordot_t = long long (*)(const std::uint8_t* x, const std::uint8_t* y);
+using fixed_xnorgemm_t = void (*)(const std::uint8_t* a, std::size_t m, const std::uint8_t* b, std::size_t n,
+                                  float* c, std::size_t ldc, ::execution mode);
+
+/// The xnordot<K> instantiation for a width known only at runtime, nullptr if K is not in FIXED_WIDTHS
+inline fixed_xnordot_t fixed_xnordot(std::size_t bits){
+    switch(bits){
+        case 64: return xnordot<64>;
+        case 128: return xnordot<128>;
+        case 256: return xnordot<256>;
+        case 512: return xnordot<512>;
+        case 1024: return xnordot<1024>;
+        case 4096: return xnordot<4096>;
+    }
+    return nullptr;
+}
+
+/// The xnorgemm<K> instantiation for a width known only at runtime, nullptr if K is not in FIXED_WIDTHS
+inline fixed_xnorgemm_t fixed_xnorgemm(std::size_t bits){
+    switch(bits){
+        case 64: return xnorgemm<64>;
+        case 128: return xnorgemm<128>;
+        case 256: return xnorgemm<256>;
+        case 512: return xnorgemm<512>;
+        case 1024: return xnorgemm<1024>;
+        case 4096: return xnorgemm<4096>;
+    }
+    return nullptr;
+}
+
+/// xnorgemm of packed codes whose width is only known at runtime. Widths in FIXED_WIDTHS go
+/// through their unrolled instantiation, any other width through xnor_sum on (bits + 7) / 8 bytes.
+/// \param a - m codes back to back
+/// \param m - number of codes in a
+/// \param b - n codes back to back
+/// \param n - number of codes in b
+/// \param bits - width of a code in bits
+/// \param c - m x n row-major output, overwritten
+/// \param ldc - distance in elements between rows of c
+/// \param mode - sequential, or spread blocks of rows of a across the thread pool
+inline void xnorgemm_codes(const std::uint8_t* a, std::size_t m, const std::uint8_t* b, std::size_t n, std::size_t bits,
+                           float* c, std::size_t ldc, ::execution mode = ::execution::sequential){
+    if(const auto kernel = fixed_xnorgemm(bits)){
+        kernel(a, m, b, n, c, ldc, mode);
+        return;
+    }
+    const auto bytes = (bits + NUM_BITS - 1) / NUM_BITS;
+    auto rows = [&](std::size_t i){
+        for(std::size_t j = 0; j < n; j++)
+            c[i * ldc + j] = static_cast<float>(xnor_sum(a + i * bytes, b + j * bytes, bits));
+    };
+    if(mode == ::execution::parallel){
+        thread_pool::global().parallel_for(m, rows);
+        return;
+    }
+    for(std::size_t i = 0; i < m; i++)
+        rows(i);
+}
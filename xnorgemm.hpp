@@ -2,6 +2,13 @@
 #define XTENSOR_USE_XSIMD
 #include <iostream>
 #include <vector>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
 #include <xtensor/xarray.hpp>
 #include <xtensor/xview.hpp>
 
@@ -10,90 +17,694 @@
 #include <xsimd/memory/xsimd_aligned_allocator.hpp>
 
 #include "xnordot.hpp"
+#include "threadpool.hpp"
+#include "dispatch.hpp"
+#include "workspace.hpp"
+#include "hugepage.hpp"
 
-using bitset_t = xtl::xdynamic_bitset<std::uint8_t, xsimd::aligned_allocator<std::uint8_t, 32>>;
-static constexpr unsigned long int BLOCK_SIZE = 1000;
+// Packed buffers come from huge_page_allocator, so the large ones can sit on huge pages, see set_page_policy
+using bitset_t = xtl::xdynamic_bitset<std::uint8_t, huge_page_allocator<std::uint8_t>>;
+// Packed panels are stored as 64-bit words so a 256-bit chunk is 4 words
+using panel_t = std::vector<std::uint64_t, huge_page_allocator<std::uint64_t>>;
 
-/// Performs an xnorgemm on the given xt::xarrays
-/// \param a1 - xarray to compute gemm
-/// \param a2 - xarray to compute gemm
-inline xt::xarray<float> xnorgemm(const xt::xarray<float>& a1,
-const xt::xarray<float>& _a2
-){
-    xt::xarray<float> a2 = xt::transpose(_a2);
-    // Check allignment
-    C_LAYOUT_ASSERT(a1)
-    C_LAYOUT_ASSERT(a2)
-    ALLIGN_ASSERT(a1.data())
-    ALLIGN_ASSERT(a2.data())
-    // Check size
-    XTENSOR_ASSERT(a1.dimension() == 2 && a2.dimension() == 2)
+// Blocking parameters, GotoBLAS style. All K-quantities are in bits.
+// The microkernel walks K one 256-bit chunk at a time.
+static constexpr std::size_t CHUNK_BITS = 256;
+static constexpr std::size_t CHUNK_WORDS = CHUNK_BITS / 64;
+// MR x NR is the register tile: MR rows of A against NR columns of B
+static constexpr std::size_t MR = 2;
+static constexpr std::size_t NR = 4;
+// KC bits is 1KB per row, so an NR-wide sliver of B (4KB) stays in L1
+static constexpr std::size_t KC = 8192;
+// MC rows of A (128KB at KC) stay in L2, NC columns of B (2MB at KC) stay in L3
+static constexpr std::size_t MC = 128;
+static constexpr std::size_t NC = 2048;
+// In parallel mode an output tile of MC x NT is one task. Tasks run in NC-block order so the
+// threads work on the same B panel while it is in the shared L3.
+static constexpr std::size_t NT = 256;
+// Rows signed per packing task
+static constexpr std::size_t PACK_ROWS = 64;
 
-    const auto in_shape_a1 = a1.shape();
-    const auto in_shape_a2 = a2.shape();
-    const auto result_shape = decltype(in_shape_a1) {in_shape_a1[0], in_shape_a2[0]};
-
-    // Enforce alignment
-    std::vector<bitset_t> bitset_a1(in_shape_a1[0], bitset_t(in_shape_a1[1]));
-    // Transpose it
-    std::vector<bitset_t> bitset_a2(in_shape_a2[0], bitset_t(in_shape_a2[1]));
-    xt::xarray<float> res;
-    res.resize(result_shape);
-
-    for(int i = 0; i < in_shape_a1[0]; i++){
-        // Reserve space for appropriate # of bits
-        bitset_a1[i].resize(in_shape_a1[1]);
-        auto offset = i * in_shape_a1[1];
-        unsafe_sign(a1.data() + offset, bitset_a1[i].data(), in_shape_a1[1]);
+/// Number of 64-bit words in the panels of `rows` packed rows of `cols` bits, R rows to a panel
+inline std::size_t panel_words(std::size_t rows, std::size_t cols, std::size_t rows_per_panel){
+    const auto chunks = (cols + CHUNK_BITS - 1) / CHUNK_BITS;
+    return (rows + rows_per_panel - 1) / rows_per_panel * rows_per_panel * chunks * CHUNK_WORDS;
+}
+
+/// Packs rows into interleaved bit panels.
+/// Panel p holds, for each 256-bit chunk k, the k-th chunk of rows p*R .. p*R+R-1 back to back,
+/// so the microkernel reads a single contiguous stream. Rows past the end of the matrix and bits
+/// past the end of a row are zero in both operands, so they never count as mismatches.
+/// \param packed - output, panel_words(rows, cols, rows_per_panel) words, overwritten
+/// \param rows - number of rows
+/// \param cols - number of columns, i.e. bits per packed row
+/// \param rows_per_panel - R, the number of rows interleaved in a panel (MR or NR)
+/// \param mode - whether to spread the rows across the thread pool
+/// \param sign_rows - sign_rows(i0, n, out, row_bytes) packs rows i0 .. i0 + n - 1 to out, row_bytes apart,
+///                    writing at most (cols + 7) / 8 bytes per row
+template <class F>
+inline void pack_panels_with(std::uint64_t* packed, std::size_t rows, std::size_t cols, std::size_t rows_per_panel,
+                             ::execution mode, F&& sign_rows){
+    const auto chunks = (cols + CHUNK_BITS - 1) / CHUNK_BITS;
+    std::fill(packed, packed + panel_words(rows, cols, rows_per_panel), std::uint64_t(0));
+
+    auto pack_rows = [&](std::size_t begin, std::size_t end){
+        // Rows are interleaved chunk by chunk, so PACK_ROWS rows are signed into scratch first.
+        // Bytes past the end of a row are never written and stay zero.
+        const auto row_words = chunks * CHUNK_WORDS;
+        workspace::frame frame;
+        const auto scratch = frame.take_zeroed<std::uint64_t>(PACK_ROWS * row_words);
+        for(std::size_t i0 = begin; i0 < end; i0 += PACK_ROWS){
+            const auto n = std::min(PACK_ROWS, end - i0);
+            sign_rows(i0, n, (std::uint8_t*) scratch, row_words * sizeof(std::uint64_t));
+            for(std::size_t i = i0; i < i0 + n; i++){
+                auto row = scratch + (i - i0) * row_words;
+                auto panel = packed + (i / rows_per_panel) * rows_per_panel * chunks * CHUNK_WORDS;
+                auto lane = i % rows_per_panel;
+                for(std::size_t k = 0; k < chunks; k++){
+                    std::memcpy(panel + (k * rows_per_panel + lane) * CHUNK_WORDS, row + k * CHUNK_WORDS,
+                                CHUNK_WORDS * sizeof(std::uint64_t));
+                }
+            }
+        }
+    };
+
+    if(mode == ::execution::parallel){
+        thread_pool::global().parallel_for((rows + PACK_ROWS - 1) / PACK_ROWS, [&](std::size_t t){
+            pack_rows(t * PACK_ROWS, std::min(rows, (t + 1) * PACK_ROWS));
+        });
+    }
+    else{
+        pack_rows(0, rows);
     }
+}
+
+/// pack_panels_with into newly allocated panels
+template <class F>
+inline panel_t pack_panels_with(std::size_t rows, std::size_t cols, std::size_t rows_per_panel,
+                                ::execution mode, F&& sign_rows){
+    panel_t packed(panel_words(rows, cols, rows_per_panel));
+    pack_panels_with(packed.data(), rows, cols, rows_per_panel, mode, std::forward<F>(sign_rows));
+    return packed;
+}
+
+/// Packs the rows of a matrix into interleaved bit panels, see pack_panels_with.
+/// The matrix is read through its strides, so a transposed or column-major operand is never copied.
+/// \param packed - output, panel_words(rows, cols, rows_per_panel) words, overwritten
+/// \param data - first element of the matrix, of any type sign() accepts
+/// \param rows - number of rows
+/// \param cols - number of columns, i.e. bits per packed row
+/// \param row_stride - distance in elements between rows
+/// \param col_stride - distance in elements between columns
+/// \param rows_per_panel - R, the number of rows interleaved in a panel (MR or NR)
+/// \param mode - whether to spread the rows across the thread pool
+/// \param row_means - if not null, receives the mean |value| of every row, the XNOR-Net scaling
+///                    factor, summed in the same pass that signs the row
+template <class T>
+inline void pack_panels_into(std::uint64_t* packed, const T* data, std::size_t rows, std::size_t cols,
+                             std::ptrdiff_t row_stride, std::ptrdiff_t col_stride, std::size_t rows_per_panel,
+                             ::execution mode, float* row_means = nullptr){
+    pack_panels_with(packed, rows, cols, rows_per_panel, mode,
+                     [&](std::size_t i0, std::size_t n, std::uint8_t* out, std::size_t row_bytes){
+        const auto sums = row_means ? row_means + i0 : nullptr;
+        if(sums)
+            std::fill(sums, sums + n, 0.f);
+        sign_matrix(data + static_cast<std::ptrdiff_t>(i0) * row_stride, n, cols, row_stride, col_stride, out, row_bytes, sums);
+        if(sums && cols)
+            for(std::size_t i = 0; i < n; i++)
+                sums[i] /= static_cast<float>(cols);
+    });
+}
+
+/// pack_panels_into newly allocated panels
+template <class T>
+inline panel_t pack_panels(const T* data, std::size_t rows, std::size_t cols,
+                           std::ptrdiff_t row_stride, std::ptrdiff_t col_stride, std::size_t rows_per_panel,
+                           ::execution mode = ::execution::sequential){
+    panel_t packed(panel_words(rows, cols, rows_per_panel));
+    pack_panels_into(packed.data(), data, rows, cols, row_stride, col_stride, rows_per_panel, mode);
+    return packed;
+}
+
+/// Packs an xtensor expression, read in row-major order as rows x cols, into interleaved bit panels,
+/// evaluating it straight into bits with no float copy, see sign(const xt::xexpression<E>&, ...).
+/// Any leading axes of an N-d expression are folded into the rows.
+/// \param packed - output, panel_words(rows, cols, rows_per_panel) words, overwritten
+/// \param row_means - if not null, receives the mean |value| of every row, taken from each block of
+///                    the expression as it is evaluated for signing
+template <class E>
+inline void pack_panels_into(std::uint64_t* packed, const E& e, std::size_t rows, std::size_t cols,
+                             std::size_t rows_per_panel, ::execution mode, float* row_means = nullptr){
+    const bool simd = expr::linear_simd(e);
+    pack_panels_with(packed, rows, cols, rows_per_panel, mode,
+                     [&](std::size_t i0, std::size_t n, std::uint8_t* out, std::size_t row_bytes){
+        for(std::size_t i = i0; i < i0 + n; i++){
+            if(!row_means){
+                expr::sign(e, simd, i * cols, (i + 1) * cols, out + (i - i0) * row_bytes);
+                continue;
+            }
+            float sum = 0.f;
+            expr::sign(e, simd, i * cols, (i + 1) * cols, out + (i - i0) * row_bytes,
+                       [&](const auto* block, std::size_t m){ sum += scalar::abs_sum(block, m); });
+            row_means[i] = cols ? sum / static_cast<float>(cols) : 0.f;
+        }
+    });
+}
+
+/// pack_panels_into newly allocated panels
+template <class E>
+inline panel_t pack_panels(const E& e, std::size_t rows, std::size_t cols, std::size_t rows_per_panel,
+                           ::execution mode = ::execution::sequential){
+    panel_t packed(panel_words(rows, cols, rows_per_panel));
+    pack_panels_into(packed.data(), e, rows, cols, rows_per_panel, mode);
+    return packed;
+}
+
+/// Packs the rows of a 2-D xtensor expression into interleaved bit panels
+template <class E>
+inline panel_t pack_panels(const E& e, std::size_t rows_per_panel, ::execution mode = ::execution::sequential){
+    return pack_panels(e, e.shape()[0], e.shape()[1], rows_per_panel, mode);
+}
+
+/// Packs the columns of a 2-D xtensor expression into interleaved bit panels. The expression is
+/// evaluated row by row into a packed bit matrix, which is then transposed in the bit domain.
+/// \param packed - output, panel_words(columns, rows, rows_per_panel) words, overwritten
+/// \param col_means - if not null, receives the mean |value| of every column, accumulated from each
+///                    block of a row as it is evaluated for signing
+template <class E>
+inline void pack_column_panels_into(std::uint64_t* packed, const E& e, std::size_t rows_per_panel, ::execution mode,
+                                    float* col_means = nullptr){
+    const std::size_t rows = e.shape()[0], cols = e.shape()[1];
+    if(col_means)
+        std::fill(col_means, col_means + cols, 0.f);
+    // With no rows the columns have no bits, so there are no chunks and no panels
+    if(rows == 0)
+        return;
+    const auto row_bytes = (cols + NUM_BITS - 1) / NUM_BITS;
+    const auto col_bytes = (rows + NUM_BITS - 1) / NUM_BITS;
+    const bool simd = expr::linear_simd(e);
+    workspace::frame frame;
+    const auto bits = frame.take<std::uint8_t>(rows * row_bytes);
+    const auto transposed = frame.take<std::uint8_t>(cols * col_bytes);
+    std::mutex sums_lock;
+    auto sign_rows = [&](std::size_t t){
+        if(!col_means){
+            for(std::size_t i = t * PACK_ROWS; i < std::min(rows, (t + 1) * PACK_ROWS); i++)
+                expr::sign(e, simd, i * cols, (i + 1) * cols, bits + i * row_bytes);
+            return;
+        }
+        // Each task sums its rows on its own and adds them to col_means once
+        workspace::frame task_frame;
+        const auto sums = task_frame.take_zeroed<float>(cols);
+        for(std::size_t i = t * PACK_ROWS; i < std::min(rows, (t + 1) * PACK_ROWS); i++){
+            std::size_t j = 0;
+            expr::sign(e, simd, i * cols, (i + 1) * cols, bits + i * row_bytes, [&](const auto* block, std::size_t m){
+                for(std::size_t q = 0; q < m; q++)
+                    sums[j + q] += scalar::magnitude(block[q]);
+                j += m;
+            });
+        }
+        std::lock_guard<std::mutex> lk(sums_lock);
+        for(std::size_t j = 0; j < cols; j++)
+            col_means[j] += sums[j];
+    };
+    const auto tasks = (rows + PACK_ROWS - 1) / PACK_ROWS;
+    if(mode == ::execution::parallel)
+        thread_pool::global().parallel_for(tasks, sign_rows);
+    else
+        for(std::size_t t = 0; t < tasks; t++)
+            sign_rows(t);
+    if(col_means)
+        for(std::size_t j = 0; j < cols; j++)
+            col_means[j] /= static_cast<float>(rows);
+    transpose_bits(bits, rows, cols, row_bytes, transposed, col_bytes, mode);
+    pack_panels_with(packed, cols, rows, rows_per_panel, mode,
+                     [&](std::size_t i0, std::size_t n, std::uint8_t* out, std::size_t out_bytes){
+        for(std::size_t i = i0; i < i0 + n; i++)
+            std::memcpy(out + (i - i0) * out_bytes, transposed + i * col_bytes, col_bytes);
+    });
+}
+
+/// pack_column_panels_into newly allocated panels
+template <class E>
+inline panel_t pack_column_panels(const E& e, std::size_t rows_per_panel, ::execution mode = ::execution::sequential){
+    panel_t packed(panel_words(e.shape()[1], e.shape()[0], rows_per_panel));
+    pack_column_panels_into(packed.data(), e, rows_per_panel, mode);
+    return packed;
+}
+
+/// Transposes a packed bit matrix held in a bitset_t, rows x cols with each row padded to whole
+/// bytes as sign() packs it. Turning row-packed weights into column-packed ones this way moves
+/// 1/32 of the memory a float transpose would.
+/// \param bits - packed rows x cols matrix
+/// \param rows - number of rows
+/// \param cols - number of columns
+/// \param mode - sequential, or spread across the thread pool
+inline bitset_t transpose_bits(const bitset_t& bits, std::size_t rows, std::size_t cols,
+                               ::execution mode = ::execution::sequential){
+    const auto src_row_bytes = (cols + NUM_BITS - 1) / NUM_BITS;
+    const auto dst_row_bytes = (rows + NUM_BITS - 1) / NUM_BITS;
+    XTENSOR_ASSERT(bits.block_count() >= rows * src_row_bytes)
+    bitset_t res(cols * dst_row_bytes * NUM_BITS);
+    transpose_bits(bits.data(), rows, cols, src_row_bytes, res.data(), dst_row_bytes, mode);
+    return res;
+}
+
+namespace gemm{
+    /// Counts mismatching bits between MR rows of A and NR columns of B over `chunks` 256-bit chunks
+    /// of packed panels, writing MR x NR counts row-major into c
+    using microkernel_t = void (*)(std::size_t chunks, const std::uint64_t* a, const std::uint64_t* b, std::uint64_t* c);
+
+    namespace scalar{
+        /// MR x NR microkernel on 64-bit words with the compiler's popcount
+        inline void microkernel(std::size_t chunks, const std::uint64_t* a, const std::uint64_t* b, std::uint64_t* c)
+        {
+            std::uint64_t accum[MR * NR] = {0};
+            for(std::size_t k = 0; k < chunks; k++, a += MR * CHUNK_WORDS, b += NR * CHUNK_WORDS)
+                for(std::size_t r = 0; r < MR; r++)
+                    for(std::size_t j = 0; j < NR; j++)
+                        for(std::size_t w = 0; w < CHUNK_WORDS; w++)
+                            accum[r * NR + j] += __builtin_popcountll(a[r * CHUNK_WORDS + w] ^ b[j * CHUNK_WORDS + w]);
+            std::copy(accum, accum + MR * NR, c);
+        }
+    } // scalar
+} // gemm
+
+XNOR_TARGET_PUSH(XNOR_SSE42_TARGET)
+namespace gemm{
+    namespace sse42{
+        /// MR x NR microkernel on 64-bit words with popcnt64
+        inline void microkernel(std::size_t chunks, const std::uint64_t* a, const std::uint64_t* b, std::uint64_t* c)
+        {
+            std::uint64_t accum[MR * NR] = {0};
+            for(std::size_t k = 0; k < chunks; k++, a += MR * CHUNK_WORDS, b += NR * CHUNK_WORDS)
+                for(std::size_t r = 0; r < MR; r++)
+                    for(std::size_t j = 0; j < NR; j++)
+                        for(std::size_t w = 0; w < CHUNK_WORDS; w++)
+                            accum[r * NR + j] += _mm_popcnt_u64(a[r * CHUNK_WORDS + w] ^ b[j * CHUNK_WORDS + w]);
+            std::copy(accum, accum + MR * NR, c);
+        }
+    } // sse42
+} // gemm
+XNOR_TARGET_POP
+
+XNOR_TARGET_PUSH(XNOR_AVX2_TARGET)
+namespace gemm{
+    namespace avx2{
+        using popcnt::popcount_lut;
+        using popcnt::hsum4;
+        // Each byte of a chunk popcounts to at most 8, so byte accumulators hold 31 chunks before overflow
+        static constexpr std::size_t BYTE_ACCUM_CHUNKS = popcnt::BYTE_ACCUM_BLOCKS;
+
+        /// MR x NR register-tiled microkernel. XORs one chunk of each of the MR rows of A against the
+        /// same chunk of NR columns of B and keeps all MR * NR popcounts in registers as byte counters,
+        /// which are widened to 64 bits once every BYTE_ACCUM_CHUNKS chunks.
+        /// \param chunks - number of 256-bit chunks along K
+        /// \param a_words - packed A micro-panel, MR chunks per step
+        /// \param b_words - packed B micro-panel, NR chunks per step
+        /// \param c - resulting MR x NR mismatch counts, row-major
+        inline void microkernel(std::size_t chunks, const std::uint64_t* a_words, const std::uint64_t* b_words, std::uint64_t* c)
+        {
+            auto a = (const __m256i*) a_words;
+            auto b = (const __m256i*) b_words;
+            const __m256i lookup = popcnt::lookup_table();
+            const __m256i low_mask = _mm256_set1_epi8(0x0f);
+            const __m256i zero = _mm256_setzero_si256();
+
+            __m256i t00 = zero, t01 = zero, t02 = zero, t03 = zero;
+            __m256i t10 = zero, t11 = zero, t12 = zero, t13 = zero;
+
+            for(std::size_t kb = 0; kb < chunks; kb += BYTE_ACCUM_CHUNKS){
+                const auto limit = std::min(chunks, kb + BYTE_ACCUM_CHUNKS);
+                __m256i c00 = zero, c01 = zero, c02 = zero, c03 = zero;
+                __m256i c10 = zero, c11 = zero, c12 = zero, c13 = zero;
+
+                for(std::size_t k = kb; k < limit; k++, a += MR, b += NR){
+                    const __m256i a0 = _mm256_load_si256(a + 0);
+                    const __m256i a1 = _mm256_load_si256(a + 1);
 
-    for(int i = 0; i < in_shape_a2[0]; i++){
-        // Reserve space for appropriate # of bits
-        bitset_a2[i].resize(in_shape_a2[1]);
-        auto offset = i * in_shape_a2[1];
-        unsafe_sign(a2.data() + offset, bitset_a2[i].data(), in_shape_a2[1]);
+                    __m256i bj = _mm256_load_si256(b + 0);
+                    c00 = _mm256_add_epi8(c00, popcount_lut(a0 ^ bj, lookup, low_mask));
+                    c10 = _mm256_add_epi8(c10, popcount_lut(a1 ^ bj, lookup, low_mask));
+                    bj = _mm256_load_si256(b + 1);
+                    c01 = _mm256_add_epi8(c01, popcount_lut(a0 ^ bj, lookup, low_mask));
+                    c11 = _mm256_add_epi8(c11, popcount_lut(a1 ^ bj, lookup, low_mask));
+                    bj = _mm256_load_si256(b + 2);
+                    c02 = _mm256_add_epi8(c02, popcount_lut(a0 ^ bj, lookup, low_mask));
+                    c12 = _mm256_add_epi8(c12, popcount_lut(a1 ^ bj, lookup, low_mask));
+                    bj = _mm256_load_si256(b + 3);
+                    c03 = _mm256_add_epi8(c03, popcount_lut(a0 ^ bj, lookup, low_mask));
+                    c13 = _mm256_add_epi8(c13, popcount_lut(a1 ^ bj, lookup, low_mask));
+                }
+
+                t00 = _mm256_add_epi64(t00, _mm256_sad_epu8(c00, zero));
+                t01 = _mm256_add_epi64(t01, _mm256_sad_epu8(c01, zero));
+                t02 = _mm256_add_epi64(t02, _mm256_sad_epu8(c02, zero));
+                t03 = _mm256_add_epi64(t03, _mm256_sad_epu8(c03, zero));
+                t10 = _mm256_add_epi64(t10, _mm256_sad_epu8(c10, zero));
+                t11 = _mm256_add_epi64(t11, _mm256_sad_epu8(c11, zero));
+                t12 = _mm256_add_epi64(t12, _mm256_sad_epu8(c12, zero));
+                t13 = _mm256_add_epi64(t13, _mm256_sad_epu8(c13, zero));
+            }
+
+            _mm256_storeu_si256((__m256i*) (c + 0), hsum4(t00, t01, t02, t03));
+            _mm256_storeu_si256((__m256i*) (c + NR), hsum4(t10, t11, t12, t13));
+        }
+    } // avx2
+} // gemm
+XNOR_TARGET_POP
+
+XNOR_TARGET_PUSH(XNOR_AVX512_VPOPCNT_TARGET)
+namespace gemm{
+    namespace avx512{
+        /// MR x NR register-tiled microkernel. XORs one chunk of each of the MR rows of A against the
+        /// same chunk of NR columns of B and keeps all MR * NR popcounts in registers.
+        /// VPOPCNTDQ counts each 64-bit lane in one instruction, so there is no lookup table or byte flush.
+        /// \param chunks - number of 256-bit chunks along K
+        /// \param a_words - packed A micro-panel, MR chunks per step
+        /// \param b_words - packed B micro-panel, NR chunks per step
+        /// \param c - resulting MR x NR mismatch counts, row-major
+        inline void microkernel(std::size_t chunks, const std::uint64_t* a_words, const std::uint64_t* b_words, std::uint64_t* c)
+        {
+            auto a = (const __m256i*) a_words;
+            auto b = (const __m256i*) b_words;
+            const __m256i zero = _mm256_setzero_si256();
+            __m256i c00 = zero, c01 = zero, c02 = zero, c03 = zero;
+            __m256i c10 = zero, c11 = zero, c12 = zero, c13 = zero;
+
+            for(std::size_t k = 0; k < chunks; k++, a += MR, b += NR){
+                const __m256i a0 = _mm256_load_si256(a + 0);
+                const __m256i a1 = _mm256_load_si256(a + 1);
+
+                __m256i bj = _mm256_load_si256(b + 0);
+                c00 = _mm256_add_epi64(c00, _mm256_popcnt_epi64(a0 ^ bj));
+                c10 = _mm256_add_epi64(c10, _mm256_popcnt_epi64(a1 ^ bj));
+                bj = _mm256_load_si256(b + 1);
+                c01 = _mm256_add_epi64(c01, _mm256_popcnt_epi64(a0 ^ bj));
+                c11 = _mm256_add_epi64(c11, _mm256_popcnt_epi64(a1 ^ bj));
+                bj = _mm256_load_si256(b + 2);
+                c02 = _mm256_add_epi64(c02, _mm256_popcnt_epi64(a0 ^ bj));
+                c12 = _mm256_add_epi64(c12, _mm256_popcnt_epi64(a1 ^ bj));
+                bj = _mm256_load_si256(b + 3);
+                c03 = _mm256_add_epi64(c03, _mm256_popcnt_epi64(a0 ^ bj));
+                c13 = _mm256_add_epi64(c13, _mm256_popcnt_epi64(a1 ^ bj));
+            }
+
+            _mm256_storeu_si256((__m256i*) (c + 0), avx2::hsum4(c00, c01, c02, c03));
+            _mm256_storeu_si256((__m256i*) (c + NR), avx2::hsum4(c10, c11, c12, c13));
+        }
+    } // avx512
+} // gemm
+XNOR_TARGET_POP
+
+namespace gemm{
+    inline microkernel_t microkernel_for(::isa level)
+    {
+        switch(level){
+            case ::isa::scalar: return scalar::microkernel;
+            case ::isa::sse42: return sse42::microkernel;
+            case ::isa::avx2: return avx2::microkernel;
+            // The 512-bit level only beats the LUT microkernel with a hardware vector popcount
+            case ::isa::avx512: return has_vpopcntdq() ? avx512::microkernel : avx2::microkernel;
+        }
+        return scalar::microkernel;
+    }
+
+    /// Microkernel for the fastest instruction set of this CPU, selected once on first use
+    inline microkernel_t dispatch()
+    {
+        static const microkernel_t selected = microkernel_for(detect_isa());
+        return selected;
+    }
+
+    /// Epilogue that stores the dot products as they are, in whatever type the output has
+    struct identity
+    {
+        template <class R>
+        R operator()(R value, std::size_t, std::size_t) const { return value; }
+    };
+
+    /// Throws if a dot product over col_size bits could overflow the output type R. Every partial
+    /// and final sum lies in [-col_size, col_size], so integer outputs are exact within that;
+    /// float is exact up to 2^24.
+    template <class R>
+    inline void check_depth(std::size_t col_size)
+    {
+        if constexpr(std::is_integral<R>::value){
+            if(col_size > static_cast<std::size_t>(std::numeric_limits<R>::max()))
+                throw std::runtime_error("xnorgemm: dot products over " + std::to_string(col_size)
+                                         + " bits overflow the output type");
+        }
     }
 
-//    for(auto& x : bitset_a1){
-//        for(auto y : x){
-//            std::cout << y << " ";
-//        }
-//        std::cout << std::endl;
-//    }
-//    std::cout << "\n\n";
-//    for(auto& x : bitset_a2){
-//        for(auto y : x){
-//            std::cout << y << " ";
-//        }
-//        std::cout << std::endl;
-//    }
-
-    // WARNING: Extremely naive kernel - no blocking, no unrolling, only transpose
-    auto col_size = in_shape_a1[1];
-
-    // This subroutine takes roughly 80%-90% of the runtime
-    auto rows = in_shape_a1[0];
-    auto cols = in_shape_a2[0];
-//    for(int ii = 0; ii < rows; ii += block_size) {
-//        for (int jj = 0; jj < cols; jj += block_size) {
-//            for (int i = 0; i < std::min(block_size, rows - ii); i++) {
-//                for (int j = 0; j < std::min(block_size, cols - jj); j++) {
-//                    int _i = i + ii;
-//                    int _j = j + jj;
-//                    bitset_t temp(col_size);
-//                    xnor(bitset_a1[_i].data(), bitset_a2[_j].data(), temp.data(), col_size);
-//                    res(_i, _j) = sum(temp.data(), col_size);
-//                }
-//            }
-//        }
-//    }
-    for (int i = 0; i < rows; i++) {
-        for (int j = 0; j < cols; j++) {
-            bitset_t temp(col_size);
-            xnor(bitset_a1[i].data(), bitset_a2[j].data(), temp.data(), col_size);
-            res(i, j) = sum(temp.data(), col_size);
+    /// Runs the microkernel over one MC x NC block of the output for one KC slice of the panels.
+    /// The first K slice assigns the output, later slices accumulate into it, and the last one
+    /// passes every finished element through the epilogue before it is stored.
+    /// \param pa - packed A panels
+    /// \param pb - packed B panels
+    /// \param chunks - number of 256-bit chunks in a full packed row
+    /// \param res - row-major output of float, std::int32_t or std::int16_t
+    /// \param ldc - distance in elements between output rows
+    /// \param epilogue - epilogue(value, i, j) gives the element stored at (i, j)
+    template <class R, class Epilogue>
+    inline void macrokernel(const std::uint64_t* pa, const std::uint64_t* pb, std::size_t chunks,
+                            std::size_t ic, std::size_t mc, std::size_t jc, std::size_t nc,
+                            std::size_t pc, std::size_t kc, std::size_t kc_bits,
+                            R* res, std::size_t ldc, const Epilogue& epilogue)
+    {
+        const bool last = pc + kc == chunks;
+        std::uint64_t counts[MR * NR];
+        const auto microkernel = dispatch();
+        for(std::size_t jr = jc; jr < jc + nc; jr += NR){
+            const auto b = pb + ((jr / NR) * NR * chunks + pc * NR) * CHUNK_WORDS;
+            const auto n = std::min(NR, jc + nc - jr);
+            for(std::size_t ir = ic; ir < ic + mc; ir += MR){
+                const auto a = pa + ((ir / MR) * MR * chunks + pc * MR) * CHUNK_WORDS;
+                const auto m = std::min(MR, ic + mc - ir);
+                microkernel(kc, a, b, counts);
+                for(std::size_t r = 0; r < m; r++){
+                    auto out = res + (ir + r) * ldc + jr;
+                    for(std::size_t j = 0; j < n; j++){
+                        // #matches - #mismatches = kc_bits - 2 * #mismatches, stored straight in the output type
+                        auto val = static_cast<R>(static_cast<long long>(kc_bits) - 2 * static_cast<long long>(counts[r * NR + j]));
+                        if(pc != 0)
+                            val = static_cast<R>(val + out[j]);
+                        out[j] = last ? static_cast<R>(epilogue(val, ir + r, jr + j)) : val;
+                    }
+                }
+            }
+        }
+    }
+
+    /// Runs the blocked loops over packed panels, writing op(A) . op(B) to a row-major output.
+    /// \param packed_a1 - MR-row panels of op(A)
+    /// \param packed_a2 - NR-row panels of the columns of op(B)
+    /// \param res - output of float, std::int32_t or std::int16_t, overwritten
+    /// \param ldc - distance in elements between output rows
+    /// \param epilogue - applied to each element as its tile is written back, see macrokernel
+    template <class R, class Epilogue = identity>
+    inline void run(const std::uint64_t* packed_a1, const std::uint64_t* packed_a2, R* res, std::size_t ldc,
+                    std::size_t rows, std::size_t cols, std::size_t col_size, ::execution mode,
+                    const Epilogue& epilogue = {})
+    {
+        check_depth<R>(col_size);
+        const auto chunks = (col_size + CHUNK_BITS - 1) / CHUNK_BITS;
+
+        // This subroutine used to take roughly 80%-90% of the runtime
+        static constexpr auto KC_CHUNKS = KC / CHUNK_BITS;
+        if(mode == ::execution::parallel){
+            // Tasks are ordered NC block, then MC block, then NT tile, and dealt round-robin,
+            // so all threads sweep the same B panel and threads on one MC block share its A panel
+            const auto row_blocks = (rows + MC - 1) / MC;
+            const auto tiles_per_block = (std::min(NC, cols) + NT - 1) / NT;
+            const auto col_blocks = (cols + NC - 1) / NC;
+            thread_pool::global().parallel_for(col_blocks * row_blocks * tiles_per_block, [&](std::size_t t){
+                const auto jc = (t / (row_blocks * tiles_per_block)) * NC;
+                const auto ic = ((t / tiles_per_block) % row_blocks) * MC;
+                const auto jt = jc + (t % tiles_per_block) * NT;
+                if(jt >= std::min(cols, jc + NC))
+                    return;
+                const auto nt = std::min(NT, cols - jt);
+                const auto mc = std::min(MC, rows - ic);
+                for(std::size_t pc = 0; pc < chunks; pc += KC_CHUNKS){
+                    const auto kc = std::min(KC_CHUNKS, chunks - pc);
+                    const auto kc_bits = std::min(KC, col_size - pc * CHUNK_BITS);
+                    macrokernel(packed_a1, packed_a2, chunks, ic, mc, jt, nt, pc, kc, kc_bits, res, ldc, epilogue);
+                }
+            });
+            return;
+        }
+
+        for(std::size_t jc = 0; jc < cols; jc += NC){
+            const auto nc = std::min(NC, cols - jc);
+            for(std::size_t pc = 0; pc < chunks; pc += KC_CHUNKS){
+                const auto kc = std::min(KC_CHUNKS, chunks - pc);
+                const auto kc_bits = std::min(KC, col_size - pc * CHUNK_BITS);
+                for(std::size_t ic = 0; ic < rows; ic += MC){
+                    const auto mc = std::min(MC, rows - ic);
+                    macrokernel(packed_a1, packed_a2, chunks, ic, mc, jc, nc, pc, kc, kc_bits, res, ldc, epilogue);
+                }
+            }
         }
     }
 
+    /// Computes C = op(A) . op(B) into a caller-owned row-major buffer, with both operands read
+    /// through element strides. op(A) is rows x col_size, op(B) is col_size x cols.
+    /// \param a - first element of op(A)
+    /// \param a_row_stride - distance in elements between rows of op(A)
+    /// \param a_col_stride - distance in elements between columns of op(A)
+    /// \param b - first element of op(B)
+    /// \param b_row_stride - distance in elements between rows of op(B)
+    /// \param b_col_stride - distance in elements between columns of op(B)
+    /// \param res - output, overwritten
+    /// \param ldc - distance in elements between output rows
+    template <class T, class U, class R>
+    inline void compute(const T* a, std::ptrdiff_t a_row_stride, std::ptrdiff_t a_col_stride,
+                        const U* b, std::ptrdiff_t b_row_stride, std::ptrdiff_t b_col_stride,
+                        R* res, std::size_t ldc,
+                        std::size_t rows, std::size_t cols, std::size_t col_size, ::execution mode)
+    {
+        if(col_size == 0){
+            for(std::size_t i = 0; i < rows; i++)
+                std::fill(res + i * ldc, res + i * ldc + cols, R(0));
+            return;
+        }
+
+        // Pack op(A) into MR-row panels and the columns of op(B) into NR-column panels
+        workspace::frame frame;
+        const auto packed_a1 = frame.take<std::uint64_t>(panel_words(rows, col_size, MR));
+        const auto packed_a2 = frame.take<std::uint64_t>(panel_words(cols, col_size, NR));
+        pack_panels_into(packed_a1, a, rows, col_size, a_row_stride, a_col_stride, MR, mode);
+        pack_panels_into(packed_a2, b, cols, col_size, b_col_stride, b_row_stride, NR, mode);
+        run(packed_a1, packed_a2, res, ldc, rows, cols, col_size, mode);
+    }
+
+    /// Computes epilogue(a . b) for two 2-D xtensor expressions into a caller-owned row-major buffer.
+    /// Both are evaluated straight into packed panels, the columns of b through a packed-bit transpose.
+    /// \param a - rows x col_size expression
+    /// \param b - col_size x cols expression
+    /// \param res - output, overwritten
+    /// \param ldc - distance in elements between output rows
+    /// \param epilogue - applied to each element as its tile is written back, see macrokernel
+    template <class E1, class E2, class R, class Epilogue = identity>
+    inline void compute_expressions(const E1& a, const E2& b, R* res, std::size_t ldc, ::execution mode,
+                                    const Epilogue& epilogue = {})
+    {
+        XTENSOR_ASSERT(a.dimension() == 2 && b.dimension() == 2)
+        const std::size_t rows = a.shape()[0], col_size = a.shape()[1], cols = b.shape()[1];
+        XTENSOR_ASSERT(b.shape()[0] == col_size)
+        if(col_size == 0){
+            for(std::size_t i = 0; i < rows; i++)
+                for(std::size_t j = 0; j < cols; j++)
+                    res[i * ldc + j] = static_cast<R>(epilogue(R(0), i, j));
+            return;
+        }
+        workspace::frame frame;
+        const auto packed_a1 = frame.take<std::uint64_t>(panel_words(rows, col_size, MR));
+        const auto packed_a2 = frame.take<std::uint64_t>(panel_words(cols, col_size, NR));
+        pack_panels_into(packed_a1, a, rows, col_size, MR, mode);
+        pack_column_panels_into(packed_a2, b, NR, mode);
+        run(packed_a1, packed_a2, res, ldc, rows, cols, col_size, mode, epilogue);
+    }
+
+    /// Workspace bytes a gemm of this size takes on the calling thread, an upper bound for every
+    /// entry point that packs both operands. Reserving it, with workspace::reserve_all for the
+    /// threads of a parallel gemm, means the gemm allocates nothing but its result.
+    /// \param rows - rows of op(A) and of the output
+    /// \param cols - columns of op(B) and of the output
+    /// \param col_size - the shared dimension, in bits
+    inline std::size_t workspace_bytes(std::size_t rows, std::size_t cols, std::size_t col_size)
+    {
+        const auto chunks = (col_size + CHUNK_BITS - 1) / CHUNK_BITS;
+        const auto panels = (panel_words(rows, col_size, MR) + panel_words(cols, col_size, NR)) * sizeof(std::uint64_t);
+        // pack_column_panels_into stages op(B) packed by rows and then transposed
+        const auto staged = col_size * ((cols + NUM_BITS - 1) / NUM_BITS) + cols * ((col_size + NUM_BITS - 1) / NUM_BITS);
+        const auto scratch = PACK_ROWS * chunks * CHUNK_WORDS * sizeof(std::uint64_t);
+        // Row and column scaling factors of compute_scaled, and a task's column sums while packing op(B)
+        const auto scales = (rows + 2 * cols) * sizeof(float);
+        // Every buffer may be padded up to the alignment
+        return panels + staged + scratch + scales + 8 * WORKSPACE_ALIGN;
+    }
+} // gemm
+
+/// Low-level xnorgemm on caller-owned buffers, BLAS style: C = op(A) . op(B) with row-major
+/// operands and leading dimensions. Nothing is allocated for the inputs or the output, and no
+/// alignment is required.
+/// \param trans_a - whether op(A) is A transposed
+/// \param trans_b - whether op(B) is B transposed
+/// \param m - rows of op(A) and C
+/// \param n - columns of op(B) and C
+/// \param k - columns of op(A), rows of op(B)
+/// \param a - A, m x k (k x m if transposed)
+/// \param lda - distance in elements between rows of A
+/// \param b - B, k x n (n x k if transposed)
+/// \param ldb - distance in elements between rows of B
+/// \param c - C, m x n, overwritten. float, or std::int32_t / std::int16_t for exact integers in
+///            half the bandwidth with int16, which holds any k below 32768
+/// \param ldc - distance in elements between rows of C
+/// \param mode - sequential, or spread packing and output tiles across the thread pool
+template <class T, class U, class R>
+inline void xnorgemm(::transposition trans_a, ::transposition trans_b,
+                     std::size_t m, std::size_t n, std::size_t k,
+                     const T* a, std::size_t lda, const U* b, std::size_t ldb,
+                     R* c, std::size_t ldc,
+                     ::execution mode = ::execution::sequential){
+    const std::ptrdiff_t sa = lda, sb = ldb;
+    const bool ta = trans_a == ::transposition::transposed;
+    const bool tb = trans_b == ::transposition::transposed;
+    gemm::compute(a, ta ? 1 : sa, ta ? sa : 1, b, tb ? 1 : sb, tb ? sb : 1, c, ldc, m, n, k, mode);
+}
+
+/// Performs an xnorgemm, op(a1) . op(a2), on the given xt::xarrays. The operands can be float, double,
+/// int8, uint8, bool, float16 or bfloat16 and need not have the same type; they are packed straight from it.
+/// Either operand can be row- or column-major, and trans_a / trans_b transpose it BLAS-style.
+/// Both are handled by reading through the strides, so no transposed copy is ever made.
+/// \param a1 - xarray to compute gemm
+/// \param a2 - xarray to compute gemm
+/// \param mode - sequential, or spread packing and output tiles across the thread pool
+/// \param trans_a - whether op(a1) is a1 transposed
+/// \param trans_b - whether op(a2) is a2 transposed
+/// \tparam R - element type of the result: float, or std::int32_t / std::int16_t, see gemm::check_depth
+template <class R = float, class T, class U, xt::layout_type LA = XTENSOR_DEFAULT_LAYOUT, xt::layout_type LB = XTENSOR_DEFAULT_LAYOUT>
+inline xt::xarray<R> xnorgemm(const xt::xarray<T, LA>& a1,
+const xt::xarray<U, LB>& a2,
+::execution mode = ::execution::sequential,
+::transposition trans_a = ::transposition::none,
+::transposition trans_b = ::transposition::none
+){
+    // Check size
+    XTENSOR_ASSERT(a1.dimension() == 2 && a2.dimension() == 2)
+
+    const bool ta = trans_a == ::transposition::transposed;
+    const bool tb = trans_b == ::transposition::transposed;
+    const std::size_t rows = a1.shape()[ta ? 1 : 0];
+    const std::size_t col_size = a1.shape()[ta ? 0 : 1];
+    const std::size_t cols = a2.shape()[tb ? 0 : 1];
+    XTENSOR_ASSERT(a2.shape()[tb ? 1 : 0] == col_size)
+
+    xt::xarray<R> res;
+    res.resize({rows, cols});
+    gemm::compute(a1.data(), a1.strides()[ta ? 1 : 0], a1.strides()[ta ? 0 : 1],
+                  a2.data(), a2.strides()[tb ? 1 : 0], a2.strides()[tb ? 0 : 1],
+                  res.data(), cols, rows, cols, col_size, mode);
+    return res;
+}
+
+/// Performs an xnorgemm on any two 2-D xtensor expressions, e.g. `x - running_mean` or a view into a
+/// batch, of any value type sign() accepts or any arithmetic type. Both are evaluated straight into
+/// packed panels; the columns of e2 are formed by a packed-bit transpose, so no float tensor is made.
+/// \param e1 - expression to compute gemm
+/// \param e2 - expression to compute gemm
+/// \param mode - sequential, or spread packing and output tiles across the thread pool
+/// \tparam R - element type of the result: float, or std::int32_t / std::int16_t, see gemm::check_depth
+template <class R = float, class E1, class E2>
+inline xt::xarray<R> xnorgemm(const xt::xexpression<E1>& e1, const xt::xexpression<E2>& e2,
+                              ::execution mode = ::execution::sequential){
+    const auto& a = e1.derived_cast();
+    const auto& b = e2.derived_cast();
+    XTENSOR_ASSERT(a.dimension() == 2 && b.dimension() == 2)
+    xt::xarray<R> res;
+    res.resize({a.shape()[0], b.shape()[1]});
+    gemm::compute_expressions(a, b, res.data(), res.shape()[1], mode);
     return res;
 }
@@ -0,0 +1,267 @@
+#pragma once
+#include <array>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+#include <xtensor/xarray.hpp>
+#include <xtensor/xexception.hpp>
+#include <xtensor/xexpression.hpp>
+#include <xtl/xclosure.hpp>
+
+#include "xnorgemm.hpp"
+#include "xnorpacked.hpp"
+
+// A lazy xnorgemm. `lazy_xnorgemm(a, b) * alpha + bias` builds no tensor; the elementwise work is
+// composed into an epilogue that the gemm applies to every element as its tile is written back,
+// so the output is written once instead of once per operation.
+// Like an xt::xfunction the node keeps its operands by reference when they are lvalues and by
+// value when they are temporaries, and packs them only when it is assigned.
+
+namespace lazy{
+    /// A float operand broadcast against the rows x cols result: a scalar, a row of cols elements,
+    /// a (rows, 1) column or a full (rows, cols) matrix. Lvalue float tensors are read in place
+    /// through their strides, anything else is evaluated once into a float array owned by the operand.
+    class operand
+    {
+    public:
+        template <class E>
+        operand(E&& e, std::size_t rows, std::size_t cols)
+        {
+            using expression_type = std::decay_t<E>;
+            if constexpr(std::is_lvalue_reference<E>::value && xt::has_data_interface<expression_type>::value
+                         && std::is_same<typename expression_type::value_type, float>::value){
+                bind(e, rows, cols);
+            }
+            else{
+                auto values = std::make_shared<xt::xarray<float>>(std::forward<E>(e));
+                bind(*values, rows, cols);
+                m_values = std::move(values);
+            }
+        }
+
+        float operator()(std::size_t i, std::size_t j) const
+        {
+            return m_data[static_cast<std::ptrdiff_t>(i) * m_row_stride + static_cast<std::ptrdiff_t>(j) * m_col_stride];
+        }
+
+    private:
+        template <class E>
+        void bind(const E& e, std::size_t rows, std::size_t cols)
+        {
+            const auto& shape = e.shape();
+            const auto& strides = e.strides();
+            const auto dim = e.dimension();
+            // Broadcasting aligns trailing axes; a stride of zero repeats the element along an axis
+            auto stride = [&](std::size_t axis, std::size_t extent) -> std::ptrdiff_t {
+                if(shape[axis] == extent)
+                    return extent == 1 ? 0 : strides[axis];
+                if(shape[axis] == 1)
+                    return 0;
+                xt::throw_broadcast_error(shape, std::array<std::size_t, 2>{rows, cols});
+            };
+            if(dim > 2)
+                xt::throw_broadcast_error(shape, std::array<std::size_t, 2>{rows, cols});
+            m_col_stride = dim >= 1 ? stride(dim - 1, cols) : 0;
+            m_row_stride = dim == 2 ? stride(0, rows) : 0;
+            m_data = e.data() + e.data_offset();
+        }
+
+        std::shared_ptr<const xt::xarray<float>> m_values;
+        const float* m_data = nullptr;
+        std::ptrdiff_t m_row_stride = 0;
+        std::ptrdiff_t m_col_stride = 0;
+    };
+} // lazy
+
+/// Lazy xnorgemm node: epilogue(op(a) . op(b)) evaluated on assignment.
+/// \tparam CT1 - closure type of the left operand, a const reference or a value
+/// \tparam CT2 - closure type of the right operand
+/// \tparam F - epilogue(value, i, j), see gemm::macrokernel
+template <class CT1, class CT2, class F>
+class xnorgemm_expression
+{
+public:
+    using value_type = float;
+    using shape_type = std::array<std::size_t, 2>;
+
+    template <class E1, class E2>
+    xnorgemm_expression(E1&& a, E2&& b, F epilogue, ::execution mode)
+        : m_a(std::forward<E1>(a)), m_b(std::forward<E2>(b)), m_epilogue(std::move(epilogue)), m_mode(mode)
+    {
+        XTENSOR_ASSERT(m_a.dimension() == 2 && m_b.dimension() == 2)
+        XTENSOR_ASSERT(m_b.shape()[0] == m_a.shape()[1])
+    }
+
+    std::size_t dimension() const { return 2; }
+    shape_type shape() const { return {m_a.shape()[0], m_b.shape()[1]}; }
+
+    /// The node with g(value, i, j) applied to what the current epilogue returns
+    template <class G>
+    auto compose(G g) const&
+    {
+        return xnorgemm_expression(*this).compose(std::move(g));
+    }
+
+    template <class G>
+    auto compose(G g) &&
+    {
+        auto epilogue = [f = std::move(m_epilogue), g = std::move(g)](float value, std::size_t i, std::size_t j){
+            return g(f(value, i, j), i, j);
+        };
+        return xnorgemm_expression<CT1, CT2, decltype(epilogue)>(std::forward<CT1>(m_a), std::forward<CT2>(m_b),
+                                                                  std::move(epilogue), m_mode);
+    }
+
+    /// The node with the unary elementwise function g, e.g. an activation, applied to every element
+    template <class G>
+    auto map(G g) const&
+    {
+        return compose([g = std::move(g)](float value, std::size_t, std::size_t){ return g(value); });
+    }
+
+    template <class G>
+    auto map(G g) &&
+    {
+        return std::move(*this).compose([g = std::move(g)](float value, std::size_t, std::size_t){ return g(value); });
+    }
+
+    /// Runs the gemm and its epilogue into a caller-owned row-major buffer, writing every element once
+    /// \param res - rows x cols output, overwritten
+    /// \param ldc - distance in elements between output rows
+    void assign_to(float* res, std::size_t ldc) const
+    {
+        gemm::compute_operands(m_a, m_b, res, ldc, m_mode, m_epilogue);
+    }
+
+    xt::xarray<float> evaluate() const
+    {
+        xt::xarray<float> res;
+        res.resize({m_a.shape()[0], m_b.shape()[1]});
+        assign_to(res.data(), res.shape()[1]);
+        return res;
+    }
+
+    operator xt::xarray<float>() const { return evaluate(); }
+
+private:
+    CT1 m_a;
+    CT2 m_b;
+    F m_epilogue;
+    ::execution m_mode;
+};
+
+namespace lazy{
+    /// What lazy_xnorgemm multiplies: 2-D expressions and prepacked matrices
+    template <class T>
+    using is_gemm_operand = gemm::is_operand<T>;
+} // lazy
+
+/// op(a) . op(b) as a lazy node, see xnorgemm_expression. Nothing is packed or computed until the
+/// node is assigned, and elementwise operators on it are fused into the gemm's write-back.
+/// \param e1 - 2-D expression or packed_binary_matrix, kept by reference if it is an lvalue
+/// \param e2 - 2-D expression or packed_binary_matrix, kept by reference if it is an lvalue
+/// \param mode - sequential, or spread packing and output tiles across the thread pool
+template <class E1, class E2,
+          std::enable_if_t<lazy::is_gemm_operand<E1>::value && lazy::is_gemm_operand<E2>::value, int> = 0>
+inline auto lazy_xnorgemm(E1&& e1, E2&& e2, ::execution mode = ::execution::sequential)
+{
+    using node = xnorgemm_expression<xtl::const_closure_type_t<E1>, xtl::const_closure_type_t<E2>, gemm::identity>;
+    return node(std::forward<E1>(e1), std::forward<E2>(e2), gemm::identity{}, mode);
+}
+
+namespace lazy{
+    /// What an xnorgemm_expression can be combined with elementwise: scalars and broadcastable expressions
+    template <class T>
+    using is_operand = std::disjunction<std::is_arithmetic<std::decay_t<T>>, xt::is_xexpression<std::decay_t<T>>>;
+
+    template <class T, std::enable_if_t<std::is_arithmetic<std::decay_t<T>>::value, int> = 0>
+    inline auto elements(T scalar, std::size_t, std::size_t)
+    {
+        return [s = static_cast<float>(scalar)](std::size_t, std::size_t){ return s; };
+    }
+
+    template <class E, std::enable_if_t<xt::is_xexpression<std::decay_t<E>>::value, int> = 0>
+    inline operand elements(E&& e, std::size_t rows, std::size_t cols)
+    {
+        return operand(std::forward<E>(e), rows, cols);
+    }
+
+    /// node op rhs, fused into the node's epilogue
+    template <class Op, class N, class R>
+    inline auto right(N node, R&& rhs)
+    {
+        const auto shape = node.shape();
+        return std::move(node).compose([x = elements(std::forward<R>(rhs), shape[0], shape[1])](float value, std::size_t i, std::size_t j){
+            return Op{}(value, x(i, j));
+        });
+    }
+
+    /// lhs op node, fused into the node's epilogue
+    template <class Op, class L, class N>
+    inline auto left(L&& lhs, N node)
+    {
+        const auto shape = node.shape();
+        return std::move(node).compose([x = elements(std::forward<L>(lhs), shape[0], shape[1])](float value, std::size_t i, std::size_t j){
+            return Op{}(x(i, j), value);
+        });
+    }
+} // lazy
+
+// The node is taken by value so these overloads are more specialized than xtensor's
+// operators, which would otherwise wrap it as a scalar.
+
+template <class CT1, class CT2, class F, class R, std::enable_if_t<lazy::is_operand<R>::value, int> = 0>
+inline auto operator+(xnorgemm_expression<CT1, CT2, F> node, R&& rhs)
+{
+    return lazy::right<std::plus<float>>(std::move(node), std::forward<R>(rhs));
+}
+
+template <class L, class CT1, class CT2, class F, std::enable_if_t<lazy::is_operand<L>::value, int> = 0>
+inline auto operator+(L&& lhs, xnorgemm_expression<CT1, CT2, F> node)
+{
+    return lazy::left<std::plus<float>>(std::forward<L>(lhs), std::move(node));
+}
+
+template <class CT1, class CT2, class F, class R, std::enable_if_t<lazy::is_operand<R>::value, int> = 0>
+inline auto operator-(xnorgemm_expression<CT1, CT2, F> node, R&& rhs)
+{
+    return lazy::right<std::minus<float>>(std::move(node), std::forward<R>(rhs));
+}
+
+template <class L, class CT1, class CT2, class F, std::enable_if_t<lazy::is_operand<L>::value, int> = 0>
+inline auto operator-(L&& lhs, xnorgemm_expression<CT1, CT2, F> node)
+{
+    return lazy::left<std::minus<float>>(std::forward<L>(lhs), std::move(node));
+}
+
+template <class CT1, class CT2, class F, class R, std::enable_if_t<lazy::is_operand<R>::value, int> = 0>
+inline auto operator*(xnorgemm_expression<CT1, CT2, F> node, R&& rhs)
+{
+    return lazy::right<std::multiplies<float>>(std::move(node), std::forward<R>(rhs));
+}
+
+template <class L, class CT1, class CT2, class F, std::enable_if_t<lazy::is_operand<L>::value, int> = 0>
+inline auto operator*(L&& lhs, xnorgemm_expression<CT1, CT2, F> node)
+{
+    return lazy::left<std::multiplies<float>>(std::forward<L>(lhs), std::move(node));
+}
+
+template <class CT1, class CT2, class F, class R, std::enable_if_t<lazy::is_operand<R>::value, int> = 0>
+inline auto operator/(xnorgemm_expression<CT1, CT2, F> node, R&& rhs)
+{
+    return lazy::right<std::divides<float>>(std::move(node), std::forward<R>(rhs));
+}
+
+template <class L, class CT1, class CT2, class F, std::enable_if_t<lazy::is_operand<L>::value, int> = 0>
+inline auto operator/(L&& lhs, xnorgemm_expression<CT1, CT2, F> node)
+{
+    return lazy::left<std::divides<float>>(std::forward<L>(lhs), std::move(node));
+}
+
+template <class CT1, class CT2, class F>
+inline auto operator-(xnorgemm_expression<CT1, CT2, F> node)
+{
+    return std::move(node).map(std::negate<float>());
+}
@@ -0,0 +1,473 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#include <xtensor/xarray.hpp>
+#include <xtensor/xeval.hpp>
+
+#include "xnorpacked.hpp"
+#include "xnorscale.hpp"
+
+// Binary-weight layers (BWN): the weights are signs, the activations keep their precision. The first
+// and last layers of a binary net are run this way. Each packed weight bit picks whether its
+// activation is added or subtracted, so the product needs no multiplies and the weights stay at
+// 1 bit. The bits flip the sign of the activations with an XOR:
+// - int8: x ^ 0xFF = -x - 1, summed in 16 bits with vpmaddubsw and corrected by the number of -1
+//   weights per column, which is exact even for x = -128
+// - float: the bit is moved into the sign bit and XORed in, which negates exactly
+
+namespace gemm{
+    /// Rows of activations the mixed-precision microkernel multiplies at once, each against NR weight columns
+    static constexpr std::size_t MX = 2;
+
+    /// What the sums of a binary-weight product over activations of type T are kept in
+    template <class T>
+    struct bwn_accumulator
+    {
+        static_assert(std::is_same<T, std::int8_t>::value || std::is_same<T, float>::value,
+                      "bwngemm: activations must be std::int8_t or float");
+    };
+
+    template <>
+    struct bwn_accumulator<std::int8_t>
+    {
+        using type = std::int32_t;
+    };
+
+    template <>
+    struct bwn_accumulator<float>
+    {
+        using type = float;
+    };
+
+    template <class T>
+    using bwn_accumulator_t = typename bwn_accumulator<T>::type;
+
+    /// Sums MX rows of activations, each XORed with the sign mask of NR weight columns, over `chunks`
+    /// 256-bit chunks of a packed B micro-panel, writing MX x NR sums row-major into c.
+    /// For float that is x . w; for int8 it is x . w less the number of -1 weights.
+    template <class T>
+    using bwn_microkernel_t = void (*)(std::size_t chunks, const T* x0, const T* x1, const std::uint64_t* b,
+                                       bwn_accumulator_t<T>* c);
+
+    namespace scalar{
+        /// MX x NR binary-weight microkernel, one element at a time
+        template <class T>
+        inline void bwn_microkernel(std::size_t chunks, const T* x0, const T* x1, const std::uint64_t* b,
+                                    bwn_accumulator_t<T>* c)
+        {
+            using A = bwn_accumulator_t<T>;
+            A accum[MX * NR] = {};
+            const T* x[MX] = {x0, x1};
+            for(std::size_t k = 0; k < chunks; k++, b += NR * CHUNK_WORDS)
+                for(std::size_t r = 0; r < MX; r++)
+                    for(std::size_t j = 0; j < NR; j++)
+                        for(std::size_t e = 0; e < CHUNK_BITS; e++){
+                            const auto v = x[r][k * CHUNK_BITS + e];
+                            const bool negative = (b[j * CHUNK_WORDS + e / 64] >> (e % 64)) & 1;
+                            if constexpr(std::is_integral<T>::value)
+                                accum[r * NR + j] += negative ? ~v : v;
+                            else
+                                accum[r * NR + j] += negative ? -v : v;
+                        }
+            std::copy(accum, accum + MX * NR, c);
+        }
+    } // scalar
+} // gemm
+
+XNOR_TARGET_PUSH(XNOR_AVX2_TARGET)
+namespace gemm{
+    namespace avx2{
+        // A vpmaddubsw pair sums to at most 256 in magnitude, so 16-bit sums hold 64 vectors, 8 chunks
+        static constexpr std::size_t INT16_ACCUM_CHUNKS = 8;
+
+        /// 32 bits of a weight column spread to 32 bytes, 0xFF where the bit is set.
+        /// spread copies byte q of the bits to bytes 8q..8q+7, select keeps bit i % 8 in byte i.
+        inline __m256i byte_mask(std::uint32_t bits, __m256i spread, __m256i select)
+        {
+            const __m256i bytes = _mm256_shuffle_epi8(_mm256_set1_epi32(static_cast<int>(bits)), spread);
+            return _mm256_cmpeq_epi8(_mm256_and_si256(bytes, select), select);
+        }
+
+        /// Bits 8u..8u+7 of 32 bits of a weight column, broadcast to every lane, moved into the sign bits of 8 floats
+        inline __m256 sign_mask(__m256i bits, __m256i shifts, __m256i sign)
+        {
+            return _mm256_castsi256_ps(_mm256_and_si256(_mm256_sllv_epi32(bits, shifts), sign));
+        }
+
+        inline std::int32_t reduce(__m256i v)
+        {
+            __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+            s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+            s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+            return _mm_cvtsi128_si32(s);
+        }
+
+        inline float reduce(__m256 v)
+        {
+            __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+            s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+            s = _mm_add_ss(s, _mm_movehdup_ps(s));
+            return _mm_cvtss_f32(s);
+        }
+
+        /// MX x NR int8 microkernel. Each 32-byte vector of both rows is XORed with the byte mask of
+        /// each of the NR columns and summed by vpmaddubsw against ones into 16-bit pairs, which are
+        /// widened to 32 bits once every INT16_ACCUM_CHUNKS chunks.
+        /// \param chunks - number of 256-bit chunks along K
+        /// \param x0 - first row of activations, CHUNK_BITS values per chunk
+        /// \param x1 - second row, or x0 again when there is only one
+        /// \param b - packed B micro-panel, NR chunks per step
+        /// \param c - resulting MX x NR sums of x ^ mask, row-major
+        inline void bwn_microkernel(std::size_t chunks, const std::int8_t* x0, const std::int8_t* x1,
+                                    const std::uint64_t* b, std::int32_t* c)
+        {
+            static constexpr std::size_t VECTORS = CHUNK_BITS / 32;
+            const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                                    2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+            const __m256i select = _mm256_set1_epi64x(0x8040201008040201LL);
+            const __m256i ones8 = _mm256_set1_epi8(1);
+            const __m256i ones16 = _mm256_set1_epi16(1);
+            const __m256i zero = _mm256_setzero_si256();
+
+            __m256i t00 = zero, t01 = zero, t02 = zero, t03 = zero;
+            __m256i t10 = zero, t11 = zero, t12 = zero, t13 = zero;
+
+            for(std::size_t kb = 0; kb < chunks; kb += INT16_ACCUM_CHUNKS){
+                const auto limit = std::min(chunks, kb + INT16_ACCUM_CHUNKS);
+                __m256i s00 = zero, s01 = zero, s02 = zero, s03 = zero;
+                __m256i s10 = zero, s11 = zero, s12 = zero, s13 = zero;
+
+                for(std::size_t k = kb; k < limit; k++, x0 += CHUNK_BITS, x1 += CHUNK_BITS, b += NR * CHUNK_WORDS){
+                    for(std::size_t q = 0; q < VECTORS; q++){
+                        const __m256i a0 = _mm256_loadu_si256((const __m256i*) (x0 + 32 * q));
+                        const __m256i a1 = _mm256_loadu_si256((const __m256i*) (x1 + 32 * q));
+                        const auto shift = 32 * (q % 2);
+
+                        __m256i m = byte_mask(static_cast<std::uint32_t>(b[0 * CHUNK_WORDS + q / 2] >> shift), spread, select);
+                        s00 = _mm256_add_epi16(s00, _mm256_maddubs_epi16(ones8, _mm256_xor_si256(a0, m)));
+                        s10 = _mm256_add_epi16(s10, _mm256_maddubs_epi16(ones8, _mm256_xor_si256(a1, m)));
+                        m = byte_mask(static_cast<std::uint32_t>(b[1 * CHUNK_WORDS + q / 2] >> shift), spread, select);
+                        s01 = _mm256_add_epi16(s01, _mm256_maddubs_epi16(ones8, _mm256_xor_si256(a0, m)));
+                        s11 = _mm256_add_epi16(s11, _mm256_maddubs_epi16(ones8, _mm256_xor_si256(a1, m)));
+                        m = byte_mask(static_cast<std::uint32_t>(b[2 * CHUNK_WORDS + q / 2] >> shift), spread, select);
+                        s02 = _mm256_add_epi16(s02, _mm256_maddubs_epi16(ones8, _mm256_xor_si256(a0, m)));
+                        s12 = _mm256_add_epi16(s12, _mm256_maddubs_epi16(ones8, _mm256_xor_si256(a1, m)));
+                        m = byte_mask(static_cast<std::uint32_t>(b[3 * CHUNK_WORDS + q / 2] >> shift), spread, select);
+                        s03 = _mm256_add_epi16(s03, _mm256_maddubs_epi16(ones8, _mm256_xor_si256(a0, m)));
+                        s13 = _mm256_add_epi16(s13, _mm256_maddubs_epi16(ones8, _mm256_xor_si256(a1, m)));
+                    }
+                }
+
+                t00 = _mm256_add_epi32(t00, _mm256_madd_epi16(s00, ones16));
+                t01 = _mm256_add_epi32(t01, _mm256_madd_epi16(s01, ones16));
+                t02 = _mm256_add_epi32(t02, _mm256_madd_epi16(s02, ones16));
+                t03 = _mm256_add_epi32(t03, _mm256_madd_epi16(s03, ones16));
+                t10 = _mm256_add_epi32(t10, _mm256_madd_epi16(s10, ones16));
+                t11 = _mm256_add_epi32(t11, _mm256_madd_epi16(s11, ones16));
+                t12 = _mm256_add_epi32(t12, _mm256_madd_epi16(s12, ones16));
+                t13 = _mm256_add_epi32(t13, _mm256_madd_epi16(s13, ones16));
+            }
+
+            c[0] = reduce(t00); c[1] = reduce(t01); c[2] = reduce(t02); c[3] = reduce(t03);
+            c[NR + 0] = reduce(t10); c[NR + 1] = reduce(t11); c[NR + 2] = reduce(t12); c[NR + 3] = reduce(t13);
+        }
+
+        /// MX x NR float microkernel. 32 bits of each of the NR columns are broadcast once, and each
+        /// 8-float vector of both rows has its 8 of them XORed into the sign bits and is added to its
+        /// own accumulator.
+        /// \param chunks - number of 256-bit chunks along K
+        /// \param x0 - first row of activations, CHUNK_BITS values per chunk
+        /// \param x1 - second row, or x0 again when there is only one
+        /// \param b - packed B micro-panel, NR chunks per step
+        /// \param c - resulting MX x NR dot products, row-major
+        inline void bwn_microkernel(std::size_t chunks, const float* x0, const float* x1,
+                                    const std::uint64_t* b, float* c)
+        {
+            static constexpr std::size_t DWORDS = CHUNK_BITS / 32;
+            // Lane l of the u-th vector takes bit 8u + l into the sign bit
+            const __m256i shifts[4] = {_mm256_setr_epi32(31, 30, 29, 28, 27, 26, 25, 24),
+                                       _mm256_setr_epi32(23, 22, 21, 20, 19, 18, 17, 16),
+                                       _mm256_setr_epi32(15, 14, 13, 12, 11, 10, 9, 8),
+                                       _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0)};
+            const __m256i sign = _mm256_set1_epi32(std::numeric_limits<std::int32_t>::min());
+
+            __m256 s00 = _mm256_setzero_ps(), s01 = s00, s02 = s00, s03 = s00;
+            __m256 s10 = s00, s11 = s00, s12 = s00, s13 = s00;
+
+            for(std::size_t k = 0; k < chunks; k++, x0 += CHUNK_BITS, x1 += CHUNK_BITS, b += NR * CHUNK_WORDS){
+                for(std::size_t d = 0; d < DWORDS; d++){
+                    const auto shift = 32 * (d % 2);
+                    const __m256i b0 = _mm256_set1_epi32(static_cast<int>(b[0 * CHUNK_WORDS + d / 2] >> shift));
+                    const __m256i b1 = _mm256_set1_epi32(static_cast<int>(b[1 * CHUNK_WORDS + d / 2] >> shift));
+                    const __m256i b2 = _mm256_set1_epi32(static_cast<int>(b[2 * CHUNK_WORDS + d / 2] >> shift));
+                    const __m256i b3 = _mm256_set1_epi32(static_cast<int>(b[3 * CHUNK_WORDS + d / 2] >> shift));
+                    for(std::size_t u = 0; u < 4; u++){
+                        const __m256 a0 = _mm256_loadu_ps(x0 + 32 * d + 8 * u);
+                        const __m256 a1 = _mm256_loadu_ps(x1 + 32 * d + 8 * u);
+
+                        __m256 m = sign_mask(b0, shifts[u], sign);
+                        s00 = _mm256_add_ps(s00, _mm256_xor_ps(a0, m));
+                        s10 = _mm256_add_ps(s10, _mm256_xor_ps(a1, m));
+                        m = sign_mask(b1, shifts[u], sign);
+                        s01 = _mm256_add_ps(s01, _mm256_xor_ps(a0, m));
+                        s11 = _mm256_add_ps(s11, _mm256_xor_ps(a1, m));
+                        m = sign_mask(b2, shifts[u], sign);
+                        s02 = _mm256_add_ps(s02, _mm256_xor_ps(a0, m));
+                        s12 = _mm256_add_ps(s12, _mm256_xor_ps(a1, m));
+                        m = sign_mask(b3, shifts[u], sign);
+                        s03 = _mm256_add_ps(s03, _mm256_xor_ps(a0, m));
+                        s13 = _mm256_add_ps(s13, _mm256_xor_ps(a1, m));
+                    }
+                }
+            }
+
+            c[0] = reduce(s00); c[1] = reduce(s01); c[2] = reduce(s02); c[3] = reduce(s03);
+            c[NR + 0] = reduce(s10); c[NR + 1] = reduce(s11); c[NR + 2] = reduce(s12); c[NR + 3] = reduce(s13);
+        }
+    } // avx2
+} // gemm
+XNOR_TARGET_POP
+
+namespace gemm{
+    template <class T>
+    inline bwn_microkernel_t<T> bwn_microkernel_for(::isa level)
+    {
+        switch(level){
+            // Without 256-bit byte shuffles and variable shifts there is nothing to gain over the scalar loop
+            case ::isa::scalar: return scalar::bwn_microkernel<T>;
+            case ::isa::sse42: return scalar::bwn_microkernel<T>;
+            case ::isa::avx2: return avx2::bwn_microkernel;
+            case ::isa::avx512: return avx2::bwn_microkernel;
+        }
+        return scalar::bwn_microkernel<T>;
+    }
+
+    /// Binary-weight microkernel for the fastest instruction set of this CPU, selected once on first use
+    template <class T>
+    inline bwn_microkernel_t<T> bwn_dispatch()
+    {
+        static const bwn_microkernel_t<T> selected = bwn_microkernel_for<T>(detect_isa());
+        return selected;
+    }
+
+    /// Throws if an int8 product over col_size values could overflow the output type R. Every sum
+    /// lies in [-128 * col_size, 128 * col_size]; float outputs are exact up to 2^24.
+    template <class T, class R>
+    inline void check_bwn_depth(std::size_t col_size)
+    {
+        if constexpr(std::is_integral<T>::value && std::is_integral<R>::value){
+            const auto limit = static_cast<std::size_t>(std::min<long long>(std::numeric_limits<R>::max(),
+                                                                            std::numeric_limits<std::int32_t>::max()));
+            if(col_size > limit / 128)
+                throw std::runtime_error("bwngemm: dot products over " + std::to_string(col_size)
+                                         + " int8 values overflow the output type");
+        }
+    }
+
+    /// Runs the blocked loops of a binary-weight product, writing x . sign(W) to a row-major output.
+    /// Tasks are NT-column tiles by MC-row blocks, column tile first, so the tasks of one tile share
+    /// its weight panels. K is split into KC-value slices whose sums are kept in the task's workspace.
+    /// \param x - rows x col_size row-major activations, std::int8_t or float
+    /// \param ldx - distance in elements between rows of x
+    /// \param pb - NR-column panels of W, as right_panels packs them
+    /// \param res - output, overwritten
+    /// \param ldc - distance in elements between output rows
+    /// \param epilogue - epilogue(value, i, j) gives the element stored at (i, j)
+    template <class T, class R, class Epilogue = identity>
+    inline void run_bwn(const T* x, std::size_t ldx, const std::uint64_t* pb, R* res, std::size_t ldc,
+                        std::size_t rows, std::size_t cols, std::size_t col_size, ::execution mode,
+                        const Epilogue& epilogue = {})
+    {
+        using A = bwn_accumulator_t<T>;
+        check_bwn_depth<T, R>(col_size);
+        if(col_size == 0){
+            for(std::size_t i = 0; i < rows; i++)
+                for(std::size_t j = 0; j < cols; j++)
+                    res[i * ldc + j] = static_cast<R>(epilogue(A(0), i, j));
+            return;
+        }
+        const auto chunks = (col_size + CHUNK_BITS - 1) / CHUNK_BITS;
+        // Chunks read straight from x. The last one, if partial, is copied into a zero-padded stage.
+        const auto full = col_size / CHUNK_BITS;
+        const auto rest = col_size % CHUNK_BITS;
+        const auto microkernel = bwn_dispatch<T>();
+
+        workspace::frame frame;
+        // The int8 microkernels sum x ^ mask = x . w - #(w = -1), so the number of -1 weights of
+        // every column is added back as each element is stored
+        A* negatives = nullptr;
+        if constexpr(std::is_integral<T>::value){
+            negatives = frame.take<A>(cols);
+            for(std::size_t j = 0; j < cols; j++){
+                auto column = pb + ((j / NR) * NR * chunks + j % NR) * CHUNK_WORDS;
+                A count = 0;
+                for(std::size_t k = 0; k < chunks; k++, column += NR * CHUNK_WORDS)
+                    for(std::size_t w = 0; w < CHUNK_WORDS; w++)
+                        count += __builtin_popcountll(column[w]);
+                negatives[j] = count;
+            }
+        }
+
+        static constexpr auto KC_CHUNKS = KC / CHUNK_BITS;
+        const auto row_blocks = (rows + MC - 1) / MC;
+        const auto col_tiles = (cols + NT - 1) / NT;
+        auto task = [&](std::size_t t){
+            const auto jt = (t / row_blocks) * NT;
+            const auto ic = (t % row_blocks) * MC;
+            const auto nt = std::min(NT, cols - jt);
+            const auto mc = std::min(MC, rows - ic);
+            workspace::frame scratch;
+            // Sums of the K slices before the last, needed only when there are several
+            const auto partial = chunks > KC_CHUNKS ? scratch.take<A>(mc * nt) : nullptr;
+            const auto stage = rest ? scratch.take_zeroed<T>(MX * CHUNK_BITS) : nullptr;
+            A sums[MX * NR];
+            A tail[MX * NR];
+            for(std::size_t pc = 0; pc < chunks; pc += KC_CHUNKS){
+                const auto kc = std::min(KC_CHUNKS, chunks - pc);
+                const bool last = pc + kc == chunks;
+                const auto direct = std::min(kc, full - pc);
+                const bool staged = direct < kc;
+                for(std::size_t ir = ic; ir < ic + mc; ir += MX){
+                    const auto m = std::min(MX, ic + mc - ir);
+                    const auto x0 = x + ir * ldx + pc * CHUNK_BITS;
+                    const auto x1 = m > 1 ? x0 + ldx : x0;
+                    if(staged)
+                        for(std::size_t r = 0; r < m; r++){
+                            const auto row = x + (ir + r) * ldx + full * CHUNK_BITS;
+                            std::copy(row, row + rest, stage + r * CHUNK_BITS);
+                        }
+                    for(std::size_t jr = jt; jr < jt + nt; jr += NR){
+                        const auto b = pb + ((jr / NR) * NR * chunks + pc * NR) * CHUNK_WORDS;
+                        const auto n = std::min(NR, jt + nt - jr);
+                        microkernel(direct, x0, x1, b, sums);
+                        if(staged){
+                            microkernel(1, stage, m > 1 ? stage + CHUNK_BITS : stage, b + direct * NR * CHUNK_WORDS, tail);
+                            for(std::size_t e = 0; e < MX * NR; e++)
+                                sums[e] += tail[e];
+                        }
+                        for(std::size_t r = 0; r < m; r++)
+                            for(std::size_t j = 0; j < n; j++){
+                                auto val = sums[r * NR + j];
+                                const auto p = partial ? partial + (ir - ic + r) * nt + (jr - jt + j) : nullptr;
+                                if(pc != 0)
+                                    val += *p;
+                                if(!last){
+                                    *p = val;
+                                    continue;
+                                }
+                                if(negatives)
+                                    val += negatives[jr + j];
+                                res[(ir + r) * ldc + jr + j] = static_cast<R>(epilogue(val, ir + r, jr + j));
+                            }
+                    }
+                }
+            }
+        };
+        if(mode == ::execution::parallel)
+            thread_pool::global().parallel_for(col_tiles * row_blocks, task);
+        else
+            for(std::size_t t = 0; t < col_tiles * row_blocks; t++)
+                task(t);
+    }
+
+    /// Calls f with the first element and row distance of e as a row-major matrix, evaluating it
+    /// into one only if it is not already
+    template <class E, class F>
+    inline void with_row_major(const E& e, F&& f)
+    {
+        using T = typename E::value_type;
+        auto&& v = xt::eval(e);
+        if(v.layout() == xt::layout_type::row_major){
+            f(v.data(), v.shape()[1]);
+            return;
+        }
+        const xt::xarray<T, xt::layout_type::row_major> copy = v;
+        f(copy.data(), copy.shape()[1]);
+    }
+
+    template <class E, class W>
+    inline void check_bwn_operands(const E& x, const W& w)
+    {
+        if(x.dimension() != 2 || w.dimension() != 2)
+            throw std::runtime_error("bwngemm: needs two matrices");
+        if(x.shape()[1] != w.shape()[0])
+            throw std::runtime_error("bwngemm: inner dimensions " + std::to_string(x.shape()[1]) + " and "
+                                     + std::to_string(w.shape()[0]) + " do not match");
+    }
+} // gemm
+
+/// Low-level binary-weight gemm on caller-owned buffers: C = x . sign(W), where every weight is
+/// +1 or -1 and the activations keep their precision, for the first and last layers of a binary
+/// net. Nothing is allocated for the inputs or the output, and no alignment is required.
+/// \param m - rows of x and C
+/// \param x - m x k row-major activations, std::int8_t or float
+/// \param ldx - distance in elements between rows of x
+/// \param w - k x n weights packed with operand_side::right
+/// \param c - C, m x n, overwritten. float, or std::int32_t / std::int16_t for int8 activations,
+///            see gemm::check_bwn_depth
+/// \param ldc - distance in elements between rows of C
+/// \param mode - sequential, or spread output tiles across the thread pool
+template <class T, class R>
+inline void bwngemm(std::size_t m, const T* x, std::size_t ldx, const packed_binary_matrix& w, R* c, std::size_t ldc,
+                    ::execution mode = ::execution::sequential){
+    workspace::frame frame;
+    const auto packed = w.shape()[0] ? gemm::right_panels(w, mode, frame) : nullptr;
+    gemm::run_bwn(x, ldx, packed, c, ldc, m, w.shape()[1], w.shape()[0], mode);
+}
+
+/// Binary-weight gemm, x . sign(W), of int8 or float activations against weights that are either
+/// prepacked or signed and packed on the call
+/// \param e - 2-D expression of std::int8_t or float activations, evaluated row-major if it is not already
+/// \param w - 2-D expression of weights of any type sign() accepts, or a matrix packed with operand_side::right
+/// \param mode - sequential, or spread packing and output tiles across the thread pool
+/// \tparam R - element type of the result: float, or std::int32_t / std::int16_t for int8 activations
+template <class R = float, class E, class W, std::enable_if_t<gemm::is_operand<W>::value, int> = 0>
+inline xt::xarray<R> bwngemm(const xt::xexpression<E>& e, const W& w, ::execution mode = ::execution::sequential){
+    const auto& x = e.derived_cast();
+    gemm::check_bwn_operands(x, w);
+    xt::xarray<R> res;
+    res.resize({x.shape()[0], w.shape()[1]});
+    workspace::frame frame;
+    const auto packed = w.shape()[0] ? gemm::right_panels(w, mode, frame) : nullptr;
+    gemm::with_row_major(x, [&](const auto* data, std::size_t ldx){
+        gemm::run_bwn(data, ldx, packed, res.data(), res.shape()[1], x.shape()[0], w.shape()[1], w.shape()[0], mode);
+    });
+    return res;
+}
+
+/// A binary-weight layer: activation(alpha(i) * beta(j) * (x . sign(W))(i, j) + bias(j)) with the
+/// scales, bias and activation applied in the write-back, see xnor_epilogue. col_scaling mean_abs
+/// takes beta from the weights, as BWN does; the activations are not signed, so there is no row scaling.
+/// \param e - 2-D expression of std::int8_t or float activations
+/// \param w - 2-D expression of weights, or a matrix packed with operand_side::right
+/// \param epilogue - scales, bias and activation, with e.shape()[0] / w.shape()[1] elements behind
+///                   every row / column pointer
+/// \param mode - sequential, or spread packing and output tiles across the thread pool
+template <class E, class W, std::enable_if_t<gemm::is_operand<W>::value, int> = 0>
+inline xt::xarray<float> bwngemm(const xt::xexpression<E>& e, const W& w, const xnor_epilogue& epilogue,
+                                 ::execution mode = ::execution::sequential){
+    const auto& x = e.derived_cast();
+    gemm::check_bwn_operands(x, w);
+    if(epilogue.row_scaling == ::scale_mode::mean_abs)
+        throw std::runtime_error("bwngemm: the activations are not binarized, pass alpha instead of row scaling");
+    xt::xarray<float> res;
+    res.resize({x.shape()[0], w.shape()[1]});
+    workspace::frame frame;
+    const float* beta = epilogue.beta;
+    const std::uint64_t* packed = nullptr;
+    if(w.shape()[0] != 0)
+        packed = epilogue.col_scaling == ::scale_mode::mean_abs ? gemm::right_panels(w, mode, frame, beta)
+                                                                : gemm::right_panels(w, mode, frame);
+    gemm::with_epilogue(epilogue, epilogue.alpha, beta, [&](const auto& scaled){
+        gemm::with_row_major(x, [&](const auto* data, std::size_t ldx){
+            gemm::run_bwn(data, ldx, packed, res.data(), res.shape()[1], x.shape()[0], w.shape()[1], w.shape()[0],
+                          mode, scaled);
+        });
+    });
+    return res;
+}
@@ -0,0 +1,243 @@
+#pragma once
+#include <array>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <xtensor/xarray.hpp>
+#include <xtensor/xexpression.hpp>
+
+#include "xnorgemm.hpp"
+
+// Operands packed once and reused across products. Packing signs every element and, for the right
+// operand, transposes it in the bit domain; for inference weights that never change this is paid
+// when the model is loaded instead of on every request, where at batch 1 it is most of the gemm.
+
+/// Which operand of a product a packed_binary_matrix is
+enum class operand_side : bool
+{
+    left = false,  // the A of A . B, its rows packed into MR-row panels
+    right = true,  // the B of A . B, its columns packed into NR-column panels
+};
+
+/// Whether packing also computes the XNOR-Net scaling factor of every packed unit
+enum class scale_mode : bool
+{
+    none = false,
+    mean_abs = true, // the mean |value| of each row of a left operand and each column of a right one
+};
+
+/// A matrix signed and packed once into the panel layout the gemm microkernel reads, to be used as
+/// an operand of xnorgemm any number of times. It holds only the packed bits, 1/32 of a float matrix.
+class packed_binary_matrix
+{
+public:
+    using shape_type = std::array<std::size_t, 2>;
+
+    packed_binary_matrix() = default;
+
+    /// Signs and packs a 2-D expression of any type sign() accepts
+    /// \param e - the matrix as it appears in the product, e.g. the k x n weights of x . W
+    /// \param side - the operand the matrix is packed for
+    /// \param mode - sequential, or spread packing across the thread pool
+    /// \param scales - whether to keep the scaling factor of every unit, see scales()
+    template <class E>
+    packed_binary_matrix(const xt::xexpression<E>& e, operand_side side, ::execution mode = ::execution::sequential,
+                         ::scale_mode scales = ::scale_mode::none)
+        : m_side(side)
+    {
+        const auto& m = e.derived_cast();
+        if(m.dimension() != 2)
+            throw std::runtime_error("packed_binary_matrix: expected a matrix, got " + std::to_string(m.dimension())
+                                     + " dimensions");
+        m_shape = {m.shape()[0], m.shape()[1]};
+        m_panels.resize(panel_words(units(), unit_bits(), lanes(side)));
+        if(scales == ::scale_mode::mean_abs)
+            m_scales.resize(units());
+        const auto means = m_scales.empty() ? nullptr : m_scales.data();
+        if(side == operand_side::left)
+            pack_panels_into(m_panels.data(), m, m_shape[0], m_shape[1], MR, mode, means);
+        else
+            pack_column_panels_into(m_panels.data(), m, NR, mode, means);
+    }
+
+    /// Signs and packs the rows of a row-major buffer, one row per packed unit: the rows of A for
+    /// operand_side::left, the columns of B for operand_side::right. A right operand is thus
+    /// packed from B transposed, the way an embedding table or a retrieval index is stored for x . table^T.
+    /// \param data - first element of the buffer, of any type sign() accepts
+    /// \param rows - number of rows, i.e. packed units
+    /// \param cols - values per row, i.e. bits per packed unit
+    /// \param ld - distance in elements between rows
+    /// \param side - the operand the buffer is packed for
+    /// \param mode - sequential, or spread packing across the thread pool
+    /// \param scales - whether to keep the scaling factor of every unit, see scales()
+    template <class T>
+    packed_binary_matrix(const T* data, std::size_t rows, std::size_t cols, std::size_t ld, operand_side side,
+                         ::execution mode = ::execution::sequential, ::scale_mode scales = ::scale_mode::none)
+        : m_panels(panel_words(rows, cols, lanes(side))),
+          m_scales(scales == ::scale_mode::mean_abs ? rows : 0),
+          m_shape(side == operand_side::left ? shape_type{rows, cols} : shape_type{cols, rows}),
+          m_side(side)
+    {
+        pack_panels_into(m_panels.data(), data, rows, cols, static_cast<std::ptrdiff_t>(ld), 1, lanes(side), mode,
+                         m_scales.empty() ? nullptr : m_scales.data());
+    }
+
+    std::size_t dimension() const { return 2; }
+    const shape_type& shape() const { return m_shape; }
+    operand_side side() const { return m_side; }
+    const panel_t& panels() const { return m_panels; }
+    /// Mean |value| of every unit, in the order of units(), if packed with scale_mode::mean_abs; else empty
+    const std::vector<float>& scales() const { return m_scales; }
+
+    /// Packed units: rows of a left operand, columns of a right one
+    std::size_t units() const { return m_side == operand_side::left ? m_shape[0] : m_shape[1]; }
+    /// Bits per packed unit, the depth of the product
+    std::size_t unit_bits() const { return m_side == operand_side::left ? m_shape[1] : m_shape[0]; }
+
+    /// Re-signs some units in place from a row-major buffer laid out as for the buffer constructor,
+    /// leaving the others as they are. Their scaling factors are updated too, if kept.
+    /// \param data - first element of the buffer
+    /// \param ld - distance in elements between rows of the buffer
+    /// \param indices - units to repack, each below units()
+    /// \param mode - sequential, or spread blocks of units across the thread pool
+    template <class T>
+    void repack(const T* data, std::size_t ld, const std::vector<std::size_t>& indices,
+                ::execution mode = ::execution::sequential)
+    {
+        const auto bits = unit_bits();
+        const auto chunks = (bits + CHUNK_BITS - 1) / CHUNK_BITS;
+        const auto R = lanes(m_side);
+        auto repack_units = [&](std::size_t t){
+            // Signed into a zeroed row so the bits past the end of the unit stay zero
+            workspace::frame frame;
+            const auto row = frame.take_zeroed<std::uint64_t>(chunks * CHUNK_WORDS);
+            for(std::size_t n = t * PACK_ROWS; n < std::min(indices.size(), (t + 1) * PACK_ROWS); n++){
+                const auto i = indices[n];
+                XTENSOR_ASSERT(i < units())
+                float sum = 0.f;
+                sign_matrix(data + i * ld, 1, bits, static_cast<std::ptrdiff_t>(ld), 1, (std::uint8_t*) row,
+                            chunks * CHUNK_WORDS * sizeof(std::uint64_t), m_scales.empty() ? nullptr : &sum);
+                if(!m_scales.empty())
+                    m_scales[i] = bits ? sum / static_cast<float>(bits) : 0.f;
+                auto panel = m_panels.data() + (i / R) * R * chunks * CHUNK_WORDS;
+                for(std::size_t k = 0; k < chunks; k++)
+                    std::memcpy(panel + (k * R + i % R) * CHUNK_WORDS, row + k * CHUNK_WORDS,
+                                CHUNK_WORDS * sizeof(std::uint64_t));
+            }
+        };
+        const auto tasks = (indices.size() + PACK_ROWS - 1) / PACK_ROWS;
+        if(mode == ::execution::parallel)
+            thread_pool::global().parallel_for(tasks, repack_units);
+        else
+            for(std::size_t t = 0; t < tasks; t++)
+                repack_units(t);
+    }
+
+private:
+    static std::size_t lanes(operand_side side) { return side == operand_side::left ? MR : NR; }
+
+    panel_t m_panels;
+    std::vector<float> m_scales;
+    shape_type m_shape = {0, 0};
+    operand_side m_side = operand_side::left;
+};
+
+namespace gemm{
+    /// What the gemm entry points multiply: 2-D expressions and prepacked matrices
+    template <class T>
+    using is_operand = std::disjunction<xt::is_xexpression<std::decay_t<T>>,
+                                        std::is_same<std::decay_t<T>, packed_binary_matrix>>;
+
+    /// MR-row panels of a left operand, packed into a buffer taken from frame if it is an expression
+    template <class E>
+    inline const std::uint64_t* left_panels(const E& e, ::execution mode, workspace::frame& frame){
+        const auto packed = frame.take<std::uint64_t>(panel_words(e.shape()[0], e.shape()[1], MR));
+        pack_panels_into(packed, e, e.shape()[0], e.shape()[1], MR, mode);
+        return packed;
+    }
+
+    inline const std::uint64_t* left_panels(const packed_binary_matrix& a, ::execution, workspace::frame&){
+        if(a.side() != operand_side::left)
+            throw std::runtime_error("xnorgemm: the left operand was packed as a right operand");
+        return a.panels().data();
+    }
+
+    /// NR-column panels of a right operand, packed into a buffer taken from frame if it is an expression
+    template <class E>
+    inline const std::uint64_t* right_panels(const E& e, ::execution mode, workspace::frame& frame){
+        const auto packed = frame.take<std::uint64_t>(panel_words(e.shape()[1], e.shape()[0], NR));
+        pack_column_panels_into(packed, e, NR, mode);
+        return packed;
+    }
+
+    inline const std::uint64_t* right_panels(const packed_binary_matrix& b, ::execution, workspace::frame&){
+        if(b.side() != operand_side::right)
+            throw std::runtime_error("xnorgemm: the right operand was packed as a left operand");
+        return b.panels().data();
+    }
+
+    /// compute_expressions where either operand may also be a packed_binary_matrix, which goes to
+    /// the microkernel as it is
+    template <class E1, class E2, class R, class Epilogue = identity>
+    inline void compute_operands(const E1& a, const E2& b, R* res, std::size_t ldc, ::execution mode,
+                                 const Epilogue& epilogue = {})
+    {
+        XTENSOR_ASSERT(a.dimension() == 2 && b.dimension() == 2)
+        const std::size_t rows = a.shape()[0], col_size = a.shape()[1], cols = b.shape()[1];
+        XTENSOR_ASSERT(b.shape()[0] == col_size)
+        if(col_size == 0){
+            for(std::size_t i = 0; i < rows; i++)
+                for(std::size_t j = 0; j < cols; j++)
+                    res[i * ldc + j] = static_cast<R>(epilogue(R(0), i, j));
+            return;
+        }
+        workspace::frame frame;
+        const auto packed_a1 = left_panels(a, mode, frame);
+        const auto packed_a2 = right_panels(b, mode, frame);
+        run(packed_a1, packed_a2, res, ldc, rows, cols, col_size, mode, epilogue);
+    }
+
+    template <class R, class E1, class E2>
+    inline xt::xarray<R> evaluate_operands(const E1& a, const E2& b, ::execution mode){
+        if(a.shape()[1] != b.shape()[0])
+            throw std::runtime_error("xnorgemm: inner dimensions " + std::to_string(a.shape()[1]) + " and "
+                                     + std::to_string(b.shape()[0]) + " do not match");
+        xt::xarray<R> res;
+        res.resize({a.shape()[0], b.shape()[1]});
+        compute_operands(a, b, res.data(), res.shape()[1], mode);
+        return res;
+    }
+} // gemm
+
+/// xnorgemm of an expression, e.g. a batch of activations, against prepacked weights. Only e1 is
+/// packed on each call.
+/// \param e1 - 2-D expression
+/// \param b - matrix packed with operand_side::right
+/// \param mode - sequential, or spread packing and output tiles across the thread pool
+template <class R = float, class E>
+inline xt::xarray<R> xnorgemm(const xt::xexpression<E>& e1, const packed_binary_matrix& b,
+                              ::execution mode = ::execution::sequential){
+    return gemm::evaluate_operands<R>(e1.derived_cast(), b, mode);
+}
+
+/// xnorgemm of prepacked weights against an expression. Only e2 is packed on each call.
+/// \param a - matrix packed with operand_side::left
+/// \param e2 - 2-D expression
+/// \param mode - sequential, or spread packing and output tiles across the thread pool
+template <class R = float, class E>
+inline xt::xarray<R> xnorgemm(const packed_binary_matrix& a, const xt::xexpression<E>& e2,
+                              ::execution mode = ::execution::sequential){
+    return gemm::evaluate_operands<R>(a, e2.derived_cast(), mode);
+}
+
+/// xnorgemm of two prepacked matrices, with no packing at all
+/// \param a - matrix packed with operand_side::left
+/// \param b - matrix packed with operand_side::right
+/// \param mode - sequential, or spread output tiles across the thread pool
+template <class R = float>
+inline xt::xarray<R> xnorgemm(const packed_binary_matrix& a, const packed_binary_matrix& b,
+                              ::execution mode = ::execution::sequential){
+    return gemm::evaluate_operands<R>(a, b, mode);
+}
@@ -0,0 +1,200 @@
+#pragma once
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#include <xtensor/xarray.hpp>
+
+#include "xnorpacked.hpp"
+
+// XNOR-Net layers: out(i, j) = activation(alpha(i) * beta(j) * (sign(x) . sign(w))(i, j) + bias(j)),
+// where alpha and beta are the mean |value| of each row of x and each column of w.
+// The scales, bias and activation are applied by the gemm as it writes each tile back, and the
+// scaling factors are summed while packing signs the operands, so the floats are read once and
+// the output is written once.
+
+/// Activation applied after the scales and bias
+enum class activation : int
+{
+    none = 0,
+    relu = 1,     // max(v, 0)
+    hardtanh = 2, // v clamped to [lower, upper]
+    prelu = 3,    // v, or v * slope when negative
+};
+
+/// What an XNOR-Net layer does to each dot product before it is stored. A null pointer leaves its term out.
+struct xnor_epilogue
+{
+    // Per output row, e.g. the scaling factor of each activation row. Ignored if row_scaling is mean_abs.
+    const float* alpha = nullptr;
+    // Per output column, e.g. the scaling factor of each filter. Ignored if col_scaling is mean_abs.
+    const float* beta = nullptr;
+    // Per output column
+    const float* bias = nullptr;
+    ::activation act = ::activation::none;
+    // Bounds of activation::hardtanh
+    float lower = -1.f;
+    float upper = 1.f;
+    // Negative slope of activation::prelu, or one per output column if slopes is set
+    float slope = 0.25f;
+    const float* slopes = nullptr;
+    // mean_abs: alpha is the mean |value| of each row of the left operand, summed while it is packed,
+    // or kept by a left packed_binary_matrix packed with scale_mode::mean_abs
+    ::scale_mode row_scaling = ::scale_mode::none;
+    // mean_abs: beta is the mean |value| of each column of the right operand, likewise
+    ::scale_mode col_scaling = ::scale_mode::none;
+};
+
+namespace gemm{
+    /// xnor_epilogue as a gemm epilogue, with the activation fixed at compile time so the write-back
+    /// does not branch on it
+    template <::activation A>
+    struct scale_epilogue
+    {
+        const float* alpha;
+        const float* beta;
+        const float* bias;
+        float lower;
+        float upper;
+        float slope;
+        const float* slopes;
+
+        template <class R>
+        float operator()(R value, std::size_t i, std::size_t j) const
+        {
+            auto v = static_cast<float>(value);
+            if(alpha)
+                v *= alpha[i];
+            if(beta)
+                v *= beta[j];
+            if(bias)
+                v += bias[j];
+            if constexpr(A == ::activation::relu)
+                return std::max(v, 0.f);
+            else if constexpr(A == ::activation::hardtanh)
+                return std::min(std::max(v, lower), upper);
+            else if constexpr(A == ::activation::prelu)
+                return v < 0.f ? v * (slopes ? slopes[j] : slope) : v;
+            else
+                return v;
+        }
+    };
+
+    /// Calls f with the scale_epilogue of p's activation
+    /// \param alpha - row scales to use in place of p.alpha
+    /// \param beta - column scales to use in place of p.beta
+    template <class F>
+    inline void with_epilogue(const xnor_epilogue& p, const float* alpha, const float* beta, F&& f)
+    {
+        switch(p.act){
+            case ::activation::none:
+                f(scale_epilogue<::activation::none>{alpha, beta, p.bias, p.lower, p.upper, p.slope, p.slopes});
+                return;
+            case ::activation::relu:
+                f(scale_epilogue<::activation::relu>{alpha, beta, p.bias, p.lower, p.upper, p.slope, p.slopes});
+                return;
+            case ::activation::hardtanh:
+                f(scale_epilogue<::activation::hardtanh>{alpha, beta, p.bias, p.lower, p.upper, p.slope, p.slopes});
+                return;
+            case ::activation::prelu:
+                f(scale_epilogue<::activation::prelu>{alpha, beta, p.bias, p.lower, p.upper, p.slope, p.slopes});
+                return;
+        }
+        throw std::runtime_error("xnorgemm: unknown activation " + std::to_string(static_cast<int>(p.act)));
+    }
+
+    /// left_panels that also gives the mean |value| of every row, summed while the expression is signed
+    template <class E>
+    inline const std::uint64_t* left_panels(const E& e, ::execution mode, workspace::frame& frame, const float*& means){
+        const auto rows = e.shape()[0], cols = e.shape()[1];
+        const auto row_means = frame.take<float>(rows);
+        const auto packed = frame.take<std::uint64_t>(panel_words(rows, cols, MR));
+        pack_panels_into(packed, e, rows, cols, MR, mode, row_means);
+        means = row_means;
+        return packed;
+    }
+
+    inline const std::uint64_t* left_panels(const packed_binary_matrix& a, ::execution mode, workspace::frame& frame,
+                                            const float*& means){
+        if(a.scales().empty())
+            throw std::runtime_error("xnorgemm: the left operand was packed without scale_mode::mean_abs");
+        means = a.scales().data();
+        return left_panels(a, mode, frame);
+    }
+
+    /// right_panels that also gives the mean |value| of every column, summed while the expression is signed
+    template <class E>
+    inline const std::uint64_t* right_panels(const E& e, ::execution mode, workspace::frame& frame, const float*& means){
+        const auto col_means = frame.take<float>(e.shape()[1]);
+        const auto packed = frame.take<std::uint64_t>(panel_words(e.shape()[1], e.shape()[0], NR));
+        pack_column_panels_into(packed, e, NR, mode, col_means);
+        means = col_means;
+        return packed;
+    }
+
+    inline const std::uint64_t* right_panels(const packed_binary_matrix& b, ::execution mode, workspace::frame& frame,
+                                             const float*& means){
+        if(b.scales().empty())
+            throw std::runtime_error("xnorgemm: the right operand was packed without scale_mode::mean_abs");
+        means = b.scales().data();
+        return right_panels(b, mode, frame);
+    }
+
+    /// Computes an XNOR-Net layer, p applied to a . b, into a caller-owned row-major buffer.
+    /// Either operand may be a 2-D expression or a packed_binary_matrix.
+    /// \param a - rows x col_size left operand
+    /// \param b - col_size x cols right operand
+    /// \param res - output, overwritten
+    /// \param ldc - distance in elements between output rows
+    /// \param p - scales, bias and activation, with rows / cols elements behind every row / column pointer
+    template <class E1, class E2, class R>
+    inline void compute_scaled(const E1& a, const E2& b, R* res, std::size_t ldc, ::execution mode,
+                               const xnor_epilogue& p)
+    {
+        XTENSOR_ASSERT(a.dimension() == 2 && b.dimension() == 2)
+        const std::size_t rows = a.shape()[0], col_size = a.shape()[1], cols = b.shape()[1];
+        XTENSOR_ASSERT(b.shape()[0] == col_size)
+        if(col_size == 0){
+            // Every dot product is 0, whatever the scales
+            with_epilogue(p, nullptr, nullptr, [&](const auto& epilogue){
+                for(std::size_t i = 0; i < rows; i++)
+                    for(std::size_t j = 0; j < cols; j++)
+                        res[i * ldc + j] = static_cast<R>(epilogue(R(0), i, j));
+            });
+            return;
+        }
+        workspace::frame frame;
+        const float* alpha = p.alpha;
+        const float* beta = p.beta;
+        const auto packed_a1 = p.row_scaling == ::scale_mode::mean_abs ? left_panels(a, mode, frame, alpha)
+                                                                        : left_panels(a, mode, frame);
+        const auto packed_a2 = p.col_scaling == ::scale_mode::mean_abs ? right_panels(b, mode, frame, beta)
+                                                                        : right_panels(b, mode, frame);
+        with_epilogue(p, alpha, beta, [&](const auto& epilogue){
+            run(packed_a1, packed_a2, res, ldc, rows, cols, col_size, mode, epilogue);
+        });
+    }
+} // gemm
+
+/// An XNOR-Net layer: activation(alpha(i) * beta(j) * (a . b)(i, j) + bias(j)) with the scales, bias and
+/// activation applied in the gemm's write-back, see xnor_epilogue.
+/// \param a - 2-D expression, e.g. a batch of activations, or a left packed_binary_matrix
+/// \param b - 2-D expression, e.g. the weights, or a right packed_binary_matrix
+/// \param epilogue - scales, bias and activation, with a.shape()[0] / b.shape()[1] elements behind
+///                   every row / column pointer
+/// \param mode - sequential, or spread packing and output tiles across the thread pool
+template <class E1, class E2,
+          std::enable_if_t<gemm::is_operand<E1>::value && gemm::is_operand<E2>::value, int> = 0>
+inline xt::xarray<float> xnorgemm(const E1& a, const E2& b, const xnor_epilogue& epilogue,
+                                  ::execution mode = ::execution::sequential){
+    if(a.dimension() != 2 || b.dimension() != 2)
+        throw std::runtime_error("xnorgemm: needs two matrices");
+    if(a.shape()[1] != b.shape()[0])
+        throw std::runtime_error("xnorgemm: inner dimensions " + std::to_string(a.shape()[1]) + " and "
+                                 + std::to_string(b.shape()[0]) + " do not match");
+    xt::xarray<float> res;
+    res.resize({a.shape()[0], b.shape()[1]});
+    gemm::compute_scaled(a, b, res.data(), res.shape()[1], mode, epilogue);
+    return res;
+}